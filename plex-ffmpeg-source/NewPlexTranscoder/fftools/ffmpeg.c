@@ -105,6 +105,7 @@
 #include "cmdutils.h"
 
 #include "libavutil/avassert.h"
+#include "libavutil/trace.h" //PLEX
 
 //PLEX
 #include "plex.h"
@@ -164,6 +165,9 @@ static int restore_tty;
 
 #if HAVE_THREADS
 static void free_input_threads(void);
+static void free_decoder_threads(void); //PLEX
+static void free_encoder_threads(void); //PLEX
+static void free_chunk_encoder(OutputStream *ost); //PLEX
 #endif
 
 /* sub2video hack:
@@ -226,6 +230,11 @@ static void sub2video_push_ref(InputStream *ist, int64_t pts)
     av_assert1(frame->data[0]);
     ist->sub2video.last_pts = frame->pts = pts;
     for (i = 0; i < ist->nb_filters; i++) {
+        if (ist->filters[i]->graph->thread) //PLEX
+            ret = filtergraph_thread_send(ist->filters[i], frame, AV_NOPTS_VALUE,
+                                          AV_BUFFERSRC_FLAG_KEEP_REF |
+                                          AV_BUFFERSRC_FLAG_PUSH);
+        else
         ret = av_buffersrc_add_frame_flags(ist->filters[i]->filter, frame,
                                            AV_BUFFERSRC_FLAG_KEEP_REF |
                                            AV_BUFFERSRC_FLAG_PUSH);
@@ -294,7 +303,9 @@ static void sub2video_heartbeat(InputStream *ist, int64_t pts)
         if (pts2 >= ist2->sub2video.end_pts || !ist2->sub2video.frame->data[0])
             sub2video_update(ist2, NULL);
         for (j = 0, nb_reqs = 0; j < ist2->nb_filters; j++)
-            nb_reqs += av_buffersrc_get_nb_failed_requests(ist2->filters[j]->filter);
+            nb_reqs += ist2->filters[j]->graph->thread ? //PLEX
+                       filtergraph_thread_failed_requests(ist2->filters[j]) : //PLEX
+                       av_buffersrc_get_nb_failed_requests(ist2->filters[j]->filter);
         if (nb_reqs)
             sub2video_push_ref(ist2, pts2);
     }
@@ -308,6 +319,9 @@ static void sub2video_flush(InputStream *ist)
     if (ist->sub2video.end_pts < INT64_MAX)
         sub2video_update(ist, NULL);
     for (i = 0; i < ist->nb_filters; i++) {
+        if (ist->filters[i]->graph->thread) //PLEX
+            ret = filtergraph_thread_send(ist->filters[i], NULL, AV_NOPTS_VALUE, 0);
+        else
         ret = av_buffersrc_add_frame(ist->filters[i]->filter, NULL);
         if (ret != AVERROR_EOF && ret < 0)
             av_log(NULL, AV_LOG_WARNING, "Flush the frame error.\n");
@@ -483,6 +497,10 @@ static void ffmpeg_cleanup(int ret)
 {
     int i, j;
 
+#if HAVE_THREADS
+    free_encoder_threads(); //PLEX
+#endif
+
     if (do_benchmark) {
         int maxrss = getmaxrss() / 1024;
         av_log(NULL, AV_LOG_INFO, "bench: maxrss=%ikB\n", maxrss);
@@ -490,6 +508,7 @@ static void ffmpeg_cleanup(int ret)
 
     for (i = 0; i < nb_filtergraphs; i++) {
         FilterGraph *fg = filtergraphs[i];
+        free_filtergraph_thread(fg); //PLEX
         avfilter_graph_free(&fg->graph);
         for (j = 0; j < fg->nb_inputs; j++) {
             while (av_fifo_size(fg->inputs[j]->frame_queue)) {
@@ -540,6 +559,7 @@ static void ffmpeg_cleanup(int ret)
             avio_closep(&s->pb);
         avformat_free_context(s);
         av_dict_free(&of->opts);
+        av_dict_free(&of->header_opts); //PLEX
 
         av_freep(&output_files[i]);
     }
@@ -586,6 +606,7 @@ static void ffmpeg_cleanup(int ret)
     }
 #if HAVE_THREADS
     free_input_threads();
+    free_decoder_threads(); //PLEX
 #endif
     for (i = 0; i < nb_input_files; i++) {
         avformat_close_input(&input_files[i]->ctx);
@@ -623,6 +644,8 @@ static void ffmpeg_cleanup(int ret)
 
     uninit_opts();
 
+    plex_uninit(); //PLEX
+
     avformat_network_deinit();
 
     if (received_sigterm) {
@@ -692,6 +715,7 @@ static void write_packet(OutputFile *of, AVPacket *pkt, OutputStream *ost, int u
     InputFile *f = ist ? input_files [ist->file_index] : NULL;
     int ret;
     int64_t dts_diff; // <PLEX
+    PlexStageClock clock; //PLEX
 
     /*
      * Audio encoders may split the packets --  #frames in != #packets out.
@@ -827,7 +851,11 @@ static void write_packet(OutputFile *of, AVPacket *pkt, OutputStream *ost, int u
               );
     }
 
+    plex_stage_begin(&clock); //PLEX
+    avpriv_trace_begin("mux", pkt->pts); //PLEX
     ret = av_interleaved_write_frame(s, pkt);
+    avpriv_trace_end("mux", AV_NOPTS_VALUE); //PLEX
+    plex_stage_end(&ost->plex_times, PLEX_STAGE_MUX, &clock); //PLEX
     if (ret < 0) {
         print_error("av_interleaved_write_frame()", ret);
         main_return_code = 1;
@@ -922,12 +950,676 @@ static int check_recording_time(OutputStream *ost)
     return 1;
 }
 
+//PLEX
+#if HAVE_THREADS
+/* With -threaded_encode, the audio and video encoders of every output stream
+ * run on threads of their own, so that encoders of different streams overlap
+ * with each other and with decoding and filtering. do_audio_out() and
+ * do_video_out() queue frames for the thread; the packets it produces are
+ * collected on the main thread, in encoding (dts) order, and go through
+ * output_packet() as before. */
+#define ENCODER_THREAD_FRAMES 4
+
+typedef struct EncoderThread {
+    OutputStream *ost;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    AVFifoBuffer *frames;       ///< AVFrame*, main thread -> encoder, NULL to flush
+    AVFifoBuffer *packets;      ///< AVPacket, encoder -> main thread
+    int error;                  ///< first error of the encoder
+    int eof;                    ///< the encoder has been flushed
+    int exiting;
+} EncoderThread;
+
+static int encoder_thread_push(EncoderThread *et, AVPacket *pkt)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&et->lock);
+    if (av_fifo_space(et->packets) < sizeof(*pkt))
+        ret = av_fifo_grow(et->packets, av_fifo_size(et->packets));
+    if (ret >= 0) {
+        av_fifo_generic_write(et->packets, pkt, sizeof(*pkt), NULL);
+        pthread_cond_broadcast(&et->cond);
+    }
+    pthread_mutex_unlock(&et->lock);
+    return ret;
+}
+
+static void *encoder_thread(void *arg)
+{
+    EncoderThread *et = arg;
+    OutputStream *ost = et->ost;
+    AVCodecContext *enc = ost->enc_ctx;
+    AVFrame *frame;
+    AVPacket pkt;
+    PlexStageClock clock;
+    int64_t pts;
+    int ret;
+
+    pthread_mutex_lock(&et->lock);
+    while (1) {
+        while (!et->exiting && !av_fifo_size(et->frames))
+            pthread_cond_wait(&et->cond, &et->lock);
+        if (et->exiting)
+            break;
+        av_fifo_generic_read(et->frames, &frame, sizeof(frame), NULL);
+        pthread_cond_broadcast(&et->cond);
+        if (et->error || et->eof) {
+            av_frame_free(&frame);
+            continue;
+        }
+        pthread_mutex_unlock(&et->lock);
+
+        pts = frame ? frame->pts : AV_NOPTS_VALUE;
+        avpriv_trace_begin("encoder_thread", pts);
+        plex_stage_begin(&clock);
+        ret = avcodec_send_frame(enc, frame);
+        plex_stage_end(&ost->plex_times, PLEX_STAGE_ENCODE, &clock);
+        av_frame_free(&frame);
+
+        while (ret >= 0) {
+            av_init_packet(&pkt);
+            pkt.data = NULL;
+            pkt.size = 0;
+
+            plex_stage_begin(&clock);
+            ret = avcodec_receive_packet(enc, &pkt);
+            plex_stage_end(&ost->plex_times, PLEX_STAGE_ENCODE, &clock);
+            if (ret < 0)
+                break;
+
+            // Same as do_video_out(), where sync_opts is the pts of the frame.
+            if (enc->codec_type == AVMEDIA_TYPE_VIDEO &&
+                pkt.pts == AV_NOPTS_VALUE && !(enc->codec->capabilities & AV_CODEC_CAP_DELAY))
+                pkt.pts = pts;
+            if (ost->logfile && enc->stats_out)
+                fprintf(ost->logfile, "%s", enc->stats_out);
+
+            if ((ret = encoder_thread_push(et, &pkt)) < 0)
+                av_packet_unref(&pkt);
+        }
+        avpriv_trace_end("encoder_thread", AV_NOPTS_VALUE);
+
+        pthread_mutex_lock(&et->lock);
+        if (ret == AVERROR_EOF)
+            et->eof = 1;
+        else if (ret != AVERROR(EAGAIN))
+            et->error = ret;
+        pthread_cond_broadcast(&et->cond);
+    }
+    pthread_mutex_unlock(&et->lock);
+
+    return NULL;
+}
+
+static void free_encoder_thread(OutputStream *ost)
+{
+    EncoderThread *et = ost->enc_thread;
+    AVFrame *frame;
+    AVPacket pkt;
+
+    if (!et)
+        return;
+
+    pthread_mutex_lock(&et->lock);
+    et->exiting = 1;
+    pthread_cond_broadcast(&et->cond);
+    pthread_mutex_unlock(&et->lock);
+    pthread_join(et->thread, NULL);
+
+    while (av_fifo_size(et->frames)) {
+        av_fifo_generic_read(et->frames, &frame, sizeof(frame), NULL);
+        av_frame_free(&frame);
+    }
+    while (av_fifo_size(et->packets)) {
+        av_fifo_generic_read(et->packets, &pkt, sizeof(pkt), NULL);
+        av_packet_unref(&pkt);
+    }
+    av_fifo_freep(&et->frames);
+    av_fifo_freep(&et->packets);
+    pthread_cond_destroy(&et->cond);
+    pthread_mutex_destroy(&et->lock);
+    av_freep(&ost->enc_thread);
+}
+
+static void free_encoder_threads(void)
+{
+    int i;
+
+    for (i = 0; i < nb_output_streams; i++)
+        if (output_streams[i]) {
+            free_encoder_thread(output_streams[i]);
+            free_chunk_encoder(output_streams[i]);
+        }
+}
+
+static int init_encoder_thread(OutputStream *ost)
+{
+    EncoderThread *et;
+    int ret;
+
+    if (!(et = av_mallocz(sizeof(*et))))
+        return AVERROR(ENOMEM);
+    et->ost     = ost;
+    et->frames  = av_fifo_alloc_array(ENCODER_THREAD_FRAMES, sizeof(AVFrame*));
+    et->packets = av_fifo_alloc_array(ENCODER_THREAD_FRAMES, sizeof(AVPacket));
+    if (!et->frames || !et->packets) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    pthread_mutex_init(&et->lock, NULL);
+    pthread_cond_init(&et->cond, NULL);
+
+    if ((ret = pthread_create(&et->thread, NULL, encoder_thread, et))) {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        pthread_cond_destroy(&et->cond);
+        pthread_mutex_destroy(&et->lock);
+        ret = AVERROR(ret);
+        goto fail;
+    }
+    ost->enc_thread = et;
+    return 0;
+
+fail:
+    av_fifo_freep(&et->frames);
+    av_fifo_freep(&et->packets);
+    av_free(et);
+    return ret;
+}
+
+/* Pass a packet from an encoder thread, in encoder time base, to the muxer. */
+static void encoder_thread_output(OutputFile *of, OutputStream *ost, AVPacket *pkt)
+{
+    AVCodecContext *enc = ost->enc_ctx;
+    int pkt_size;
+
+    av_packet_rescale_ts(pkt, enc->time_base, ost->mux_timebase);
+    if (debug_ts) {
+        av_log(NULL, AV_LOG_INFO, "encoder -> type:%s "
+               "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
+               av_get_media_type_string(enc->codec_type),
+               av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, &ost->mux_timebase),
+               av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, &ost->mux_timebase));
+    }
+    pkt_size = pkt->size;
+    output_packet(of, pkt, ost, 0);
+    if (enc->codec_type == AVMEDIA_TYPE_VIDEO && vstats_filename)
+        do_video_stats(ost, pkt_size);
+}
+
+/*
+ * Pass the packets the encoder thread of ost has finished to the muxer. If
+ * flush is set, wait until the encoder is drained and, if it is greater than
+ * one, also flush the bitstream filters.
+ */
+static void encoder_thread_receive(OutputFile *of, OutputStream *ost, int flush)
+{
+    EncoderThread *et = ost->enc_thread;
+    AVCodecContext *enc = ost->enc_ctx;
+    AVPacket pkt;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock(&et->lock);
+        while (flush && !av_fifo_size(et->packets) && !et->eof && !et->error)
+            pthread_cond_wait(&et->cond, &et->lock);
+        if (!av_fifo_size(et->packets)) {
+            ret = et->error ? et->error : et->eof ? AVERROR_EOF : 0;
+            pthread_mutex_unlock(&et->lock);
+            break;
+        }
+        av_fifo_generic_read(et->packets, &pkt, sizeof(pkt), NULL);
+        pthread_mutex_unlock(&et->lock);
+
+        if (flush && (ost->finished & MUXER_FINISHED)) {
+            av_packet_unref(&pkt);
+            continue;
+        }
+
+        encoder_thread_output(of, ost, &pkt);
+    }
+
+    if (ret < 0 && ret != AVERROR_EOF) {
+        av_log(NULL, AV_LOG_FATAL, "%s encoding failed: %s\n",
+               av_get_media_type_string(enc->codec_type), av_err2str(ret));
+        exit_program(1);
+    }
+    if (flush > 1 && ret == AVERROR_EOF) {
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        output_packet(of, &pkt, ost, 1);
+    }
+}
+
+/* Queue frame (NULL to flush) for the encoder thread of ost. */
+static void encoder_thread_send(OutputFile *of, OutputStream *ost, AVFrame *frame)
+{
+    EncoderThread *et;
+    AVFrame *ref = NULL;
+    int ret;
+
+    if (!ost->enc_thread && (ret = init_encoder_thread(ost)) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Could not start the encoder thread: %s\n",
+               av_err2str(ret));
+        exit_program(1);
+    }
+    et = ost->enc_thread;
+
+    if (frame && !(ref = av_frame_clone(frame))) {
+        av_log(NULL, AV_LOG_FATAL, "Could not queue a frame for encoding\n");
+        exit_program(1);
+    }
+
+    pthread_mutex_lock(&et->lock);
+    while (av_fifo_space(et->frames) < sizeof(ref) && !et->error)
+        pthread_cond_wait(&et->cond, &et->lock);
+    if (et->error)
+        av_frame_free(&ref);
+    else
+        av_fifo_generic_write(et->frames, &ref, sizeof(ref), NULL);
+    pthread_cond_broadcast(&et->cond);
+    pthread_mutex_unlock(&et->lock);
+
+    encoder_thread_receive(of, ost, 0);
+}
+#endif
+//PLEX
+
+//PLEX
+/* Open a new encoder with the settings of the one of ost; thread_count
+ * overrides the number of threads if it is not 0. */
+static int open_encoder_copy(OutputStream *ost, int thread_count, AVCodecContext **penc)
+{
+    AVCodecContext *enc_ctx = avcodec_alloc_context3(ost->enc);
+    int ret;
+
+    if (!enc_ctx)
+        return AVERROR(ENOMEM);
+
+FF_DISABLE_DEPRECATION_WARNINGS
+    ret = avcodec_copy_context(enc_ctx, ost->enc_ctx);
+FF_ENABLE_DEPRECATION_WARNINGS
+    if (ret < 0)
+        goto fail;
+    // Owned by the old context; the encoder sets them up again when opened.
+    enc_ctx->stats_out = NULL;
+    av_freep(&enc_ctx->extradata);
+    enc_ctx->extradata_size = 0;
+    if (ost->enc_ctx->hw_device_ctx) {
+        enc_ctx->hw_device_ctx = av_buffer_ref(ost->enc_ctx->hw_device_ctx);
+        if (!enc_ctx->hw_device_ctx) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
+    if (thread_count)
+        enc_ctx->thread_count = thread_count;
+
+    ret = avcodec_open2(enc_ctx, ost->enc, NULL);
+    if (ret < 0)
+        goto fail;
+
+    *penc = enc_ctx;
+    return 0;
+
+fail:
+    avcodec_free_context(&enc_ctx);
+    return ret;
+}
+
+#if HAVE_THREADS
+/* With -chunk_encode, the video of every output stream is cut into chunks of
+ * that many seconds, and each chunk is encoded from a keyframe on by an
+ * encoder and a thread of its own. Up to -chunk_threads chunks are encoded at
+ * the same time while decoding and filtering run ahead, and the packets are
+ * passed to the muxer chunk after chunk. Frames waiting for an encoder are
+ * kept in memory: at most CHUNK_FRAMES for one chunk and
+ * CHUNK_TOTAL_FRAMES per chunk in flight altogether, beyond which the main
+ * thread waits for the encoders. */
+#define CHUNK_FRAMES       120
+#define CHUNK_TOTAL_FRAMES  60
+
+typedef struct EncoderChunk {
+    struct ChunkEncoder *ce;
+    AVCodecContext *enc;
+    pthread_t thread;
+    AVFifoBuffer *frames;       ///< AVFrame*, main thread -> encoder, NULL ends the chunk
+    AVFifoBuffer *packets;      ///< AVPacket, encoder -> main thread
+    int ended;                  ///< the last frame has been queued, main thread only
+    int done;                   ///< the encoder has been flushed or failed
+    int error;
+} EncoderChunk;
+
+typedef struct ChunkEncoder {
+    OutputStream *ost;
+    pthread_mutex_t lock;       ///< protects the fifos and flags of all chunks
+    pthread_cond_t cond;
+    EncoderChunk **chunks;      ///< chunks in flight, oldest first
+    int nb_chunks;
+    int max_chunks;
+    int thread_count;           ///< threads of each chunk encoder
+    int64_t duration;           ///< chunk length in encoder time base
+    int64_t end;                ///< pts at which the current chunk ends
+    int nb_frames;              ///< frames queued for all chunks
+    int max_frames;
+    int exiting;
+} ChunkEncoder;
+
+static void *chunk_encoder_thread(void *arg)
+{
+    EncoderChunk *c = arg;
+    ChunkEncoder *ce = c->ce;
+    OutputStream *ost = ce->ost;
+    AVFrame *frame;
+    AVPacket pkt;
+    PlexStageClock clock;
+    int64_t pts;
+    int ret = 0;
+
+    while (ret >= 0) {
+        pthread_mutex_lock(&ce->lock);
+        while (!ce->exiting && !av_fifo_size(c->frames))
+            pthread_cond_wait(&ce->cond, &ce->lock);
+        if (ce->exiting) {
+            pthread_mutex_unlock(&ce->lock);
+            break;
+        }
+        av_fifo_generic_read(c->frames, &frame, sizeof(frame), NULL);
+        if (frame) {
+            ce->nb_frames--;
+            pthread_cond_broadcast(&ce->cond);
+        }
+        pthread_mutex_unlock(&ce->lock);
+
+        pts = frame ? frame->pts : AV_NOPTS_VALUE;
+        avpriv_trace_begin("chunk_encoder_thread", pts);
+        plex_stage_begin(&clock);
+        ret = avcodec_send_frame(c->enc, frame);
+        plex_stage_end(&ost->plex_times, PLEX_STAGE_ENCODE, &clock);
+        av_frame_free(&frame);
+
+        while (ret >= 0) {
+            av_init_packet(&pkt);
+            pkt.data = NULL;
+            pkt.size = 0;
+
+            plex_stage_begin(&clock);
+            ret = avcodec_receive_packet(c->enc, &pkt);
+            plex_stage_end(&ost->plex_times, PLEX_STAGE_ENCODE, &clock);
+            if (ret < 0)
+                break;
+            if (pkt.pts == AV_NOPTS_VALUE && !(c->enc->codec->capabilities & AV_CODEC_CAP_DELAY))
+                pkt.pts = pts;
+
+            pthread_mutex_lock(&ce->lock);
+            if (av_fifo_space(c->packets) < sizeof(pkt))
+                ret = av_fifo_grow(c->packets, av_fifo_size(c->packets));
+            if (ret >= 0)
+                av_fifo_generic_write(c->packets, &pkt, sizeof(pkt), NULL);
+            else
+                av_packet_unref(&pkt);
+            pthread_cond_broadcast(&ce->cond);
+            pthread_mutex_unlock(&ce->lock);
+        }
+        avpriv_trace_end("chunk_encoder_thread", AV_NOPTS_VALUE);
+        if (ret == AVERROR(EAGAIN))
+            ret = 0;
+    }
+
+    pthread_mutex_lock(&ce->lock);
+    // Frames left after a failure no longer count against the limit.
+    while (av_fifo_size(c->frames)) {
+        av_fifo_generic_read(c->frames, &frame, sizeof(frame), NULL);
+        if (frame)
+            ce->nb_frames--;
+        av_frame_free(&frame);
+    }
+    c->done = 1;
+    if (ret != AVERROR_EOF)
+        c->error = ret;
+    pthread_cond_broadcast(&ce->cond);
+    pthread_mutex_unlock(&ce->lock);
+
+    return NULL;
+}
+
+/* The thread of the chunk must have been joined. */
+static void free_encoder_chunk(EncoderChunk **pc)
+{
+    EncoderChunk *c = *pc;
+    AVFrame *frame;
+    AVPacket pkt;
+
+    while (av_fifo_size(c->frames)) {
+        av_fifo_generic_read(c->frames, &frame, sizeof(frame), NULL);
+        av_frame_free(&frame);
+    }
+    while (av_fifo_size(c->packets)) {
+        av_fifo_generic_read(c->packets, &pkt, sizeof(pkt), NULL);
+        av_packet_unref(&pkt);
+    }
+    av_fifo_freep(&c->frames);
+    av_fifo_freep(&c->packets);
+    avcodec_free_context(&c->enc);
+    av_freep(pc);
+}
+
+static void free_chunk_encoder(OutputStream *ost)
+{
+    ChunkEncoder *ce = ost->chunk_enc;
+    int i;
+
+    if (!ce)
+        return;
+
+    pthread_mutex_lock(&ce->lock);
+    ce->exiting = 1;
+    pthread_cond_broadcast(&ce->cond);
+    pthread_mutex_unlock(&ce->lock);
+    for (i = 0; i < ce->nb_chunks; i++) {
+        pthread_join(ce->chunks[i]->thread, NULL);
+        free_encoder_chunk(&ce->chunks[i]);
+    }
+
+    av_freep(&ce->chunks);
+    pthread_cond_destroy(&ce->cond);
+    pthread_mutex_destroy(&ce->lock);
+    av_freep(&ost->chunk_enc);
+}
+
+static int init_chunk_encoder(OutputStream *ost)
+{
+    ChunkEncoder *ce;
+
+    if (!(ce = av_mallocz(sizeof(*ce))))
+        return AVERROR(ENOMEM);
+    ce->ost          = ost;
+    ce->max_chunks   = chunk_threads > 0 ? chunk_threads : av_cpu_count();
+    ce->max_frames   = ce->max_chunks * CHUNK_TOTAL_FRAMES;
+    ce->thread_count = FFMAX(ost->enc_ctx->thread_count / ce->max_chunks, 1);
+    ce->duration     = av_rescale_q(llrint(chunk_encode * AV_TIME_BASE), AV_TIME_BASE_Q,
+                                    ost->enc_ctx->time_base);
+    if (!(ce->chunks = av_mallocz_array(ce->max_chunks, sizeof(*ce->chunks)))) {
+        av_free(ce);
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&ce->lock, NULL);
+    pthread_cond_init(&ce->cond, NULL);
+    ost->chunk_enc = ce;
+    return 0;
+}
+
+static int start_encoder_chunk(ChunkEncoder *ce)
+{
+    EncoderChunk *c;
+    int ret;
+
+    if (!(c = av_mallocz(sizeof(*c))))
+        return AVERROR(ENOMEM);
+    c->ce      = ce;
+    c->frames  = av_fifo_alloc_array(ENCODER_THREAD_FRAMES, sizeof(AVFrame*));
+    c->packets = av_fifo_alloc_array(ENCODER_THREAD_FRAMES, sizeof(AVPacket));
+    if (!c->frames || !c->packets) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if ((ret = open_encoder_copy(ce->ost, ce->thread_count, &c->enc)) < 0)
+        goto fail;
+    if ((ret = pthread_create(&c->thread, NULL, chunk_encoder_thread, c))) {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        ret = AVERROR(ret);
+        goto fail;
+    }
+    ce->chunks[ce->nb_chunks++] = c;
+    return 0;
+
+fail:
+    free_encoder_chunk(&c);
+    return ret;
+}
+
+/* Queue frame (a new reference, or NULL to end the chunk) for the newest
+ * chunk, waiting while too many frames are queued already. */
+static int encoder_chunk_queue(ChunkEncoder *ce, AVFrame *frame)
+{
+    EncoderChunk *c = ce->chunks[ce->nb_chunks - 1];
+    int ret = 0;
+
+    pthread_mutex_lock(&ce->lock);
+    while (frame && !c->done &&
+           (av_fifo_size(c->frames) >= CHUNK_FRAMES * sizeof(frame) ||
+            ce->nb_frames >= ce->max_frames))
+        pthread_cond_wait(&ce->cond, &ce->lock);
+    if (frame && c->done)
+        ret = c->error < 0 ? c->error : AVERROR_BUG;
+    else if (av_fifo_space(c->frames) < sizeof(frame))
+        ret = av_fifo_grow(c->frames, av_fifo_size(c->frames));
+    if (ret >= 0) {
+        av_fifo_generic_write(c->frames, &frame, sizeof(frame), NULL);
+        if (frame)
+            ce->nb_frames++;
+        pthread_cond_broadcast(&ce->cond);
+    }
+    pthread_mutex_unlock(&ce->lock);
+    c->ended = !frame;
+    return ret;
+}
+
+/*
+ * Pass the packets of the oldest chunks to the muxer, in order, and free the
+ * chunks that are done. Wait for the oldest chunks until no more than
+ * max_chunks are left; only chunks that have ended may be waited for.
+ */
+static void chunk_encoder_receive(OutputFile *of, OutputStream *ost, int max_chunks)
+{
+    ChunkEncoder *ce = ost->chunk_enc;
+    AVPacket pkt;
+
+    while (ce->nb_chunks) {
+        EncoderChunk *c = ce->chunks[0];
+        int wait = ce->nb_chunks > max_chunks;
+        int done, error;
+
+        av_assert0(!wait || c->ended);
+        pthread_mutex_lock(&ce->lock);
+        while (wait && !av_fifo_size(c->packets) && !c->done)
+            pthread_cond_wait(&ce->cond, &ce->lock);
+        if (av_fifo_size(c->packets)) {
+            av_fifo_generic_read(c->packets, &pkt, sizeof(pkt), NULL);
+            pthread_mutex_unlock(&ce->lock);
+            if (ost->finished & MUXER_FINISHED)
+                av_packet_unref(&pkt);
+            else
+                encoder_thread_output(of, ost, &pkt);
+            continue;
+        }
+        done  = c->done;
+        error = c->error;
+        pthread_mutex_unlock(&ce->lock);
+
+        if (!done)
+            break;
+        if (error < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Video encoding failed: %s\n", av_err2str(error));
+            exit_program(1);
+        }
+        pthread_join(c->thread, NULL);
+        free_encoder_chunk(&ce->chunks[0]);
+        memmove(ce->chunks, ce->chunks + 1, --ce->nb_chunks * sizeof(*ce->chunks));
+    }
+}
+
+static void chunk_encoder_send(OutputFile *of, OutputStream *ost, AVFrame *frame)
+{
+    ChunkEncoder *ce = ost->chunk_enc;
+    AVFrame *ref;
+    int ret;
+
+    if (!ce) {
+        if ((ret = init_chunk_encoder(ost)) < 0)
+            goto fail;
+        ce = ost->chunk_enc;
+    }
+
+    if (!ce->nb_chunks || ce->chunks[ce->nb_chunks - 1]->ended || frame->pts >= ce->end) {
+        if (ce->nb_chunks && !ce->chunks[ce->nb_chunks - 1]->ended &&
+            (ret = encoder_chunk_queue(ce, NULL)) < 0)
+            goto fail;
+        chunk_encoder_receive(of, ost, ce->max_chunks - 1);
+        if ((ret = start_encoder_chunk(ce)) < 0)
+            goto fail;
+        ce->end = frame->pts + ce->duration;
+    }
+
+    if (!(ref = av_frame_clone(frame))) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if ((ret = encoder_chunk_queue(ce, ref)) < 0) {
+        av_frame_free(&ref);
+        goto fail;
+    }
+    chunk_encoder_receive(of, ost, INT_MAX);
+    return;
+
+fail:
+    av_log(NULL, AV_LOG_FATAL, "Could not queue a frame for chunked encoding: %s\n",
+           av_err2str(ret));
+    exit_program(1);
+}
+
+/* End the last chunk and pass all remaining packets to the muxer. */
+static void chunk_encoder_flush(OutputFile *of, OutputStream *ost, int flush_bsf)
+{
+    ChunkEncoder *ce = ost->chunk_enc;
+    AVPacket pkt;
+
+    if (ce->nb_chunks && !ce->chunks[ce->nb_chunks - 1]->ended &&
+        encoder_chunk_queue(ce, NULL) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Could not end the last encoding chunk\n");
+        exit_program(1);
+    }
+    chunk_encoder_receive(of, ost, 0);
+    if (flush_bsf) {
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        output_packet(of, &pkt, ost, 1);
+    }
+}
+#endif
+//PLEX
+
 static void do_audio_out(OutputFile *of, OutputStream *ost,
                          AVFrame *frame)
 {
     AVCodecContext *enc = ost->enc_ctx;
     AVPacket pkt;
     int ret;
+    PlexStageClock clock; //PLEX
 
     av_init_packet(&pkt);
     pkt.data = NULL;
@@ -951,12 +1643,25 @@ static void do_audio_out(OutputFile *of, OutputStream *ost,
                enc->time_base.num, enc->time_base.den);
     }
 
+//PLEX
+#if HAVE_THREADS
+    if (threaded_encode) {
+        encoder_thread_send(of, ost, frame);
+        return;
+    }
+#endif
+//PLEX
+
+    plex_stage_begin(&clock); //PLEX
     ret = avcodec_send_frame(enc, frame);
+    plex_stage_end(&ost->plex_times, PLEX_STAGE_ENCODE, &clock); //PLEX
     if (ret < 0)
         goto error;
 
     while (1) {
+        plex_stage_begin(&clock); //PLEX
         ret = avcodec_receive_packet(enc, &pkt);
+        plex_stage_end(&ost->plex_times, PLEX_STAGE_ENCODE, &clock); //PLEX
         if (ret == AVERROR(EAGAIN))
             break;
         if (ret < 0)
@@ -1082,6 +1787,7 @@ static void do_video_out(OutputFile *of,
     int frame_size = 0;
     InputStream *ist = NULL;
     AVFilterContext *filter = ost->filter->filter;
+    PlexStageClock clock; //PLEX
 
     if (ost->source_index >= 0)
         ist = input_streams[ost->source_index];
@@ -1301,12 +2007,33 @@ static void do_video_out(OutputFile *of,
 
         ost->frames_encoded++;
 
+//PLEX
+#if HAVE_THREADS
+        if (chunk_encode > 0 && !ost->logfile) {
+            chunk_encoder_send(of, ost, in_picture);
+            ost->sync_opts++;
+            ost->frame_number++;
+            continue;
+        }
+        if (threaded_encode) {
+            encoder_thread_send(of, ost, in_picture);
+            ost->sync_opts++;
+            ost->frame_number++;
+            continue;
+        }
+#endif
+//PLEX
+
+        plex_stage_begin(&clock); //PLEX
         ret = avcodec_send_frame(enc, in_picture);
+        plex_stage_end(&ost->plex_times, PLEX_STAGE_ENCODE, &clock); //PLEX
         if (ret < 0)
             goto error;
 
         while (1) {
+            plex_stage_begin(&clock); //PLEX
             ret = avcodec_receive_packet(enc, &pkt);
+            plex_stage_end(&ost->plex_times, PLEX_STAGE_ENCODE, &clock); //PLEX
             update_benchmark("encode_video %d.%d", ost->file_index, ost->index);
             if (ret == AVERROR(EAGAIN))
                 break;
@@ -1441,6 +2168,8 @@ static int reap_filters(int flush)
     AVFrame *filtered_frame = NULL;
     int i;
 
+    avpriv_trace_begin("reap_filters", AV_NOPTS_VALUE); //PLEX
+
     /* Reap all buffers present in the buffer sinks */
     for (i = 0; i < nb_output_streams; i++) {
         OutputStream *ost = output_streams[i];
@@ -1464,12 +2193,16 @@ static int reap_filters(int flush)
         }
 
         if (!ost->filtered_frame && !(ost->filtered_frame = av_frame_alloc())) {
+            avpriv_trace_end("reap_filters", AV_NOPTS_VALUE); //PLEX
             return AVERROR(ENOMEM);
         }
         filtered_frame = ost->filtered_frame;
 
         while (1) {
             double float_pts = AV_NOPTS_VALUE; // this is identical to filtered_frame.pts but with higher precision
+            if (ost->filter->graph->thread) //PLEX
+                ret = filtergraph_thread_get_frame(ost->filter, filtered_frame);
+            else
             ret = av_buffersink_get_frame_flags(filter, filtered_frame,
                                                AV_BUFFERSINK_FLAG_NO_REQUEST);
             if (ret < 0) {
@@ -1519,7 +2252,9 @@ static int reap_filters(int flush)
                             enc->time_base.num, enc->time_base.den);
                 }
 
+                avpriv_trace_begin("do_video_out", filtered_frame->pts); //PLEX
                 do_video_out(of, ost, filtered_frame, float_pts);
+                avpriv_trace_end("do_video_out", filtered_frame->pts); //PLEX
                 break;
             case AVMEDIA_TYPE_AUDIO:
                 if (!(enc->codec->capabilities & AV_CODEC_CAP_PARAM_CHANGE) &&
@@ -1528,7 +2263,9 @@ static int reap_filters(int flush)
                            "Audio filter graph output is not normalized and encoder does not support parameter changes\n");
                     break;
                 }
+                avpriv_trace_begin("do_audio_out", filtered_frame->pts); //PLEX
                 do_audio_out(of, ost, filtered_frame);
+                avpriv_trace_end("do_audio_out", filtered_frame->pts); //PLEX
                 break;
             default:
                 // TODO support subtitle filters
@@ -1539,6 +2276,7 @@ static int reap_filters(int flush)
         }
     }
 
+    avpriv_trace_end("reap_filters", AV_NOPTS_VALUE); //PLEX
     return 0;
 }
 
@@ -1797,7 +2535,6 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
         char url[4096];
 
         if (plexContext.progress_url) {
-            char* reply;
             int hw_state = -1;
             // Compute speed of transcode as a multiple of real-time.
             float speed = (float)(pts - last_pts) / (float)run_time;
@@ -1843,10 +2580,12 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
             if (hw_state >= 0)
                 av_strlcatf(url, sizeof(url), "&vdec_hw_status=%d", hw_state);
 
-            reply = PMS_IssueHttpRequest(url, "PUT");
+            plex_append_stage_stats(url, sizeof(url));
 
-            // Handle throttling.
-            if (reply && strstr(reply, "canThrottle")) {
+            plex_report_progress(url);
+
+            // Handle throttling, based on the newest reply received so far.
+            if (plex_can_throttle()) {
                 if (plexContext.throttle_delay == 0)
                     PMS_Log(LOG_LEVEL_DEBUG, "Throttle - Going into sloth mode.");
 
@@ -1858,7 +2597,6 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
                 plexContext.throttle_delay = 0;
             }
 
-            av_free(reply);
             lastRemaining = remainingSecs;
         }
         last_pts = pts;
@@ -2001,6 +2739,23 @@ static void flush_encoders(void)
             }
         }
 
+//PLEX
+#if HAVE_THREADS
+        if (ost->chunk_enc) {
+            chunk_encoder_flush(of, ost, 1);
+            continue;
+        }
+        if (ost->enc_thread) {
+            int flush_bsf = (enc->codec_type == AVMEDIA_TYPE_VIDEO ||
+                             enc->codec_type == AVMEDIA_TYPE_AUDIO) &&
+                            !(enc->codec_type == AVMEDIA_TYPE_AUDIO && enc->frame_size <= 1);
+            encoder_thread_send(of, ost, NULL);
+            encoder_thread_receive(of, ost, 1 + flush_bsf);
+            continue;
+        }
+#endif
+//PLEX
+
         if (enc->codec_type == AVMEDIA_TYPE_AUDIO && enc->frame_size <= 1)
             continue;
 
@@ -2011,6 +2766,7 @@ static void flush_encoders(void)
             const char *desc = NULL;
             AVPacket pkt;
             int pkt_size;
+            PlexStageClock clock; //PLEX
 
             switch (enc->codec_type) {
             case AVMEDIA_TYPE_AUDIO:
@@ -2028,6 +2784,7 @@ static void flush_encoders(void)
                 pkt.size = 0;
 
                 update_benchmark(NULL);
+                plex_stage_begin(&clock); //PLEX
 
                 while ((ret = avcodec_receive_packet(enc, &pkt)) == AVERROR(EAGAIN)) {
                     ret = avcodec_send_frame(enc, NULL);
@@ -2039,6 +2796,7 @@ static void flush_encoders(void)
                     }
                 }
 
+                plex_stage_end(&ost->plex_times, PLEX_STAGE_ENCODE, &clock); //PLEX
                 update_benchmark("flush_%s %d.%d", desc, ost->file_index, ost->index);
                 if (ret < 0 && ret != AVERROR_EOF) {
                     av_log(NULL, AV_LOG_FATAL, "%s encoding failed: %s\n",
@@ -2241,6 +2999,7 @@ static int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame)
 {
     FilterGraph *fg = ifilter->graph;
     int need_reinit, ret, i;
+    PlexStageClock clock; //PLEX
 
     /* determine if the parameters for this input changed */
     need_reinit = ifilter->format != frame->format;
@@ -2290,6 +3049,7 @@ static int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame)
             }
         }
 
+        filtergraph_thread_sync(fg); //PLEX
         ret = reap_filters(1);
         if (ret < 0 && ret != AVERROR_EOF) {
             char errbuf[128];
@@ -2306,7 +3066,15 @@ static int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame)
         }
     }
 
-    ret = av_buffersrc_add_frame_flags(ifilter->filter, frame, AV_BUFFERSRC_FLAG_PUSH);
+//PLEX
+    if (fg->thread) {
+        ret = filtergraph_thread_send(ifilter, frame, AV_NOPTS_VALUE, AV_BUFFERSRC_FLAG_PUSH);
+    } else {
+        plex_stage_begin(&clock);
+        ret = av_buffersrc_add_frame_flags(ifilter->filter, frame, AV_BUFFERSRC_FLAG_PUSH);
+        plex_stage_end(&fg->plex_times, PLEX_STAGE_FILTER, &clock);
+    }
+//PLEX
     if (ret < 0) {
         if (ret != AVERROR_EOF)
             av_log(NULL, AV_LOG_ERROR, "Error while filtering: %s\n", av_err2str(ret));
@@ -2323,6 +3091,9 @@ static int ifilter_send_eof(InputFilter *ifilter, int64_t pts)
     ifilter->eof = 1;
 
     if (ifilter->filter) {
+        if (ifilter->graph->thread) //PLEX
+            ret = filtergraph_thread_send(ifilter, NULL, pts, AV_BUFFERSRC_FLAG_PUSH);
+        else
         ret = av_buffersrc_close(ifilter->filter, pts, AV_BUFFERSRC_FLAG_PUSH);
         if (ret < 0)
             return ret;
@@ -2371,6 +3142,344 @@ static int decode(AVCodecContext *avctx, AVFrame *frame, int *got_frame, AVPacke
     return 0;
 }
 
+//PLEX
+/* The decoder context fields used around decoding. */
+typedef struct DecoderParams {
+    int has_b_frames;
+    int width, height;
+    enum AVPixelFormat pix_fmt;
+    int sample_rate;
+    int frame_size;
+    AVRational framerate;
+    int ticks_per_frame;
+} DecoderParams;
+
+static void copy_decoder_params(DecoderParams *p, const AVCodecContext *avctx)
+{
+    p->has_b_frames    = avctx->has_b_frames;
+    p->width           = avctx->width;
+    p->height          = avctx->height;
+    p->pix_fmt         = avctx->pix_fmt;
+    p->sample_rate     = avctx->sample_rate;
+    p->frame_size      = avctx->frame_size;
+    p->framerate       = avctx->framerate;
+    p->ticks_per_frame = avctx->ticks_per_frame;
+}
+
+#if HAVE_THREADS
+/* With -threaded_decode, the decoder of each audio and video stream runs on a
+ * thread of its own. The main thread still does everything around decoding
+ * (timestamps, filtering, subtitles and sub2video): decode_audio() and
+ * decode_video() hand packets to the thread and take back whatever frames it
+ * has finished, with the same send/receive semantics as decode(). Only while
+ * draining does taking a frame wait for the decoder. */
+#define DECODER_THREAD_PACKETS 8
+#define DECODER_THREAD_FRAMES  4
+
+typedef struct DecodedFrame {
+    AVFrame *frame;             ///< NULL if ret is an error or AVERROR_EOF
+    int ret;
+    DecoderParams params;       ///< the decoder context right after this result
+} DecodedFrame;
+
+typedef struct DecoderThread {
+    InputStream *ist;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    AVFifoBuffer *packets;      ///< AVPacket, main thread -> decoder
+    AVFifoBuffer *frames;       ///< DecodedFrame, decoder -> main thread
+    AVFifoBuffer *ready;        ///< DecodedFrame, moved out of frames to make room while waiting for the decoder
+    int busy;                   ///< the decoder is working on a packet
+    int exiting;
+    int draining;               ///< main thread only: sent the end of the stream, not yet received it
+    DecoderParams params;       ///< main thread only: params of the last result taken
+} DecoderThread;
+
+static int decoder_thread_push(DecoderThread *dt, AVFrame *frame, int ret)
+{
+    DecodedFrame df = { frame, ret };
+
+    pthread_mutex_lock(&dt->lock);
+    while (!dt->exiting && av_fifo_space(dt->frames) < sizeof(df))
+        pthread_cond_wait(&dt->cond, &dt->lock);
+    if (!dt->exiting) {
+        // The main thread must not read the context while we decode.
+        copy_decoder_params(&df.params, dt->ist->dec_ctx);
+        av_fifo_generic_write(dt->frames, &df, sizeof(df), NULL);
+        pthread_cond_broadcast(&dt->cond);
+    }
+    ret = dt->exiting;
+    pthread_mutex_unlock(&dt->lock);
+
+    if (ret)
+        av_frame_free(&frame);
+    return ret;
+}
+
+static void *decoder_thread(void *arg)
+{
+    DecoderThread *dt = arg;
+    InputStream *ist = dt->ist;
+    AVPacket pkt;
+    AVFrame *frame;
+    PlexStageClock clock;
+    int ret;
+
+    pthread_mutex_lock(&dt->lock);
+    while (1) {
+        while (!dt->exiting && !av_fifo_size(dt->packets))
+            pthread_cond_wait(&dt->cond, &dt->lock);
+        if (dt->exiting)
+            break;
+        av_fifo_generic_read(dt->packets, &pkt, sizeof(pkt), NULL);
+        dt->busy = 1;
+        pthread_cond_broadcast(&dt->cond);
+        pthread_mutex_unlock(&dt->lock);
+
+        avpriv_trace_begin("decoder_thread", pkt.pts);
+        // An empty packet starts draining.
+        plex_stage_begin(&clock);
+        ret = avcodec_send_packet(ist->dec_ctx, &pkt);
+        plex_stage_end(&ist->plex_times, PLEX_STAGE_DECODE, &clock);
+        av_packet_unref(&pkt);
+        if (ret < 0 && ret != AVERROR_EOF) {
+            decoder_thread_push(dt, NULL, ret);
+        } else {
+            while (1) {
+                if (!(frame = av_frame_alloc())) {
+                    decoder_thread_push(dt, NULL, AVERROR(ENOMEM));
+                    break;
+                }
+                plex_stage_begin(&clock);
+                ret = avcodec_receive_frame(ist->dec_ctx, frame);
+                plex_stage_end(&ist->plex_times, PLEX_STAGE_DECODE, &clock);
+                if (ret < 0)
+                    av_frame_free(&frame);
+                if (ret == AVERROR(EAGAIN) ||
+                    decoder_thread_push(dt, frame, ret) || ret < 0)
+                    break;
+            }
+        }
+        avpriv_trace_end("decoder_thread", AV_NOPTS_VALUE);
+
+        pthread_mutex_lock(&dt->lock);
+        dt->busy = 0;
+        pthread_cond_broadcast(&dt->cond);
+    }
+    pthread_mutex_unlock(&dt->lock);
+
+    return NULL;
+}
+
+/* Drop a DecodedFrame fifo; called with the lock held. */
+static void decoder_thread_drop_frames(AVFifoBuffer *fifo)
+{
+    DecodedFrame df;
+
+    while (av_fifo_size(fifo) >= sizeof(df)) {
+        av_fifo_generic_read(fifo, &df, sizeof(df), NULL);
+        av_frame_free(&df.frame);
+    }
+}
+
+/* Same as decode(), through the decoder thread of ist. */
+static int decoder_thread_decode(InputStream *ist, AVFrame *frame, int *got_frame, AVPacket *pkt)
+{
+    DecoderThread *dt = ist->dec_thread;
+    DecodedFrame df;
+    AVPacket ref;
+    int ret;
+
+    *got_frame = 0;
+
+    if (pkt && !(dt->draining && !pkt->size)) {
+        if (pkt->size) {
+            if ((ret = av_packet_ref(&ref, pkt)) < 0)
+                return ret;
+        } else {
+            av_init_packet(&ref);
+            ref.data = NULL;
+            ref.size = 0;
+            dt->draining = 1;
+        }
+
+        pthread_mutex_lock(&dt->lock);
+        while (av_fifo_space(dt->packets) < sizeof(ref)) {
+            // Make room for the decoder so that it can get to our packet.
+            if (av_fifo_size(dt->frames)) {
+                if (av_fifo_space(dt->ready) < av_fifo_size(dt->frames) &&
+                    av_fifo_grow(dt->ready, av_fifo_size(dt->frames)) < 0) {
+                    pthread_mutex_unlock(&dt->lock);
+                    av_packet_unref(&ref);
+                    return AVERROR(ENOMEM);
+                }
+                while (av_fifo_size(dt->frames)) {
+                    av_fifo_generic_read(dt->frames, &df, sizeof(df), NULL);
+                    av_fifo_generic_write(dt->ready, &df, sizeof(df), NULL);
+                }
+                pthread_cond_broadcast(&dt->cond);
+            } else {
+                pthread_cond_wait(&dt->cond, &dt->lock);
+            }
+        }
+        av_fifo_generic_write(dt->packets, &ref, sizeof(ref), NULL);
+        pthread_cond_broadcast(&dt->cond);
+        pthread_mutex_unlock(&dt->lock);
+    }
+
+    df.frame  = NULL;
+    df.ret    = AVERROR(EAGAIN);
+    df.params = dt->params;
+    pthread_mutex_lock(&dt->lock);
+    if (av_fifo_size(dt->ready)) {
+        av_fifo_generic_read(dt->ready, &df, sizeof(df), NULL);
+    } else {
+        while (dt->draining && !av_fifo_size(dt->frames))
+            pthread_cond_wait(&dt->cond, &dt->lock);
+        if (av_fifo_size(dt->frames)) {
+            av_fifo_generic_read(dt->frames, &df, sizeof(df), NULL);
+            pthread_cond_broadcast(&dt->cond);
+        }
+    }
+    pthread_mutex_unlock(&dt->lock);
+    dt->params = df.params;
+
+    if (!df.frame) {
+        if (df.ret == AVERROR_EOF)
+            dt->draining = 0;
+        return df.ret == AVERROR(EAGAIN) ? 0 : df.ret;
+    }
+    av_frame_move_ref(frame, df.frame);
+    av_frame_free(&df.frame);
+    *got_frame = 1;
+    return 0;
+}
+
+/* Discard everything queued for or by the decoder and flush it. */
+static void decoder_thread_flush(InputStream *ist)
+{
+    DecoderThread *dt = ist->dec_thread;
+    AVPacket pkt;
+
+    pthread_mutex_lock(&dt->lock);
+    while (av_fifo_size(dt->packets)) {
+        av_fifo_generic_read(dt->packets, &pkt, sizeof(pkt), NULL);
+        av_packet_unref(&pkt);
+    }
+    do {
+        decoder_thread_drop_frames(dt->frames);
+        pthread_cond_broadcast(&dt->cond);
+        if (dt->busy)
+            pthread_cond_wait(&dt->cond, &dt->lock);
+    } while (dt->busy);
+    decoder_thread_drop_frames(dt->frames);
+    decoder_thread_drop_frames(dt->ready);
+    // The decoder waits for a packet and cannot touch the context meanwhile.
+    avcodec_flush_buffers(ist->dec_ctx);
+    dt->draining = 0;
+    pthread_mutex_unlock(&dt->lock);
+}
+
+static void free_decoder_threads(void)
+{
+    int i;
+
+    for (i = 0; i < nb_input_streams; i++) {
+        InputStream *ist = input_streams[i];
+        DecoderThread *dt = ist->dec_thread;
+        AVPacket pkt;
+
+        if (!dt)
+            continue;
+
+        pthread_mutex_lock(&dt->lock);
+        dt->exiting = 1;
+        pthread_cond_broadcast(&dt->cond);
+        pthread_mutex_unlock(&dt->lock);
+        pthread_join(dt->thread, NULL);
+
+        while (av_fifo_size(dt->packets)) {
+            av_fifo_generic_read(dt->packets, &pkt, sizeof(pkt), NULL);
+            av_packet_unref(&pkt);
+        }
+        decoder_thread_drop_frames(dt->frames);
+        decoder_thread_drop_frames(dt->ready);
+        av_fifo_freep(&dt->packets);
+        av_fifo_freep(&dt->frames);
+        av_fifo_freep(&dt->ready);
+        pthread_cond_destroy(&dt->cond);
+        pthread_mutex_destroy(&dt->lock);
+        av_freep(&ist->dec_thread);
+    }
+}
+
+static int init_decoder_threads(void)
+{
+    int i, ret;
+
+    if (!threaded_decode)
+        return 0;
+
+    for (i = 0; i < nb_input_streams; i++) {
+        InputStream *ist = input_streams[i];
+        DecoderThread *dt;
+
+        // Hardware decoding is left on the main thread, which may fall back
+        // to software and reinitialize the decoder between two packets.
+        if (!ist->decoding_needed || ist->dec_thread ||
+            ist->hwaccel_id != HWACCEL_NONE ||
+            (ist->dec_ctx->codec_type != AVMEDIA_TYPE_AUDIO &&
+             ist->dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO))
+            continue;
+
+        if (!(dt = av_mallocz(sizeof(*dt))))
+            return AVERROR(ENOMEM);
+        dt->ist     = ist;
+        copy_decoder_params(&dt->params, ist->dec_ctx);
+        dt->packets = av_fifo_alloc_array(DECODER_THREAD_PACKETS, sizeof(AVPacket));
+        dt->frames  = av_fifo_alloc_array(DECODER_THREAD_FRAMES,  sizeof(DecodedFrame));
+        dt->ready   = av_fifo_alloc_array(DECODER_THREAD_FRAMES,  sizeof(DecodedFrame));
+        if (!dt->packets || !dt->frames || !dt->ready) {
+            av_fifo_freep(&dt->packets);
+            av_fifo_freep(&dt->frames);
+            av_fifo_freep(&dt->ready);
+            av_free(dt);
+            return AVERROR(ENOMEM);
+        }
+        pthread_mutex_init(&dt->lock, NULL);
+        pthread_cond_init(&dt->cond, NULL);
+
+        if ((ret = pthread_create(&dt->thread, NULL, decoder_thread, dt))) {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+            pthread_cond_destroy(&dt->cond);
+            pthread_mutex_destroy(&dt->lock);
+            av_fifo_freep(&dt->packets);
+            av_fifo_freep(&dt->frames);
+            av_fifo_freep(&dt->ready);
+            av_free(dt);
+            return AVERROR(ret);
+        }
+        ist->dec_thread = dt;
+    }
+    return 0;
+}
+#endif
+
+/* With a decoder thread, the context as of the last result taken from it:
+ * the thread may be changing the context itself meanwhile. */
+static void get_decoder_params(InputStream *ist, DecoderParams *p)
+{
+#if HAVE_THREADS
+    if (ist->dec_thread) {
+        *p = ist->dec_thread->params;
+        return;
+    }
+#endif
+    copy_decoder_params(p, ist->dec_ctx);
+}
+//PLEX
+
 static int send_frame_to_filters(InputStream *ist, AVFrame *decoded_frame)
 {
     int i, ret;
@@ -2404,6 +3513,8 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output,
     AVCodecContext *avctx = ist->dec_ctx;
     int ret, err = 0;
     AVRational decoded_frame_tb;
+    PlexStageClock clock; //PLEX
+    DecoderParams params; //PLEX
 
     if (!ist->decoded_frame && !(ist->decoded_frame = av_frame_alloc()))
         return AVERROR(ENOMEM);
@@ -2412,13 +3523,26 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output,
     decoded_frame = ist->decoded_frame;
 
     update_benchmark(NULL);
+    plex_stage_begin(&clock); //PLEX
+    avpriv_trace_begin("decode_audio", pkt ? pkt->pts : AV_NOPTS_VALUE); //PLEX
+//PLEX
+#if HAVE_THREADS
+    if (ist->dec_thread)
+        ret = decoder_thread_decode(ist, decoded_frame, got_output, pkt);
+    else
+#endif
+//PLEX
     ret = decode(avctx, decoded_frame, got_output, pkt);
+    avpriv_trace_end("decode_audio", pkt ? pkt->pts : AV_NOPTS_VALUE); //PLEX
+    if (!ist->dec_thread) //PLEX: the decoder thread times itself
+        plex_stage_end(&ist->plex_times, PLEX_STAGE_DECODE, &clock); //PLEX
     update_benchmark("decode_audio %d.%d", ist->file_index, ist->st->index);
     if (ret < 0)
         *decode_failed = 1;
+    get_decoder_params(ist, &params); //PLEX
 
-    if (ret >= 0 && avctx->sample_rate <= 0) {
-        av_log(avctx, AV_LOG_ERROR, "Sample rate %d invalid\n", avctx->sample_rate);
+    if (ret >= 0 && params.sample_rate <= 0) { //PLEX
+        av_log(avctx, AV_LOG_ERROR, "Sample rate %d invalid\n", params.sample_rate); //PLEX
         ret = AVERROR_INVALIDDATA;
     }
 
@@ -2435,10 +3559,18 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output,
     /* increment next_dts to use for the case where the input stream does not
        have timestamps or there are multiple frames in the packet */
     ist->next_pts += ((int64_t)AV_TIME_BASE * decoded_frame->nb_samples) /
-                     avctx->sample_rate;
+                     params.sample_rate; //PLEX
     ist->next_dts += ((int64_t)AV_TIME_BASE * decoded_frame->nb_samples) /
-                     avctx->sample_rate;
+                     params.sample_rate; //PLEX
 #endif
+//PLEX
+    /* The decoder thread may return frames of packets sent before this one,
+     * so go by the end of the frame rather than add it on to the packet. */
+    if (ist->dec_thread && decoded_frame->pts != AV_NOPTS_VALUE)
+        ist->next_pts = ist->next_dts =
+            av_rescale_q(decoded_frame->pts, ist->st->time_base, AV_TIME_BASE_Q) +
+            ((int64_t)AV_TIME_BASE * decoded_frame->nb_samples) / params.sample_rate;
+//PLEX
 
     if (decoded_frame->pts != AV_NOPTS_VALUE) {
         decoded_frame_tb   = ist->st->time_base;
@@ -2451,8 +3583,8 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output,
     }
     if (decoded_frame->pts != AV_NOPTS_VALUE)
         decoded_frame->pts = av_rescale_delta(decoded_frame_tb, decoded_frame->pts,
-                                              (AVRational){1, avctx->sample_rate}, decoded_frame->nb_samples, &ist->filter_in_rescale_delta_last,
-                                              (AVRational){1, avctx->sample_rate});
+                                              (AVRational){1, params.sample_rate}, decoded_frame->nb_samples, &ist->filter_in_rescale_delta_last,
+                                              (AVRational){1, params.sample_rate}); //PLEX
     ist->nb_samples = decoded_frame->nb_samples;
     err = send_frame_to_filters(ist, decoded_frame);
 
@@ -2468,6 +3600,8 @@ static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output, int64_
     int i, ret = 0, err = 0;
     int64_t best_effort_timestamp;
     int64_t dts = AV_NOPTS_VALUE;
+    PlexStageClock clock; //PLEX
+    DecoderParams params; //PLEX
     AVPacket avpkt;
 
     // With fate-indeo3-2, we're getting 0-sized packets before EOF for some
@@ -2504,23 +3638,36 @@ static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output, int64_
 //PLEX
 
     update_benchmark(NULL);
+    plex_stage_begin(&clock); //PLEX
+    avpriv_trace_begin("decode_video", pkt ? pkt->pts : AV_NOPTS_VALUE); //PLEX
+//PLEX
+#if HAVE_THREADS
+    if (ist->dec_thread)
+        ret = decoder_thread_decode(ist, decoded_frame, got_output, pkt ? &avpkt : NULL);
+    else
+#endif
+//PLEX
     ret = decode(ist->dec_ctx, decoded_frame, got_output, pkt ? &avpkt : NULL);
+    avpriv_trace_end("decode_video", pkt ? pkt->pts : AV_NOPTS_VALUE); //PLEX
+    if (!ist->dec_thread) //PLEX: the decoder thread times itself
+        plex_stage_end(&ist->plex_times, PLEX_STAGE_DECODE, &clock); //PLEX
     update_benchmark("decode_video %d.%d", ist->file_index, ist->st->index);
     if (ret < 0)
         *decode_failed = 1;
+    get_decoder_params(ist, &params); //PLEX
 
     // The following line may be required in some cases where there is no parser
     // or the parser does not has_b_frames correctly
-    if (ist->st->codecpar->video_delay < ist->dec_ctx->has_b_frames) {
+    if (ist->st->codecpar->video_delay < params.has_b_frames) { //PLEX
         if (ist->dec_ctx->codec_id == AV_CODEC_ID_H264) {
-            ist->st->codecpar->video_delay = ist->dec_ctx->has_b_frames;
+            ist->st->codecpar->video_delay = params.has_b_frames; //PLEX
         } else
             av_log(ist->dec_ctx, AV_LOG_WARNING,
                    "video_delay is larger in decoder than demuxer %d > %d.\n"
                    "If you want to help, upload a sample "
                    "of this file to ftp://upload.ffmpeg.org/incoming/ "
                    "and contact the ffmpeg-devel mailing list. (ffmpeg-devel@ffmpeg.org)\n",
-                   ist->dec_ctx->has_b_frames,
+                   params.has_b_frames, //PLEX
                    ist->st->codecpar->video_delay);
     }
 
@@ -2564,16 +3711,16 @@ static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output, int64_
 //PLEX
 
     if (*got_output && ret >= 0) {
-        if (ist->dec_ctx->width  != decoded_frame->width ||
-            ist->dec_ctx->height != decoded_frame->height ||
-            ist->dec_ctx->pix_fmt != decoded_frame->format) {
+        if (params.width  != decoded_frame->width || //PLEX
+            params.height != decoded_frame->height || //PLEX
+            params.pix_fmt != decoded_frame->format) { //PLEX
             av_log(NULL, AV_LOG_DEBUG, "Frame parameters mismatch context %d,%d,%d != %d,%d,%d\n",
                 decoded_frame->width,
                 decoded_frame->height,
                 decoded_frame->format,
-                ist->dec_ctx->width,
-                ist->dec_ctx->height,
-                ist->dec_ctx->pix_fmt);
+                params.width, //PLEX
+                params.height, //PLEX
+                params.pix_fmt); //PLEX
         }
     }
 
@@ -2640,8 +3787,12 @@ static int transcode_subtitles(InputStream *ist, AVPacket *pkt, int *got_output,
 {
     AVSubtitle subtitle;
     int free_sub = 1;
-    int i, ret = avcodec_decode_subtitle2(ist->dec_ctx,
-                                          &subtitle, got_output, pkt);
+    int i, ret;
+    PlexStageClock clock; //PLEX
+
+    plex_stage_begin(&clock); //PLEX
+    ret = avcodec_decode_subtitle2(ist->dec_ctx, &subtitle, got_output, pkt);
+    plex_stage_end(&ist->plex_times, PLEX_STAGE_DECODE, &clock); //PLEX
 
     check_decode_result(NULL, got_output, ret);
 
@@ -2735,10 +3886,12 @@ static int process_input_packet(InputStream *ist, const AVPacket *pkt, int no_eo
     int ret = 0, i;
     int repeating = 0;
     int eof_reached = 0;
+    DecoderParams params; //PLEX
 
     AVPacket avpkt;
+    get_decoder_params(ist, &params); //PLEX
     if (!ist->saw_first_ts) {
-        ist->dts = ist->st->avg_frame_rate.num ? - ist->dec_ctx->has_b_frames * AV_TIME_BASE / av_q2d(ist->st->avg_frame_rate) : 0;
+        ist->dts = ist->st->avg_frame_rate.num ? - params.has_b_frames * AV_TIME_BASE / av_q2d(ist->st->avg_frame_rate) : 0; //PLEX
         ist->pts = 0;
         if (pkt && pkt->pts != AV_NOPTS_VALUE && !ist->decoding_needed) {
             ist->dts += av_rescale_q(pkt->pts, ist->st->time_base, AV_TIME_BASE_Q);
@@ -2785,14 +3938,17 @@ static int process_input_packet(InputStream *ist, const AVPacket *pkt, int no_eo
         case AVMEDIA_TYPE_VIDEO:
             ret = decode_video    (ist, repeating ? NULL : &avpkt, &got_output, &duration_pts, !pkt,
                                    &decode_failed);
-            if (!repeating || !pkt || got_output) {
+            get_decoder_params(ist, &params); //PLEX
+            // PLEX: a decoder thread may return frames of earlier packets
+            // with this one, which must not move next_dts further
+            if (!repeating || !pkt || (got_output && !ist->dec_thread)) {
                 if (pkt && pkt->duration) {
                     duration_dts = av_rescale_q(pkt->duration, ist->st->time_base, AV_TIME_BASE_Q);
-                } else if(ist->dec_ctx->framerate.num != 0 && ist->dec_ctx->framerate.den != 0) {
-                    int ticks= av_stream_get_parser(ist->st) ? av_stream_get_parser(ist->st)->repeat_pict+1 : ist->dec_ctx->ticks_per_frame;
+                } else if(params.framerate.num != 0 && params.framerate.den != 0) { //PLEX
+                    int ticks= av_stream_get_parser(ist->st) ? av_stream_get_parser(ist->st)->repeat_pict+1 : params.ticks_per_frame; //PLEX
                     duration_dts = ((int64_t)AV_TIME_BASE *
-                                    ist->dec_ctx->framerate.den * ticks) /
-                                    ist->dec_ctx->framerate.num / ist->dec_ctx->ticks_per_frame;
+                                    params.framerate.den * ticks) /
+                                    params.framerate.num / params.ticks_per_frame; //PLEX
                 }
 
                 if(ist->dts != AV_NOPTS_VALUE && duration_dts) {
@@ -2873,8 +4029,8 @@ static int process_input_packet(InputStream *ist, const AVPacket *pkt, int no_eo
         ist->dts = ist->next_dts;
         switch (ist->dec_ctx->codec_type) {
         case AVMEDIA_TYPE_AUDIO:
-            ist->next_dts += ((int64_t)AV_TIME_BASE * ist->dec_ctx->frame_size) /
-                             ist->dec_ctx->sample_rate;
+            ist->next_dts += ((int64_t)AV_TIME_BASE * params.frame_size) /
+                             params.sample_rate; //PLEX
             break;
         case AVMEDIA_TYPE_VIDEO:
             if (ist->framerate.num) {
@@ -2884,11 +4040,11 @@ static int process_input_packet(InputStream *ist, const AVPacket *pkt, int no_eo
                 ist->next_dts = av_rescale_q(next_dts + 1, av_inv_q(ist->framerate), time_base_q);
             } else if (pkt->duration) {
                 ist->next_dts += av_rescale_q(pkt->duration, ist->st->time_base, AV_TIME_BASE_Q);
-            } else if(ist->dec_ctx->framerate.num != 0) {
-                int ticks= av_stream_get_parser(ist->st) ? av_stream_get_parser(ist->st)->repeat_pict + 1 : ist->dec_ctx->ticks_per_frame;
+            } else if(params.framerate.num != 0) { //PLEX
+                int ticks= av_stream_get_parser(ist->st) ? av_stream_get_parser(ist->st)->repeat_pict + 1 : params.ticks_per_frame; //PLEX
                 ist->next_dts += ((int64_t)AV_TIME_BASE *
-                                  ist->dec_ctx->framerate.den * ticks) /
-                                  ist->dec_ctx->framerate.num / ist->dec_ctx->ticks_per_frame;
+                                  params.framerate.den * ticks) /
+                                  params.framerate.num / params.ticks_per_frame; //PLEX
             }
             break;
         }
@@ -3087,8 +4243,13 @@ static int init_input_stream(int ist_index, char *error, int error_len)
          * audio, and video decoders such as cuvid or mediacodec */
         ist->dec_ctx->pkt_timebase = ist->st->time_base;
 
-        if (!av_dict_get(ist->decoder_opts, "threads", NULL, 0))
+        if (!av_dict_get(ist->decoder_opts, "threads", NULL, 0)) {
+            int threads = ist->dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ? plex_thread_share(PLEX_STAGE_DECODE) : 0; //PLEX
+            if (threads) //PLEX
+                av_dict_set_int(&ist->decoder_opts, "threads", threads, 0); //PLEX
+            else //PLEX
             av_dict_set(&ist->decoder_opts, "threads", "auto", 0);
+        }
         /* Attached pics are sparse, therefore we would not want to delay their decoding till EOF. */
         if (ist->st->disposition & AV_DISPOSITION_ATTACHED_PIC)
             av_dict_set(&ist->decoder_opts, "threads", "1", 0);
@@ -3631,8 +4792,13 @@ static int init_output_stream(OutputStream *ost, char *error, int error_len)
             memcpy(ost->enc_ctx->subtitle_header, dec->subtitle_header, dec->subtitle_header_size);
             ost->enc_ctx->subtitle_header_size = dec->subtitle_header_size;
         }
-        if (!av_dict_get(ost->encoder_opts, "threads", NULL, 0))
+        if (!av_dict_get(ost->encoder_opts, "threads", NULL, 0)) {
+            int threads = ost->enc->type == AVMEDIA_TYPE_VIDEO ? plex_thread_share(PLEX_STAGE_ENCODE) : 0; //PLEX
+            if (threads) //PLEX
+                av_dict_set_int(&ost->encoder_opts, "threads", threads, 0); //PLEX
+            else //PLEX
             av_dict_set(&ost->encoder_opts, "threads", "auto", 0);
+        }
         if (ost->enc->type == AVMEDIA_TYPE_AUDIO &&
             !codec->defaults &&
             !av_dict_get(ost->encoder_opts, "b", NULL, 0) &&
@@ -3665,9 +4831,11 @@ static int init_output_stream(OutputStream *ost, char *error, int error_len)
             return ret;
         }
         if (ost->enc->type == AVMEDIA_TYPE_AUDIO &&
-            !(ost->enc->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+            !(ost->enc->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)) {
+            filtergraph_thread_sync(ost->filter->graph); //PLEX
             av_buffersink_set_frame_size(ost->filter->filter,
                                             ost->enc_ctx->frame_size);
+        }
         assert_avoptions(ost->encoder_opts);
         if (ost->enc_ctx->bit_rate && ost->enc_ctx->bit_rate < 1000)
             av_log(NULL, AV_LOG_WARNING, "The bitrate parameter is set too low."
@@ -4109,6 +5277,7 @@ static int check_keyboard_interaction(int64_t cur_time)
             for (i = 0; i < nb_filtergraphs; i++) {
                 FilterGraph *fg = filtergraphs[i];
                 if (fg->graph) {
+                    filtergraph_thread_sync(fg); //PLEX
                     if (time < 0) {
                         ret = avfilter_graph_send_command(fg->graph, target, command, arg, buf, sizeof(buf),
                                                           key == 'c' ? AVFILTER_CMD_FLAG_ONE : 0);
@@ -4180,7 +5349,108 @@ static int check_keyboard_interaction(int64_t cur_time)
     return 0;
 }
 
+//PLEX
+/* The worker threads count the events that may give the main loop something
+ * to do, so that it can wait for one when every input said EAGAIN instead of
+ * polling. */
+#if HAVE_THREADS
+static pthread_mutex_t wakeup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup_cond = PTHREAD_COND_INITIALIZER;
+#endif
+static atomic_uint wakeup_count = ATOMIC_VAR_INIT(0);
+static atomic_int wakeup_waiting = ATOMIC_VAR_INIT(0);
+static unsigned wakeup_seen;    ///< wakeup_count when the EAGAIN flags were last reset
+
+/* The lock is only taken when the main loop waits: it sets wakeup_waiting
+ * before reading wakeup_count again, so an event counted after that read is
+ * signalled. */
+void transcode_wakeup(void)
+{
+    atomic_fetch_add(&wakeup_count, 1);
+#if HAVE_THREADS
+    if (atomic_load(&wakeup_waiting)) {
+        pthread_mutex_lock(&wakeup_lock);
+        pthread_cond_broadcast(&wakeup_cond);
+        pthread_mutex_unlock(&wakeup_lock);
+    }
+#endif
+}
+
+/* Wait until a thread has signalled an event since the EAGAIN flags were
+ * reset. Inputs that have to be polled (-re, or a device read on the main
+ * thread) are looked at again after 10 ms; otherwise the wait is only bounded
+ * so that signals and the keyboard are still seen. */
+static void wait_for_wakeup(void)
+{
+    int64_t timeout = 100000;
+    int i;
+
+    for (i = 0; i < nb_input_files; i++) {
+        InputFile *f = input_files[i];
+        if (f->eagain && (f->rate_emu
+#if HAVE_THREADS
+                          || !f->in_thread_queue
+#endif
+                          ))
+            timeout = 10000;
+    }
+
+#if HAVE_THREADS
+    {
+        int64_t deadline = av_gettime() + timeout;
+        struct timespec ts = { deadline / 1000000, deadline % 1000000 * 1000 };
+
+        pthread_mutex_lock(&wakeup_lock);
+        atomic_store(&wakeup_waiting, 1);
+        while (atomic_load(&wakeup_count) == wakeup_seen && !received_nb_signals &&
+               pthread_cond_timedwait(&wakeup_cond, &wakeup_lock, &ts) != ETIMEDOUT)
+            ;
+        atomic_store(&wakeup_waiting, 0);
+        pthread_mutex_unlock(&wakeup_lock);
+    }
+#else
+    av_usleep(timeout);
+#endif
+}
+//PLEX
+
 #if HAVE_THREADS
+//PLEX
+#define READ_AHEAD_BYTES   (16 << 20) ///< default limit for a single input read on its own thread
+#define READ_AHEAD_PACKETS 1024       ///< queue size when the limit is in bytes
+
+/* With a byte limit, the input thread waits for the main thread to take
+ * enough packets before queueing one that would exceed it; a single packet
+ * larger than the limit is still queued when the queue is empty. */
+static int input_thread_has_room(InputFile *f, const AVPacket *pkt)
+{
+    int64_t queued = atomic_load(&f->queued_bytes);
+    return !queued || queued + pkt->size <= f->thread_queue_bytes;
+}
+
+static int input_thread_wait_room(InputFile *f, const AVPacket *pkt)
+{
+    int ret = 0;
+
+    if (!f->thread_queue_bytes)
+        return 0;
+    if (!input_thread_has_room(f, pkt)) {
+        // queue_waiting is set before queued_bytes is read again, see get_input_packet_mt()
+        pthread_mutex_lock(&f->queue_lock);
+        atomic_store(&f->queue_waiting, 1);
+        while (!input_thread_has_room(f, pkt) && !f->queue_closed)
+            pthread_cond_wait(&f->queue_cond, &f->queue_lock);
+        atomic_store(&f->queue_waiting, 0);
+        if (f->queue_closed)
+            ret = AVERROR_EOF;
+        pthread_mutex_unlock(&f->queue_lock);
+    }
+    if (ret >= 0)
+        atomic_fetch_add(&f->queued_bytes, pkt->size);
+    return ret;
+}
+//PLEX
+
 static void *input_thread(void *arg)
 {
     InputFile *f = arg;
@@ -4189,17 +5459,25 @@ static void *input_thread(void *arg)
 
     while (1) {
         AVPacket pkt;
+        PlexStageClock clock; //PLEX
+
+        plex_stage_begin(&clock); //PLEX
         ret = av_read_frame(f->ctx, &pkt);
+        plex_stage_end(&f->plex_times, PLEX_STAGE_DEMUX, &clock); //PLEX
 
+        // PLEX: only devices opened non-blocking still get here, see init_input_thread()
         if (ret == AVERROR(EAGAIN)) {
             av_usleep(10000);
             continue;
         }
         if (ret < 0) {
             av_thread_message_queue_set_err_recv(f->in_thread_queue, ret);
+            transcode_wakeup(); //PLEX
             break;
         }
-        ret = av_thread_message_queue_send(f->in_thread_queue, &pkt, flags);
+        ret = input_thread_wait_room(f, &pkt); //PLEX
+        if (ret >= 0) //PLEX
+            ret = av_thread_message_queue_send(f->in_thread_queue, &pkt, flags);
         if (flags && ret == AVERROR(EAGAIN)) {
             flags = 0;
             ret = av_thread_message_queue_send(f->in_thread_queue, &pkt, flags);
@@ -4215,70 +5493,146 @@ static void *input_thread(void *arg)
                        av_err2str(ret));
             av_packet_unref(&pkt);
             av_thread_message_queue_set_err_recv(f->in_thread_queue, ret);
+            transcode_wakeup(); //PLEX
             break;
         }
+        transcode_wakeup(); //PLEX
     }
 
     return NULL;
 }
 
+static void free_input_thread(int i)
+{
+    InputFile *f = input_files[i];
+    AVPacket pkt;
+
+    if (!f || !f->in_thread_queue)
+        return;
+    av_thread_message_queue_set_err_send(f->in_thread_queue, AVERROR_EOF);
+//PLEX
+    pthread_mutex_lock(&f->queue_lock);
+    f->queue_closed = 1;
+    pthread_cond_signal(&f->queue_cond);
+    pthread_mutex_unlock(&f->queue_lock);
+//PLEX
+    while (av_thread_message_queue_recv(f->in_thread_queue, &pkt, 0) >= 0)
+        av_packet_unref(&pkt);
+
+    pthread_join(f->thread, NULL);
+    f->joined = 1;
+    f->ctx->flags |= AVFMT_FLAG_NONBLOCK; //PLEX
+    av_thread_message_queue_free(&f->in_thread_queue);
+    pthread_cond_destroy(&f->queue_cond); //PLEX
+    pthread_mutex_destroy(&f->queue_lock); //PLEX
+}
+
 static void free_input_threads(void)
 {
     int i;
 
-    for (i = 0; i < nb_input_files; i++) {
-        InputFile *f = input_files[i];
-        AVPacket pkt;
+    for (i = 0; i < nb_input_files; i++)
+        free_input_thread(i);
+}
 
-        if (!f || !f->in_thread_queue)
-            continue;
-        av_thread_message_queue_set_err_send(f->in_thread_queue, AVERROR_EOF);
-        while (av_thread_message_queue_recv(f->in_thread_queue, &pkt, 0) >= 0)
-            av_packet_unref(&pkt);
+//PLEX
+/* Local files are read on the main thread unless asked otherwise, as long as
+ * there is no other input to interleave with. */
+static int input_needs_thread(InputFile *f)
+{
+    const char *proto;
+
+    if (nb_input_files > 1 || threaded_demux > 0)
+        return 1;
+    if (!threaded_demux || !f->ctx->pb)
+        return 0;
+    proto = avio_find_protocol_name(f->ctx->url);
+    return proto && strcmp(proto, "file") && strcmp(proto, "pipe");
+}
+//PLEX
+
+static int init_input_thread(int i)
+{
+    int ret;
+    InputFile *f = input_files[i];
+
+    if (!input_needs_thread(f)) //PLEX
+        return 0;
+
+    if (nb_input_files > 1 && //PLEX: a single input has nothing to do meanwhile
+        (f->ctx->pb ? !f->ctx->pb->seekable :
+        strcmp(f->ctx->iformat->name, "lavfi")))
+        f->non_blocking = 1;
+//PLEX
+    f->thread_queue_bytes = f->thread_queue_bytes_opt;
+    if (!f->thread_queue_bytes && nb_input_files == 1)
+        f->thread_queue_bytes = READ_AHEAD_BYTES;
+    atomic_init(&f->queued_bytes, 0);
+    atomic_init(&f->queue_waiting, 0);
+    f->queue_closed = 0;
+    // only the input thread sends and only the main thread receives
+    ret = av_thread_message_queue_alloc2(&f->in_thread_queue,
+                                         f->thread_queue_bytes ? FFMAX(f->thread_queue_size, READ_AHEAD_PACKETS) :
+                                                                 f->thread_queue_size,
+                                         sizeof(AVPacket), AV_THREAD_MESSAGE_QUEUE_SPSC);
+//PLEX
+    if (ret < 0)
+        return ret;
+    pthread_mutex_init(&f->queue_lock, NULL); //PLEX
+    pthread_cond_init(&f->queue_cond, NULL); //PLEX
+
+    // PLEX: the thread has nothing else to do, so let the demuxer block
+    // rather than have the thread poll it
+    f->ctx->flags &= ~AVFMT_FLAG_NONBLOCK;
 
-        pthread_join(f->thread, NULL);
-        f->joined = 1;
+    if ((ret = pthread_create(&f->thread, NULL, input_thread, f))) {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        f->ctx->flags |= AVFMT_FLAG_NONBLOCK; //PLEX
         av_thread_message_queue_free(&f->in_thread_queue);
+        pthread_cond_destroy(&f->queue_cond); //PLEX
+        pthread_mutex_destroy(&f->queue_lock); //PLEX
+        return AVERROR(ret);
     }
+
+    return 0;
 }
 
 static int init_input_threads(void)
 {
     int i, ret;
 
-    if (nb_input_files == 1)
-        return 0;
-
     for (i = 0; i < nb_input_files; i++) {
-        InputFile *f = input_files[i];
-
-        if (f->ctx->pb ? !f->ctx->pb->seekable :
-            strcmp(f->ctx->iformat->name, "lavfi"))
-            f->non_blocking = 1;
-        ret = av_thread_message_queue_alloc(&f->in_thread_queue,
-                                            f->thread_queue_size, sizeof(AVPacket));
+        ret = init_input_thread(i);
         if (ret < 0)
             return ret;
-
-        if ((ret = pthread_create(&f->thread, NULL, input_thread, f))) {
-            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
-            av_thread_message_queue_free(&f->in_thread_queue);
-            return AVERROR(ret);
-        }
     }
     return 0;
 }
 
 static int get_input_packet_mt(InputFile *f, AVPacket *pkt)
 {
-    return av_thread_message_queue_recv(f->in_thread_queue, pkt,
-                                        f->non_blocking ?
-                                        AV_THREAD_MESSAGE_NONBLOCK : 0);
+    int ret = av_thread_message_queue_recv(f->in_thread_queue, pkt,
+                                           f->non_blocking ?
+                                           AV_THREAD_MESSAGE_NONBLOCK : 0);
+//PLEX
+    if (ret >= 0 && f->thread_queue_bytes) {
+        atomic_fetch_sub(&f->queued_bytes, pkt->size);
+        if (atomic_load(&f->queue_waiting)) {
+            pthread_mutex_lock(&f->queue_lock);
+            pthread_cond_signal(&f->queue_cond);
+            pthread_mutex_unlock(&f->queue_lock);
+        }
+    }
+//PLEX
+    return ret;
 }
 #endif
 
 static int get_input_packet(InputFile *f, AVPacket *pkt)
 {
+    PlexStageClock clock; //PLEX
+    int ret;
+
     if (f->rate_emu) {
         int i;
         for (i = 0; i < f->nb_streams; i++) {
@@ -4291,10 +5645,15 @@ static int get_input_packet(InputFile *f, AVPacket *pkt)
     }
 
 #if HAVE_THREADS
-    if (nb_input_files > 1)
+    if (f->in_thread_queue) //PLEX
         return get_input_packet_mt(f, pkt);
 #endif
-    return av_read_frame(f->ctx, pkt);
+//PLEX
+    plex_stage_begin(&clock);
+    ret = av_read_frame(f->ctx, pkt);
+    plex_stage_end(&f->plex_times, PLEX_STAGE_DEMUX, &clock);
+    return ret;
+//PLEX
 }
 
 static int got_eagain(void)
@@ -4309,6 +5668,7 @@ static int got_eagain(void)
 static void reset_eagain(void)
 {
     int i;
+    wakeup_seen = atomic_load(&wakeup_count); //PLEX
     for (i = 0; i < nb_input_files; i++)
         input_files[i]->eagain = 0;
     for (i = 0; i < nb_output_streams; i++)
@@ -4352,8 +5712,21 @@ static int seek_to_start(InputFile *ifile, AVFormatContext *is)
 
         // flush decoders
         if (ist->decoding_needed) {
-            process_input_packet(ist, NULL, 1);
-            avcodec_flush_buffers(avctx);
+//PLEX
+#if HAVE_THREADS
+            // Packets may still be queued for the decoder thread: drain it
+            // completely rather than dropping them.
+            if (ist->dec_thread) {
+                while (process_input_packet(ist, NULL, 1) > 0)
+                    ;
+                decoder_thread_flush(ist);
+            } else
+#endif
+//PLEX
+            {
+                process_input_packet(ist, NULL, 1);
+                avcodec_flush_buffers(avctx);
+            }
         }
 
         /* duration is the length of the last frame in a stream
@@ -4399,6 +5772,237 @@ static int seek_to_start(InputFile *ifile, AVFormatContext *is)
     return ret;
 }
 
+//PLEX
+/* Replace the muxer of an output file with a fresh one using the same
+ * streams and options, so output restarts as if the process had just been
+ * started; for segmenting muxers, segment numbering restarts at segment. */
+static int reopen_output_file(int file_index, int segment)
+{
+    OutputFile *of = output_files[file_index];
+    AVFormatContext *old = of->ctx, *oc = NULL;
+    int i, j, ret;
+
+    ret = avformat_alloc_output_context2(&oc, old->oformat, NULL, old->url);
+    if (!oc)
+        return ret;
+
+    oc->interrupt_callback = int_cb;
+    oc->flags     = old->flags;
+    oc->max_delay = old->max_delay;
+    oc->duration  = old->duration;
+    av_dict_copy(&oc->metadata, old->metadata, 0);
+
+    for (i = 0; i < old->nb_streams; i++) {
+        AVStream *ist = old->streams[i];
+        AVStream *st  = avformat_new_stream(oc, NULL);
+        if (!st) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        ret = avcodec_parameters_copy(st->codecpar, ist->codecpar);
+        if (ret < 0)
+            goto fail;
+        st->id                  = ist->id;
+        st->time_base           = ist->time_base;
+        st->disposition         = ist->disposition;
+        st->avg_frame_rate      = ist->avg_frame_rate;
+        st->r_frame_rate        = ist->r_frame_rate;
+        st->sample_aspect_ratio = ist->sample_aspect_ratio;
+        av_dict_copy(&st->metadata, ist->metadata, 0);
+        for (j = 0; j < ist->nb_side_data; j++) {
+            const AVPacketSideData *sd = &ist->side_data[j];
+            uint8_t *dst = av_stream_new_side_data(st, sd->type, sd->size);
+            if (!dst) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+            memcpy(dst, sd->data, sd->size);
+        }
+    }
+
+    av_dict_free(&of->opts);
+    av_dict_copy(&of->opts, of->header_opts, 0);
+    if (segment > 0 && oc->oformat->priv_class &&
+        av_opt_find(&oc->oformat->priv_class, "skip_to_segment", NULL, 0, AV_OPT_SEARCH_FAKE_OBJ))
+        av_dict_set_int(&of->opts, "skip_to_segment", segment, 0);
+
+    // The old muxer is dropped without a trailer, like a killed process.
+    if (!(old->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&old->pb);
+        ret = avio_open2(&oc->pb, oc->url, AVIO_FLAG_WRITE, &oc->interrupt_callback, &of->opts);
+        if (ret < 0)
+            goto fail;
+    }
+    avformat_free_context(old);
+
+    of->ctx            = oc;
+    of->header_written = 0;
+    for (i = 0; i < oc->nb_streams; i++)
+        output_streams[of->ost_index + i]->st = oc->streams[i];
+
+    return check_init_output_file(of, file_index);
+
+fail:
+    avformat_free_context(oc);
+    return ret;
+}
+
+/* Encoders keep timestamp state across avcodec_flush_buffers() unless they
+ * implement flush, which none of ours do, so open a copy of the context and
+ * drop the old one along with whatever it still held. */
+static int reopen_encoder(OutputStream *ost)
+{
+    AVCodecContext *enc_ctx;
+    int ret = open_encoder_copy(ost, 0, &enc_ctx);
+
+    if (ret < 0)
+        return ret;
+    avcodec_free_context(&ost->enc_ctx);
+    ost->enc_ctx = enc_ctx;
+    return 0;
+}
+
+/* Continue transcoding from another position without tearing down the
+ * demuxers, decoders and filter definitions: everything in flight is
+ * discarded and the per-stream state is reset to what a process started
+ * with -ss timestamp would have. */
+static int seek_in_place(int64_t timestamp, int segment)
+{
+    AVPacket pkt;
+    int i, j, ret;
+
+#if HAVE_THREADS
+    free_input_threads();
+#endif
+
+    for (i = 0; i < nb_input_streams; i++) {
+        InputStream *ist = input_streams[i];
+
+#if HAVE_THREADS
+        if (ist->dec_thread)
+            decoder_thread_flush(ist);
+        else
+#endif
+        if (ist->decoding_needed)
+            avcodec_flush_buffers(ist->dec_ctx);
+
+        ist->next_pts = ist->next_dts = AV_NOPTS_VALUE;
+        ist->pts = ist->dts = 0;
+        ist->saw_first_ts = 0;
+        ist->wrap_correction_done = 0;
+        ist->filter_in_rescale_delta_last = AV_NOPTS_VALUE;
+        ist->min_pts = INT64_MAX;
+        ist->max_pts = INT64_MIN;
+        ist->cfr_next_pts = 0;
+        ist->start = av_gettime_relative();
+
+        if (ist->prev_sub.got_output)
+            avsubtitle_free(&ist->prev_sub.subtitle);
+        ist->prev_sub.got_output = 0;
+        ist->sub2video.last_pts = INT64_MIN;
+        ist->sub2video.end_pts  = INT64_MIN;
+        while (ist->sub2video.sub_queue && av_fifo_size(ist->sub2video.sub_queue)) {
+            AVSubtitle sub;
+            av_fifo_generic_read(ist->sub2video.sub_queue, &sub, sizeof(sub), NULL);
+            avsubtitle_free(&sub);
+        }
+    }
+
+    // The graphs are configured again with the first frame after the seek.
+    for (i = 0; i < nb_filtergraphs; i++)
+        reset_filtergraph(filtergraphs[i]);
+    for (i = 0; i < plexContext.nb_inlineass_ctxs; i++)
+        plexContext.inlineass_ctxs[i].ctx = NULL;
+
+    av_init_packet(&pkt);
+    for (i = 0; i < nb_output_streams; i++) {
+        OutputStream *ost = output_streams[i];
+
+#if HAVE_THREADS
+        free_encoder_thread(ost);
+        free_chunk_encoder(ost);
+#endif
+        if (ost->encoding_needed && ost->initialized &&
+            ost->enc_ctx->codec_type != AVMEDIA_TYPE_SUBTITLE) {
+            ret = reopen_encoder(ost);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Could not reopen encoder for output stream #%d:%d: %s\n",
+                       ost->file_index, ost->index, av_err2str(ret));
+                return ret;
+            }
+        }
+        while (av_fifo_size(ost->muxing_queue)) {
+            av_fifo_generic_read(ost->muxing_queue, &pkt, sizeof(pkt), NULL);
+            av_packet_unref(&pkt);
+        }
+
+        ost->frame_number    = 0;
+        ost->sync_opts       = 0;
+        ost->first_pts       = 0;
+        ost->last_mux_dts    = AV_NOPTS_VALUE;
+        ost->last_mux_pts    = AV_NOPTS_VALUE;
+        ost->last_dropped    = 0;
+        ost->forced_kf_index = 0;
+        ost->finished        = 0;
+        ost->unavailable     = 0;
+        ost->inputs_done     = 0;
+        memset(ost->last_nb0_frames, 0, sizeof(ost->last_nb0_frames));
+        if (ost->last_frame)
+            av_frame_unref(ost->last_frame);
+    }
+
+    for (i = 0; i < nb_output_files; i++) {
+        ret = reopen_output_file(i, segment);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not reopen output file #%d: %s\n",
+                   i, av_err2str(ret));
+            return ret;
+        }
+    }
+
+    // Same as open_input_file() does for -ss.
+    for (i = 0; i < nb_input_files; i++) {
+        InputFile *ifile = input_files[i];
+        AVFormatContext *ic = ifile->ctx;
+        int64_t seek_timestamp = timestamp;
+
+        if (!ifile->seek_timestamp && ic->start_time != AV_NOPTS_VALUE)
+            seek_timestamp += ic->start_time;
+        ifile->ts_offset = ifile->input_ts_offset -
+                           (copy_ts ? (start_at_zero && ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0) :
+                                      seek_timestamp);
+        if (!(ic->iformat->flags & AVFMT_SEEK_TO_PTS)) {
+            for (j = 0; j < ic->nb_streams; j++)
+                if (ic->streams[j]->codecpar->video_delay) {
+                    seek_timestamp -= 3*AV_TIME_BASE / 23;
+                    break;
+                }
+        }
+
+        ret = avformat_seek_file(ic, -1, INT64_MIN, seek_timestamp, seek_timestamp, 0);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "%s: could not seek to position %0.3f\n",
+                   ic->url, (double)timestamp / AV_TIME_BASE);
+            return ret;
+        }
+
+        ifile->start_time  = timestamp;
+        ifile->eof_reached = 0;
+        ifile->eagain      = 0;
+        ifile->last_ts     = AV_NOPTS_VALUE;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Seeked to %s, continuing with segment %d\n",
+           av_ts2timestr(timestamp, &AV_TIME_BASE_Q), segment);
+
+#if HAVE_THREADS
+    return init_input_threads();
+#else
+    return 0;
+#endif
+}
+//PLEX
+
 /*
  * Return
  * - 0 -- one packet was read and processed
@@ -4424,7 +6028,18 @@ static int process_input(int file_index)
         return ret;
     }
     if (ret < 0 && ifile->loop) {
+//PLEX
+#if HAVE_THREADS
+        free_input_thread(file_index);
+#endif
+//PLEX
         ret = seek_to_start(ifile, is);
+//PLEX
+#if HAVE_THREADS
+        if (ret >= 0)
+            ret = init_input_thread(file_index);
+#endif
+//PLEX
         if (ret < 0)
             av_log(NULL, AV_LOG_WARNING, "Seek to start failed.\n");
         else
@@ -4646,12 +6261,6 @@ static int process_input(int file_index)
 
     process_input_packet(ist, &pkt, 0);
 
-//PLEX
-    // Delay if needed.
-    if (plexContext.throttle_delay > 0)
-      usleep(1000*plexContext.throttle_delay);
-//PLEX
-
 discard_packet:
     av_packet_unref(&pkt);
 
@@ -4671,9 +6280,31 @@ static int transcode_from_filter(FilterGraph *graph, InputStream **best_ist)
     int nb_requests, nb_requests_max = 0;
     InputFilter *ifilter;
     InputStream *ist;
+    PlexStageClock clock; //PLEX
+    int busy = 0; //PLEX
 
     *best_ist = NULL;
-    ret = avfilter_graph_request_oldest(graph->graph);
+//PLEX
+    /* While the graph thread is busy, go by what the graph needed after its
+     * last run and reap what it has produced so far; otherwise the request is
+     * made here, as without the thread. */
+    if (graph->thread) {
+        if ((ret = filtergraph_thread_idle(graph)) < 0)
+            return ret;
+        busy = !ret;
+        if (busy) {
+            if ((ret = reap_filters(0)) < 0)
+                return ret;
+            ret = AVERROR(EAGAIN);
+        } else {
+            ret = filtergraph_thread_request_oldest(graph);
+        }
+    } else {
+        plex_stage_begin(&clock);
+        ret = avfilter_graph_request_oldest(graph->graph);
+        plex_stage_end(&graph->plex_times, PLEX_STAGE_FILTER, &clock);
+    }
+//PLEX
     if (ret >= 0)
         return reap_filters(0);
 
@@ -4692,13 +6323,21 @@ static int transcode_from_filter(FilterGraph *graph, InputStream **best_ist)
         if (input_files[ist->file_index]->eagain ||
             input_files[ist->file_index]->eof_reached)
             continue;
-        nb_requests = av_buffersrc_get_nb_failed_requests(ifilter->filter);
+        nb_requests = graph->thread ? filtergraph_thread_failed_requests(ifilter) : //PLEX
+                      av_buffersrc_get_nb_failed_requests(ifilter->filter);
         if (nb_requests > nb_requests_max) {
             nb_requests_max = nb_requests;
             *best_ist = ist;
         }
     }
 
+//PLEX
+    if (!*best_ist && busy) {
+        /* nothing to feed it yet; look again once it is done */
+        filtergraph_thread_sync(graph);
+        return 0;
+    }
+//PLEX
     if (!*best_ist)
         for (i = 0; i < graph->nb_outputs; i++)
             graph->outputs[i]->ost->unavailable = 1;
@@ -4720,8 +6359,8 @@ static int transcode_step(void)
     ost = choose_output();
     if (!ost) {
         if (got_eagain()) {
+            wait_for_wakeup(); //PLEX
             reset_eagain();
-            av_usleep(10000);
             return 0;
         }
         av_log(NULL, AV_LOG_VERBOSE, "No more inputs to read from, finishing.\n");
@@ -4770,7 +6409,9 @@ static int transcode_step(void)
         ist = input_streams[ost->source_index];
     }
 
+    avpriv_trace_begin("process_input", AV_NOPTS_VALUE); //PLEX
     ret = process_input(ist->file_index);
+    avpriv_trace_end("process_input", AV_NOPTS_VALUE); //PLEX
     if (ret == AVERROR(EAGAIN)) {
         if (input_files[ist->file_index]->eagain)
             ost->unavailable = 1;
@@ -4826,16 +6467,35 @@ static int transcode(void)
 #if HAVE_THREADS
     if ((ret = init_input_threads()) < 0)
         goto fail;
+    if ((ret = init_decoder_threads()) < 0) //PLEX
+        goto fail;
 #endif
 
+    if ((ret = plex_control_start()) < 0) //PLEX
+        goto fail;
+
     while (!received_sigterm) {
         int64_t cur_time= av_gettime_relative();
+        PlexControl cmd; //PLEX
 
         /* if 'q' pressed, exits */
         if (stdin_interaction)
             if (check_keyboard_interaction(cur_time) < 0)
                 break;
 
+//PLEX
+        if (plex_control_poll(&cmd)) {
+            if (cmd.type == PLEX_CONTROL_STOP) {
+                plex_control_done(&cmd, 0);
+                break;
+            }
+            ret = seek_in_place(cmd.seek_time, cmd.segment);
+            plex_control_done(&cmd, ret);
+            if (ret < 0)
+                break;
+        }
+//PLEX
+
         /* check if there's any stream where output is still needed */
         if (!need_output()) {
             av_log(NULL, AV_LOG_VERBOSE, "No more output streams to write to, finishing.\n");
@@ -4853,6 +6513,8 @@ static int transcode(void)
 
         /* dump report by using the output first video and audio streams */
         print_report(0, timer_start, cur_time);
+
+        plex_throttle(); //PLEX
     }
 #if HAVE_THREADS
     free_input_threads();
@@ -4888,6 +6550,7 @@ static int transcode(void)
 
     /* dump report by using the first video and audio streams */
     print_report(1, timer_start, av_gettime_relative());
+    plex_print_stage_summary(); //PLEX
 
     /* close each encoder */
     for (i = 0; i < nb_output_streams; i++) {
@@ -5003,6 +6666,9 @@ int main(int argc, char **argv)
     av_log_set_flags(AV_LOG_SKIP_REPEATED);
     parse_loglevel(argc, argv, options);
 
+    if (argc > 2 && !strcmp(argv[1], "-connect")) //PLEX
+        return plex_session_connect(argv[2], argc - 3, argv + 3); //PLEX
+
     if(argc>1 && !strcmp(argv[1], "-d")){
         run_as_daemon=1;
         av_log_set_callback(log_callback_null);
@@ -5021,6 +6687,15 @@ int main(int argc, char **argv)
     av_register_all();
     avformat_network_init();
 
+//PLEX
+    if (argc > 2 && !strcmp(argv[1], "-serve")) {
+        if (plex_session_serve(argv[2], &argc, &argv) < 0)
+            exit_program(1);
+        av_log_set_level(AV_LOG_INFO);
+        parse_loglevel(argc, argv, options);
+    }
+//PLEX
+
     show_banner(argc, argv, options);
 
     /* parse options and open all input/output files */
@@ -21,6 +21,7 @@
 
 #include "config.h"
 
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <signal.h>
@@ -120,6 +121,7 @@ typedef struct OptionsContext {
     int rate_emu;
     int accurate_seek;
     int thread_queue_size;
+    int64_t thread_queue_bytes; // PLEX
 
     SpecifierOpt *ts_scale;
     int        nb_ts_scale;
@@ -160,6 +162,11 @@ typedef struct OptionsContext {
     int subtitle_disable;
     int data_disable;
 
+    // PLEX
+    const char *ladder;         /* renditions to scale the video to, see add_ladder() */
+    const char *ladder_filter;  /* filters applied once before the renditions are scaled */
+    float ladder_keyint;        /* seconds between the keyframes shared by all renditions */
+
     /* indexed by output file stream index */
     int   *streamid_map;
     int nb_streamid_map;
@@ -236,6 +243,23 @@ typedef struct OptionsContext {
     int        nb_hwaccel_fallback_thresholds;
 } OptionsContext;
 
+// PLEX
+enum PlexStage {
+    PLEX_STAGE_DEMUX,
+    PLEX_STAGE_DECODE,
+    PLEX_STAGE_FILTER,
+    PLEX_STAGE_ENCODE,
+    PLEX_STAGE_MUX,
+    PLEX_STAGE_NB
+};
+
+/* Time spent in each pipeline stage, in microseconds. cpu is the CPU time of
+ * the thread that ran the stage, excluding codec worker threads. */
+typedef struct PlexStageTimes {
+    atomic_int_fast64_t wall[PLEX_STAGE_NB];
+    atomic_int_fast64_t cpu[PLEX_STAGE_NB];
+} PlexStageTimes;
+
 typedef struct InputFilter {
     AVFilterContext    *filter;
     struct InputStream *ist;
@@ -294,6 +318,9 @@ typedef struct FilterGraph {
     int          nb_inputs;
     OutputFilter **outputs;
     int         nb_outputs;
+
+    PlexStageTimes plex_times;  // PLEX
+    struct FilterGraphThread *thread; // PLEX: set if the graph runs on its own thread
 } FilterGraph;
 
 typedef struct InputStream {
@@ -398,6 +425,8 @@ typedef struct InputStream {
     int hwaccel_blocked;            // if set, don't try to use hwaccel
     int hwaccel_error_counter;      // current error counter for fallback
     int hwaccel_fallback_threshold; // after how many errors to start fallback
+    PlexStageTimes plex_times;
+    struct DecoderThread *dec_thread; // set if the decoder runs on its own thread
 } InputStream;
 
 typedef struct InputFile {
@@ -428,7 +457,17 @@ typedef struct InputFile {
     int non_blocking;           /* reading packets from the thread should not block */
     int joined;                 /* the thread has been joined */
     int thread_queue_size;      /* maximum number of queued packets */
+    // PLEX
+    int64_t thread_queue_bytes_opt; /* -thread_queue_bytes, 0 if unset */
+    int64_t thread_queue_bytes; /* maximum number of queued bytes, 0 for no limit */
+    atomic_int_fast64_t queued_bytes;
+    atomic_int queue_waiting;   /* the thread waits for queued_bytes to drop */
+    int queue_closed;           /* the thread is being stopped */
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
 #endif
+
+    PlexStageTimes plex_times;  // PLEX
 } InputFile;
 
 enum forced_keyframes_const {
@@ -562,6 +601,10 @@ typedef struct OutputStream {
 
     /* frame encode sum of squared error values */
     int64_t error[4];
+
+    PlexStageTimes plex_times;  // PLEX
+    struct EncoderThread *enc_thread; // PLEX: set once the encoder runs on its own thread
+    struct ChunkEncoder *chunk_enc; // PLEX: set once the video is encoded in chunks
 } OutputStream;
 
 typedef struct OutputFile {
@@ -575,6 +618,8 @@ typedef struct OutputFile {
     int shortest;
 
     int header_written;
+
+    AVDictionary *header_opts; ///< PLEX: muxer options for reopening the output in place
 } OutputFile;
 
 extern InputStream **input_streams;
@@ -623,6 +668,12 @@ extern char *videotoolbox_pixfmt;
 extern int filter_nbthreads;
 extern int filter_complex_nbthreads;
 extern int vstats_version;
+extern int threaded_decode; //PLEX
+extern int threaded_encode; //PLEX
+extern int threaded_filter; //PLEX
+extern int threaded_demux; //PLEX
+extern float chunk_encode; //PLEX
+extern int chunk_threads; //PLEX
 
 extern const AVIOInterruptCB int_cb;
 
@@ -652,6 +703,17 @@ enum AVPixelFormat choose_pixel_fmt(AVStream *st, AVCodecContext *avctx, AVCodec
 void choose_sample_fmt(AVStream *st, AVCodec *codec);
 
 int configure_filtergraph(FilterGraph *fg);
+void reset_filtergraph(FilterGraph *fg); //PLEX
+//PLEX
+void free_filtergraph_thread(FilterGraph *fg);
+void filtergraph_thread_sync(FilterGraph *fg);
+int filtergraph_thread_send(InputFilter *ifilter, AVFrame *frame, int64_t pts, int flags);
+int filtergraph_thread_get_frame(OutputFilter *ofilter, AVFrame *frame);
+int filtergraph_thread_idle(FilterGraph *fg);
+int filtergraph_thread_request_oldest(FilterGraph *fg);
+int filtergraph_thread_failed_requests(InputFilter *ifilter);
+void transcode_wakeup(void);
+//PLEX
 int configure_output_filter(FilterGraph *fg, OutputFilter *ofilter, AVFilterInOut *out);
 void check_filter_outputs(void);
 int ist_in_filtergraph(FilterGraph *fg, InputStream *ist);
@@ -38,6 +38,7 @@
 #include "libavutil/pixfmt.h"
 #include "libavutil/imgutils.h"
 #include "libavutil/samplefmt.h"
+#include "libavutil/trace.h" //PLEX
 
 //PLEX
 #include "plex.h"
@@ -1009,6 +1010,394 @@ static void cleanup_filtergraph(FilterGraph *fg)
     avfilter_graph_free(&fg->graph);
 }
 
+//PLEX
+#if HAVE_THREADS
+/* With -threaded_filter, every filtergraph with inputs gets a thread that
+ * feeds the frames and EOFs for its buffer sources into it, so that the graph
+ * runs while the main thread demuxes and decodes. What the buffer sinks
+ * return is queued for reap_filters().
+ *
+ * Anything else touching the graph (configuring it, sending commands to it,
+ * adding subtitles to it, ...) happens on the main thread after
+ * filtergraph_thread_sync(), once the thread is idle. */
+#define FILTERGRAPH_THREAD_ITEMS 4
+
+typedef struct FilterGraphItem {
+    InputFilter *ifilter;
+    AVFrame *frame;             ///< NULL to close the input
+    int64_t pts;                ///< end of the input when closing it
+    int flags;
+} FilterGraphItem;
+
+typedef struct FilterGraphThread {
+    FilterGraph *fg;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    AVFifoBuffer *items;        ///< FilterGraphItem, main thread -> graph
+    AVFifoBuffer **frames;      ///< AVFrame* per output, graph -> main thread
+    int *open;                  ///< per output, the encoder has been set up
+    int *eof;                   ///< per output, the buffer sink has returned EOF
+    int *failed_requests;       ///< per input, as of the last run of the graph
+    int error;
+    int busy;
+    int exiting;
+} FilterGraphThread;
+
+/* Move what the buffer sinks have for open outputs to their queues. */
+static void filtergraph_thread_collect(FilterGraphThread *ft)
+{
+    FilterGraph *fg = ft->fg;
+    AVFrame *frame = NULL;
+    int i, ret;
+
+    for (i = 0; i < fg->nb_outputs; i++) {
+        pthread_mutex_lock(&ft->lock);
+        ret = ft->open[i];
+        pthread_mutex_unlock(&ft->lock);
+        if (!ret)
+            continue;
+
+        while (1) {
+            if (!frame && !(frame = av_frame_alloc()))
+                return;
+            ret = av_buffersink_get_frame_flags(fg->outputs[i]->filter, frame,
+                                                AV_BUFFERSINK_FLAG_NO_REQUEST);
+            if (ret < 0) {
+                if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+                    av_log(NULL, AV_LOG_WARNING,
+                           "Error in av_buffersink_get_frame_flags(): %s\n", av_err2str(ret));
+                pthread_mutex_lock(&ft->lock);
+                ft->eof[i] = ret == AVERROR_EOF;
+                pthread_mutex_unlock(&ft->lock);
+                break;
+            }
+
+            pthread_mutex_lock(&ft->lock);
+            if (!av_fifo_space(ft->frames[i]))
+                ret = av_fifo_grow(ft->frames[i], av_fifo_size(ft->frames[i]));
+            if (ret >= 0) {
+                av_fifo_generic_write(ft->frames[i], &frame, sizeof(frame), NULL);
+                frame = NULL;
+            }
+            pthread_mutex_unlock(&ft->lock);
+            if (ret < 0)
+                av_frame_unref(frame);
+        }
+    }
+    av_frame_free(&frame);
+}
+
+static void filtergraph_thread_snapshot(FilterGraphThread *ft)
+{
+    FilterGraph *fg = ft->fg;
+    int i;
+
+    for (i = 0; i < fg->nb_inputs; i++)
+        ft->failed_requests[i] = av_buffersrc_get_nb_failed_requests(fg->inputs[i]->filter);
+}
+
+static void *filtergraph_thread(void *arg)
+{
+    FilterGraphThread *ft = arg;
+    FilterGraph *fg = ft->fg;
+    FilterGraphItem item;
+    PlexStageClock clock;
+    int ret;
+
+    pthread_mutex_lock(&ft->lock);
+    while (1) {
+        while (!ft->exiting && !av_fifo_size(ft->items))
+            pthread_cond_wait(&ft->cond, &ft->lock);
+        if (ft->exiting)
+            break;
+        av_fifo_generic_read(ft->items, &item, sizeof(item), NULL);
+        ft->busy = 1;
+        pthread_cond_broadcast(&ft->cond);
+        pthread_mutex_unlock(&ft->lock);
+
+        avpriv_trace_begin("filtergraph_thread", item.frame ? item.frame->pts : item.pts);
+        plex_stage_begin(&clock);
+        if (item.frame)
+            ret = av_buffersrc_add_frame_flags(item.ifilter->filter, item.frame, item.flags);
+        else
+            ret = av_buffersrc_close(item.ifilter->filter, item.pts, item.flags);
+        plex_stage_end(&fg->plex_times, PLEX_STAGE_FILTER, &clock);
+        av_frame_free(&item.frame);
+        filtergraph_thread_collect(ft);
+        avpriv_trace_end("filtergraph_thread", AV_NOPTS_VALUE);
+        if (ret < 0 && ret != AVERROR_EOF)
+            av_log(NULL, AV_LOG_ERROR, "Error while filtering: %s\n", av_err2str(ret));
+
+        pthread_mutex_lock(&ft->lock);
+        if (ret < 0 && ret != AVERROR_EOF && !ft->error)
+            ft->error = ret;
+        filtergraph_thread_snapshot(ft);
+        ft->busy = 0;
+        pthread_cond_broadcast(&ft->cond);
+        transcode_wakeup();
+    }
+    pthread_mutex_unlock(&ft->lock);
+
+    return NULL;
+}
+
+void free_filtergraph_thread(FilterGraph *fg)
+{
+    FilterGraphThread *ft = fg->thread;
+    FilterGraphItem item;
+    AVFrame *frame;
+    int i;
+
+    if (!ft)
+        return;
+
+    pthread_mutex_lock(&ft->lock);
+    ft->exiting = 1;
+    pthread_cond_broadcast(&ft->cond);
+    pthread_mutex_unlock(&ft->lock);
+    pthread_join(ft->thread, NULL);
+    pthread_cond_destroy(&ft->cond);
+    pthread_mutex_destroy(&ft->lock);
+
+    while (av_fifo_size(ft->items)) {
+        av_fifo_generic_read(ft->items, &item, sizeof(item), NULL);
+        av_frame_free(&item.frame);
+    }
+    av_fifo_freep(&ft->items);
+    for (i = 0; i < fg->nb_outputs; i++) {
+        while (av_fifo_size(ft->frames[i])) {
+            av_fifo_generic_read(ft->frames[i], &frame, sizeof(frame), NULL);
+            av_frame_free(&frame);
+        }
+        av_fifo_freep(&ft->frames[i]);
+    }
+    av_freep(&ft->frames);
+    av_freep(&ft->open);
+    av_freep(&ft->eof);
+    av_freep(&ft->failed_requests);
+    av_freep(&fg->thread);
+}
+
+static int init_filtergraph_thread(FilterGraph *fg)
+{
+    FilterGraphThread *ft;
+    int i, ret = AVERROR(ENOMEM);
+
+    if (!(ft = av_mallocz(sizeof(*ft))))
+        return AVERROR(ENOMEM);
+    ft->fg              = fg;
+    ft->frames          = av_mallocz_array(fg->nb_outputs, sizeof(*ft->frames));
+    ft->open            = av_mallocz_array(fg->nb_outputs, sizeof(*ft->open));
+    ft->eof             = av_mallocz_array(fg->nb_outputs, sizeof(*ft->eof));
+    ft->failed_requests = av_mallocz_array(fg->nb_inputs,  sizeof(*ft->failed_requests));
+    ft->items           = av_fifo_alloc_array(FILTERGRAPH_THREAD_ITEMS, sizeof(FilterGraphItem));
+    if (!ft->frames || !ft->open || !ft->eof || !ft->failed_requests || !ft->items)
+        goto fail;
+    for (i = 0; i < fg->nb_outputs; i++)
+        if (!(ft->frames[i] = av_fifo_alloc_array(8, sizeof(AVFrame*))))
+            goto fail;
+    pthread_mutex_init(&ft->lock, NULL);
+    pthread_cond_init(&ft->cond, NULL);
+
+    if ((ret = pthread_create(&ft->thread, NULL, filtergraph_thread, ft))) {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        pthread_cond_destroy(&ft->cond);
+        pthread_mutex_destroy(&ft->lock);
+        ret = AVERROR(ret);
+        goto fail;
+    }
+    fg->thread = ft;
+    return 0;
+
+fail:
+    for (i = 0; ft->frames && i < fg->nb_outputs; i++)
+        av_fifo_freep(&ft->frames[i]);
+    av_freep(&ft->frames);
+    av_freep(&ft->open);
+    av_freep(&ft->eof);
+    av_freep(&ft->failed_requests);
+    av_fifo_freep(&ft->items);
+    av_free(ft);
+    return ret;
+}
+
+void filtergraph_thread_sync(FilterGraph *fg)
+{
+    FilterGraphThread *ft = fg->thread;
+
+    if (!ft)
+        return;
+    pthread_mutex_lock(&ft->lock);
+    while (av_fifo_size(ft->items) || ft->busy)
+        pthread_cond_wait(&ft->cond, &ft->lock);
+    pthread_mutex_unlock(&ft->lock);
+}
+
+int filtergraph_thread_send(InputFilter *ifilter, AVFrame *frame, int64_t pts, int flags)
+{
+    FilterGraphThread *ft = ifilter->graph->thread;
+    FilterGraphItem item = { ifilter, NULL, pts, flags & ~AV_BUFFERSRC_FLAG_KEEP_REF };
+    int ret;
+
+    if (frame) {
+        if (!(item.frame = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+        if (flags & AV_BUFFERSRC_FLAG_KEEP_REF) {
+            if ((ret = av_frame_ref(item.frame, frame)) < 0) {
+                av_frame_free(&item.frame);
+                return ret;
+            }
+        } else {
+            av_frame_move_ref(item.frame, frame);
+        }
+    }
+
+    pthread_mutex_lock(&ft->lock);
+    while (av_fifo_space(ft->items) < sizeof(item) && !ft->error)
+        pthread_cond_wait(&ft->cond, &ft->lock);
+    ret = ft->error;
+    if (!ret) {
+        av_fifo_generic_write(ft->items, &item, sizeof(item), NULL);
+        pthread_cond_broadcast(&ft->cond);
+    }
+    pthread_mutex_unlock(&ft->lock);
+
+    if (ret < 0)
+        av_frame_free(&item.frame);
+    return ret;
+}
+
+int filtergraph_thread_get_frame(OutputFilter *ofilter, AVFrame *frame)
+{
+    FilterGraph *fg = ofilter->graph;
+    FilterGraphThread *ft = fg->thread;
+    AVFrame *tmp;
+    int i, ret = AVERROR(EAGAIN);
+
+    for (i = 0; fg->outputs[i] != ofilter; i++)
+        ;
+
+    /* The sink is left alone until its encoder is set up, since that may
+     * change the size of the audio frames it returns. */
+    if (!ft->open[i]) {
+        filtergraph_thread_sync(fg);
+        pthread_mutex_lock(&ft->lock);
+        ft->open[i] = 1;
+        pthread_mutex_unlock(&ft->lock);
+        filtergraph_thread_collect(ft);
+    }
+
+    pthread_mutex_lock(&ft->lock);
+    if (av_fifo_size(ft->frames[i])) {
+        av_fifo_generic_read(ft->frames[i], &tmp, sizeof(tmp), NULL);
+        av_frame_move_ref(frame, tmp);
+        av_frame_free(&tmp);
+        ret = 0;
+    } else if (ft->eof[i]) {
+        ret = AVERROR_EOF;
+    }
+    pthread_mutex_unlock(&ft->lock);
+    return ret;
+}
+
+int filtergraph_thread_idle(FilterGraph *fg)
+{
+    FilterGraphThread *ft = fg->thread;
+    int ret;
+
+    pthread_mutex_lock(&ft->lock);
+    ret = ft->error ? ft->error : !av_fifo_size(ft->items) && !ft->busy;
+    pthread_mutex_unlock(&ft->lock);
+    return ret;
+}
+
+int filtergraph_thread_request_oldest(FilterGraph *fg)
+{
+    FilterGraphThread *ft = fg->thread;
+    PlexStageClock clock;
+    int ret;
+
+    filtergraph_thread_sync(fg);
+    plex_stage_begin(&clock);
+    ret = avfilter_graph_request_oldest(fg->graph);
+    plex_stage_end(&fg->plex_times, PLEX_STAGE_FILTER, &clock);
+    filtergraph_thread_collect(ft);
+    pthread_mutex_lock(&ft->lock);
+    filtergraph_thread_snapshot(ft);
+    pthread_mutex_unlock(&ft->lock);
+    return ret;
+}
+
+int filtergraph_thread_failed_requests(InputFilter *ifilter)
+{
+    FilterGraph *fg = ifilter->graph;
+    FilterGraphThread *ft = fg->thread;
+    int i, ret;
+
+    for (i = 0; fg->inputs[i] != ifilter; i++)
+        ;
+
+    pthread_mutex_lock(&ft->lock);
+    ret = ft->failed_requests[i];
+    pthread_mutex_unlock(&ft->lock);
+    return ret;
+}
+#else
+void free_filtergraph_thread(FilterGraph *fg)
+{
+}
+
+void filtergraph_thread_sync(FilterGraph *fg)
+{
+}
+
+int filtergraph_thread_send(InputFilter *ifilter, AVFrame *frame, int64_t pts, int flags)
+{
+    return AVERROR(ENOSYS);
+}
+
+int filtergraph_thread_get_frame(OutputFilter *ofilter, AVFrame *frame)
+{
+    return AVERROR(ENOSYS);
+}
+
+int filtergraph_thread_idle(FilterGraph *fg)
+{
+    return AVERROR(ENOSYS);
+}
+
+int filtergraph_thread_request_oldest(FilterGraph *fg)
+{
+    return AVERROR(ENOSYS);
+}
+
+int filtergraph_thread_failed_requests(InputFilter *ifilter)
+{
+    return 0;
+}
+#endif
+//PLEX
+
+//PLEX
+void reset_filtergraph(FilterGraph *fg)
+{
+    int i;
+
+    free_filtergraph_thread(fg);
+    cleanup_filtergraph(fg);
+    for (i = 0; i < fg->nb_inputs; i++) {
+        InputFilter *ifilter = fg->inputs[i];
+        while (av_fifo_size(ifilter->frame_queue)) {
+            AVFrame *tmp;
+            av_fifo_generic_read(ifilter->frame_queue, &tmp, sizeof(tmp), NULL);
+            av_frame_free(&tmp);
+        }
+        ifilter->eof = 0;
+    }
+}
+//PLEX
+
 int configure_filtergraph(FilterGraph *fg)
 {
     AVFilterInOut *inputs, *outputs, *cur;
@@ -1016,6 +1405,7 @@ int configure_filtergraph(FilterGraph *fg)
     const char *graph_desc = simple ? fg->outputs[0]->ost->avfilter :
                                       fg->graph_desc;
 
+    filtergraph_thread_sync(fg); //PLEX
     cleanup_filtergraph(fg);
     if (!(fg->graph = avfilter_graph_alloc()))
         return AVERROR(ENOMEM);
@@ -1026,6 +1416,8 @@ int configure_filtergraph(FilterGraph *fg)
         AVDictionaryEntry *e = NULL;
 
         fg->graph->nb_threads = filter_nbthreads;
+        if (!filter_nbthreads && ost->st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) //PLEX
+            fg->graph->nb_threads = plex_thread_share(PLEX_STAGE_FILTER); //PLEX
 
         args[0] = 0;
         while ((e = av_dict_get(ost->sws_dict, "", e,
@@ -1058,6 +1450,13 @@ int configure_filtergraph(FilterGraph *fg)
             av_opt_set(fg->graph, "threads", e->value, 0);
     } else {
         fg->graph->nb_threads = filter_complex_nbthreads;
+//PLEX
+        for (i = 0; !filter_complex_nbthreads && i < fg->nb_outputs; i++)
+            if (fg->outputs[i]->type == AVMEDIA_TYPE_VIDEO) {
+                fg->graph->nb_threads = plex_thread_share(PLEX_STAGE_FILTER);
+                break;
+            }
+//PLEX
     }
 
     if ((ret = avfilter_graph_parse2(fg->graph, graph_desc, &inputs, &outputs)) < 0)
@@ -1187,6 +1586,18 @@ int configure_filtergraph(FilterGraph *fg)
         }
     }
 
+//PLEX
+#if HAVE_THREADS
+    if (fg->thread) {
+        for (i = 0; i < fg->nb_outputs; i++)
+            fg->thread->eof[i] = 0;
+    } else if (threaded_filter && fg->nb_inputs) {
+        if ((ret = init_filtergraph_thread(fg)) < 0)
+            goto fail;
+    }
+#endif
+//PLEX
+
     return 0;
 
 fail:
@@ -32,6 +32,7 @@
 #include "libavutil/avassert.h"
 #include "libavutil/avstring.h"
 #include "libavutil/avutil.h"
+#include "libavutil/bprint.h" //PLEX
 #include "libavutil/channel_layout.h"
 #include "libavutil/intreadwrite.h"
 #include "libavutil/fifo.h"
@@ -114,6 +115,12 @@ float max_error_rate  = 2.0/3;
 int filter_nbthreads = 0;
 int filter_complex_nbthreads = 0;
 int vstats_version = 2;
+int threaded_decode = 0; //PLEX
+int threaded_encode = 0; //PLEX
+int threaded_filter = 0; //PLEX
+int threaded_demux = -1; //PLEX
+float chunk_encode = 0; //PLEX
+int chunk_threads = 0; //PLEX: -1 reads a single input on a thread unless it is local
 
 
 static int intra_only         = 0;
@@ -170,6 +177,7 @@ static void init_options(OptionsContext *o)
     o->limit_filesize = UINT64_MAX;
     o->chapters_input_file = INT_MAX;
     o->accurate_seek  = 1;
+    o->ladder_keyint  = 2; // PLEX
 }
 
 static int show_hwaccels(void *optctx, const char *opt, const char *arg)
@@ -1205,6 +1213,7 @@ static int open_input_file(OptionsContext *o, const char *filename)
     f->time_base = (AVRational){ 1, 1 };
 #if HAVE_THREADS
     f->thread_queue_size = o->thread_queue_size > 0 ? o->thread_queue_size : 8;
+    f->thread_queue_bytes_opt = FFMAX(o->thread_queue_bytes, 0); //PLEX
 #endif
 
     /* check if all codec options have been used */
@@ -2132,6 +2141,146 @@ static int init_complex_filters(void)
     return 0;
 }
 
+//PLEX
+#define MAX_LADDER_RENDITIONS 16
+
+typedef struct LadderRendition {
+    int width, height;          ///< width is 0 to keep the display aspect ratio
+    char *bitrate;
+} LadderRendition;
+
+static void parse_ladder(const char *arg, LadderRendition *r, int *nb_r)
+{
+    const char *p = arg;
+
+    *nb_r = 0;
+    while (*p) {
+        LadderRendition *cur = &r[*nb_r];
+        char *entry = av_get_token(&p, ",");
+        char *at, *end;
+        int ret;
+
+        if (!entry)
+            exit_program(1);
+        if (*nb_r == MAX_LADDER_RENDITIONS) {
+            av_log(NULL, AV_LOG_FATAL, "At most %d ladder renditions are supported.\n",
+                   MAX_LADDER_RENDITIONS);
+            exit_program(1);
+        }
+        if ((at = strchr(entry, '@'))) {
+            *at = 0;
+            if (!(cur->bitrate = av_strdup(at + 1)))
+                exit_program(1);
+        }
+        cur->height = strtol(entry, &end, 10);
+        if (end == entry || *end) {
+            ret = av_parse_video_size(&cur->width, &cur->height, entry);
+        } else {
+            cur->width = 0;
+            ret = cur->height > 0 ? 0 : AVERROR(EINVAL);
+        }
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Invalid ladder rendition '%s'.\n", entry);
+            exit_program(1);
+        }
+        av_free(entry);
+        (*nb_r)++;
+        if (*p)
+            p++;
+    }
+    if (!*nb_r) {
+        av_log(NULL, AV_LOG_FATAL, "Empty ladder.\n");
+        exit_program(1);
+    }
+}
+
+/* Create one video stream per -ladder rendition, all fed from a single
+ * decode of the largest input video stream: the -ladder_filter chain runs
+ * once, and each rendition is scaled from the next larger one. The encoders
+ * run on threads of their own and get keyframes at the same times, so that
+ * the renditions can be switched between at segment boundaries. */
+static void add_ladder(OptionsContext *o, AVFormatContext *oc)
+{
+    LadderRendition r[MAX_LADDER_RENDITIONS] = { { 0 } };
+    InputStream *src = NULL;
+    FilterGraph *fg;
+    AVBPrint desc;
+    char *graph_desc;
+    int i, j, nb_r;
+
+    parse_ladder(o->ladder, r, &nb_r);
+    for (i = 1; i < nb_r; i++)
+        for (j = i; j > 0 && r[j].height > r[j - 1].height; j--)
+            FFSWAP(LadderRendition, r[j], r[j - 1]);
+
+    for (i = 0; i < nb_input_streams; i++) {
+        AVCodecParameters *par = input_streams[i]->st->codecpar;
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO &&
+            !(input_streams[i]->st->disposition & AV_DISPOSITION_ATTACHED_PIC) &&
+            (!src || par->width * par->height >
+                     src->st->codecpar->width * src->st->codecpar->height))
+            src = input_streams[i];
+    }
+    if (!src) {
+        av_log(NULL, AV_LOG_FATAL, "-ladder needs an input video stream.\n");
+        exit_program(1);
+    }
+    plex_link_input_stream(src);
+
+    av_bprint_init(&desc, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&desc, "[%d:%d]", src->file_index, src->st->index);
+    if (o->ladder_filter)
+        av_bprintf(&desc, "%s,", o->ladder_filter);
+    for (i = 0; i < nb_r; i++) {
+        if (r[i].width)
+            av_bprintf(&desc, "scale=%d:%d", r[i].width, r[i].height);
+        else
+            av_bprintf(&desc, "scale=trunc(%d*dar/2)*2:%d", r[i].height, r[i].height);
+        if (i < nb_r - 1)
+            av_bprintf(&desc, ",split[ladder%d_%d][ladder%d_%d_next];[ladder%d_%d_next]",
+                       nb_output_files - 1, i, nb_output_files - 1, i, nb_output_files - 1, i);
+        else
+            av_bprintf(&desc, "[ladder%d_%d]", nb_output_files - 1, i);
+    }
+    if (!av_bprint_is_complete(&desc))
+        exit_program(1);
+
+    GROW_ARRAY(filtergraphs, nb_filtergraphs);
+    if (!(fg = filtergraphs[nb_filtergraphs - 1] = av_mallocz(sizeof(*fg))))
+        exit_program(1);
+    fg->index = nb_filtergraphs - 1;
+    av_bprint_finalize(&desc, &graph_desc);
+    fg->graph_desc = graph_desc;
+    av_log(NULL, AV_LOG_VERBOSE, "Ladder filtergraph: %s\n", fg->graph_desc);
+    if (!fg->graph_desc || init_complex_filtergraph(fg) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Error initializing the ladder filtergraph.\n");
+        exit_program(1);
+    }
+
+    for (i = 0; i < nb_r; i++) {
+        OutputFilter *ofilter = NULL;
+        OutputStream *ost;
+        char label[32];
+
+        snprintf(label, sizeof(label), "ladder%d_%d", nb_output_files - 1, i);
+        for (j = 0; j < fg->nb_outputs && !ofilter; j++)
+            if (!strcmp(fg->outputs[j]->out_tmp->name, label))
+                ofilter = fg->outputs[j];
+        av_assert0(ofilter);
+        init_output_filter(ofilter, o, oc);
+        ost = ofilter->ost;
+        if (r[i].bitrate)
+            av_dict_set(&ost->encoder_opts, "b", r[i].bitrate, 0);
+        if (!ost->forced_keyframes)
+            ost->forced_keyframes = av_asprintf("expr:gte(t,n_forced*%g)", o->ladder_keyint);
+        av_freep(&r[i].bitrate);
+    }
+
+    threaded_encode = 1;
+    o->video_disable = 1;
+}
+//PLEX
+
 static int open_output_file(OptionsContext *o, const char *filename)
 {
     AVFormatContext *oc;
@@ -2223,6 +2372,9 @@ static int open_output_file(OptionsContext *o, const char *filename)
     /* we need to choose the subtitle stream we want to burn in
      (needs to be processed BEFORE the video stream is set up
      as this call will configer the vfilters) */
+
+    if (o->ladder)
+        add_ladder(o, oc);
 //PLEX
 
     if (!o->nb_stream_maps) {
@@ -2608,6 +2760,12 @@ loop_end:
     if (o->mux_preload) {
         av_dict_set_int(&of->opts, "preload", o->mux_preload*AV_TIME_BASE, 0);
     }
+//PLEX
+    // Keep the options, so the output can be reopened in place after a seek.
+    av_dict_copy(&of->header_opts, o->g->format_opts, 0);
+    if (o->mux_preload)
+        av_dict_set_int(&of->header_opts, "preload", o->mux_preload*AV_TIME_BASE, 0);
+//PLEX
     oc->max_delay = (int)(o->mux_max_delay * AV_TIME_BASE);
 
     /* copy metadata */
@@ -3553,6 +3711,18 @@ const OptionDef options[] = {
         "create a complex filtergraph", "graph_description" },
     { "filter_complex_threads", HAS_ARG | OPT_INT,                   { &filter_complex_nbthreads },
         "number of threads for -filter_complex" },
+    { "threaded_decode", OPT_BOOL | OPT_EXPERT,                      { &threaded_decode }, //PLEX
+        "run the decoder of each audio and video input stream on its own thread" },
+    { "threaded_encode", OPT_BOOL | OPT_EXPERT,                      { &threaded_encode }, //PLEX
+        "run the encoder of each audio and video output stream on its own thread" },
+    { "threaded_filter", OPT_BOOL | OPT_EXPERT,                      { &threaded_filter }, //PLEX
+        "run each filtergraph on its own thread" },
+    { "threaded_demux", OPT_BOOL | OPT_EXPERT,                       { &threaded_demux }, //PLEX
+        "read a single input on its own thread (default: unless it is a local file)" },
+    { "chunk_encode", HAS_ARG | OPT_FLOAT | OPT_EXPERT,              { &chunk_encode }, //PLEX
+        "encode video in chunks of that many seconds in parallel (offline only)", "seconds" },
+    { "chunk_threads", HAS_ARG | OPT_INT | OPT_EXPERT,               { &chunk_threads }, //PLEX
+        "number of video chunks encoded at the same time (default: number of CPUs)", "count" },
     { "lavfi",          HAS_ARG | OPT_EXPERT,                        { .func_arg = opt_filter_complex },
         "create a complex filtergraph", "graph_description" },
     { "filter_complex_script", HAS_ARG | OPT_EXPERT,                 { .func_arg = opt_filter_complex_script },
@@ -3580,6 +3750,9 @@ const OptionDef options[] = {
     { "thread_queue_size", HAS_ARG | OPT_INT | OPT_OFFSET | OPT_EXPERT | OPT_INPUT,
                                                                      { .off = OFFSET(thread_queue_size) },
         "set the maximum number of queued packets from the demuxer" },
+    { "thread_queue_bytes", HAS_ARG | OPT_INT64 | OPT_OFFSET | OPT_EXPERT | OPT_INPUT, //PLEX
+                                                                     { .off = OFFSET(thread_queue_bytes) },
+        "set the maximum number of queued bytes from the demuxer" },
     { "find_stream_info", OPT_BOOL | OPT_PERFILE | OPT_INPUT | OPT_EXPERT, { &find_stream_info },
         "read and decode the streams to fill missing information with heuristics" },
 
@@ -3792,6 +3965,15 @@ const OptionDef options[] = {
     { "map_inlineass", HAS_ARG | OPT_EXPERT | OPT_PERFILE | OPT_OUTPUT, { .func_arg = plex_opt_subtitle_stream }, "index of the subtitle stream to burn into the video", "input_file_id:stream_specifier" },
     { "progressurl", HAS_ARG | OPT_EXPERT, { .func_arg = plex_opt_progress_url }, "write progress information via HTTP PUT", "url" },
     { "loglevel_plex", HAS_ARG | OPT_EXPERT, { .func_arg = plex_opt_loglevel}, "log level for messages that will be sent to PMS", "" },
+    { "throttle_speed", HAS_ARG | OPT_EXPERT, { .func_arg = plex_opt_throttle_speed }, "output speed (multiple of realtime) to hold while PMS allows throttling", "speed" },
+    { "throttle_buffer", HAS_ARG | OPT_EXPERT, { .func_arg = plex_opt_throttle_buffer }, "seconds of output that may be produced in a burst after a stall while throttled", "seconds" },
+    { "control_url", HAS_ARG | OPT_STRING | OPT_EXPERT, { &plexContext.control_url }, "listen on URL (unix:path or tcp://host:port) for seek and stop commands", "url" },
+    { "trace_file", HAS_ARG | OPT_EXPERT, { .func_arg = plex_opt_trace_file }, "write a Chrome trace of the transcode to file", "file" },
+    { "thread_budget", HAS_ARG | OPT_INT | OPT_EXPERT, { &plexContext.thread_budget }, "total threads shared by video decoding, filtering and encoding", "count" },
+    { "thread_budget_file", HAS_ARG | OPT_EXPERT, { .func_arg = plex_opt_thread_budget_file }, "share the thread budget with other sessions using file", "file" },
+    { "ladder", HAS_ARG | OPT_STRING | OPT_EXPERT | OPT_OFFSET | OPT_OUTPUT, { .off = OFFSET(ladder) }, "encode the video at several sizes from a single decode", "size[@bitrate],..." },
+    { "ladder_filter", HAS_ARG | OPT_STRING | OPT_EXPERT | OPT_OFFSET | OPT_OUTPUT, { .off = OFFSET(ladder_filter) }, "filters applied once before the ladder renditions are scaled", "filter_graph" },
+    { "ladder_keyint", HAS_ARG | OPT_FLOAT | OPT_EXPERT | OPT_OFFSET | OPT_OUTPUT, { .off = OFFSET(ladder_keyint) }, "seconds between the keyframes shared by all ladder renditions", "seconds" },
     { "hwaccel_fallback_threshold", OPT_VIDEO | OPT_INT | HAS_ARG | OPT_EXPERT |
                                     OPT_SPEC | OPT_INPUT,                    { .off = OFFSET(hwaccel_fallback_thresholds) },
         "set when HW accelerated decoding should forcibly fall back", "fallback" },
@@ -18,6 +18,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#define _DEFAULT_SOURCE // needed for syscall()
+
 #include "plex.h"
 #include "ffmpeg.h"
 
@@ -26,24 +28,72 @@
 #include "strings.h"
 #include "libavcodec/mpegvideo.h"
 #include "libavfilter/vf_inlineass.h"
+#include "libavfilter/framepool.h"
 #include "libavformat/http.h"
 #include "libavutil/timestamp.h"
 #include "libavformat/internal.h"
+#include "libavformat/avio_internal.h"
+#include "libavformat/url.h"
+#include "libavutil/bprint.h"
 #include "libavutil/thread.h"
+#include "libavutil/time.h"
+#include "libavutil/trace.h"
 
-PlexContext plexContext = {0};
+#include <stdatomic.h>
+#if HAVE_FCNTL
+#include <fcntl.h>
+#endif
+#if HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/syscall.h>
+#endif
+#if HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+#if HAVE_SYS_UN_H && HAVE_POLL_H
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+PlexContext plexContext = {
+    .throttle_speed  = 1.0,
+    .throttle_buffer = 5.0,
+};
 
 #define LOG_LINE_SIZE 1024
+#define LOG_MSG_SIZE  2048
 
 #if HAVE_PTHREADS
-static pthread_key_t logging_key, cur_line_key;
+static pthread_key_t logging_key, cur_line_key, log_ring_key;
 static pthread_once_t key_once = PTHREAD_ONCE_INIT;
 
+static void release_log_ring(void *ring);
+
 static void make_keys(void)
 {
     pthread_key_create(&logging_key, NULL);
     pthread_key_create(&cur_line_key, NULL);
+    pthread_key_create(&log_ring_key, release_log_ring);
 }
+#else
+#if !HAVE_THREADS
+#define PLEX_THREAD_LOCAL
+#elif defined(_MSC_VER)
+#define PLEX_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define PLEX_THREAD_LOCAL _Thread_local
+#else
+#define PLEX_THREAD_LOCAL __thread
+#endif
+
+// Set while a thread is inside plex_log_callback() or is the log shipper.
+static PLEX_THREAD_LOCAL int logging = 0;
 #endif
 
 static int av_log_level_plex = AV_LOG_QUIET;
@@ -60,66 +110,459 @@ void av_log_set_level_plex(int level)
     av_log_level_plex = level;
 }
 
-char* PMS_IssueHttpRequest(const char* url, const char* verb)
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Requests to PMS reuse keep-alive connections. Idle connections are parked
+// in a small pool keyed by server, so concurrent callers (progress reporter,
+// log shipper, main thread) each take their own connection instead of
+// waiting on each other.
+#define HTTP_POOL_SIZE 4
+#define HTTP_MAX_REPLY_SIZE (1 << 20)
+
+typedef struct PMSConnection {
+    char server[512];
+    AVIOContext *ioctx;
+} PMSConnection;
+
+static AVMutex http_pool_lock = AV_MUTEX_INITIALIZER;
+static PMSConnection http_pool[HTTP_POOL_SIZE];
+static int http_pool_closed;
+
+static void http_server_key(const char *url, char *key, int key_size)
+{
+    char proto[16], host[256];
+    int port;
+
+    av_url_split(proto, sizeof(proto), NULL, 0, host, sizeof(host),
+                 &port, NULL, 0, url);
+    snprintf(key, key_size, "%s://%s:%d", proto, host, port);
+}
+
+static AVIOContext *http_pool_get(const char *server)
 {
-    char* reply = NULL;
     AVIOContext *ioctx = NULL;
+    int i;
+
+    ff_mutex_lock(&http_pool_lock);
+    for (i = 0; i < HTTP_POOL_SIZE; i++) {
+        if (http_pool[i].ioctx && !strcmp(http_pool[i].server, server)) {
+            ioctx = http_pool[i].ioctx;
+            http_pool[i].ioctx = NULL;
+            break;
+        }
+    }
+    ff_mutex_unlock(&http_pool_lock);
+    return ioctx;
+}
+
+static void http_pool_put(const char *server, AVIOContext *ioctx)
+{
+    int i;
+
+    ff_mutex_lock(&http_pool_lock);
+    for (i = 0; i < HTTP_POOL_SIZE && !http_pool_closed; i++) {
+        if (!http_pool[i].ioctx) {
+            av_strlcpy(http_pool[i].server, server, sizeof(http_pool[i].server));
+            http_pool[i].ioctx = ioctx;
+            ioctx = NULL;
+            break;
+        }
+    }
+    ff_mutex_unlock(&http_pool_lock);
+    avio_close(ioctx);
+}
+
+static void http_pool_close(void)
+{
+    AVIOContext *ioctxs[HTTP_POOL_SIZE];
+    int i;
+
+    // Closing logs, and logging may issue a request through the pool, so the
+    // connections are closed outside the lock. Requests made from here on
+    // don't keep their connection.
+    ff_mutex_lock(&http_pool_lock);
+    http_pool_closed = 1;
+    for (i = 0; i < HTTP_POOL_SIZE; i++) {
+        ioctxs[i] = http_pool[i].ioctx;
+        http_pool[i].ioctx = NULL;
+    }
+    ff_mutex_unlock(&http_pool_lock);
+
+    for (i = 0; i < HTTP_POOL_SIZE; i++)
+        avio_close(ioctxs[i]);
+}
+
+static int http_open_connection(AVIOContext **ioctx, const char* url, const char* verb,
+                                const uint8_t* data, int data_size)
+{
     AVDictionary *settings = NULL;
-    int size = 0;
-    int ret;
     char headers[1024];
     const char *token = getenv("X_PLEX_TOKEN");
+    int ret;
 
-    if (token && *token)
+    if (token && *token) {
         snprintf(headers, sizeof(headers), "X-Plex-Token: %s\r\n", token);
+        av_dict_set(&settings, "headers", headers, 0);
+    }
 
     av_dict_set(&settings, "method", verb, 0);
-    if (token && *token)
-        av_dict_set(&settings, "headers", headers, 0);
+    av_dict_set(&settings, "multiple_requests", "1", 0);
 
-    ret = avio_open2(&ioctx, url, AVIO_FLAG_READ,
-                     NULL,
-                     &settings);
+    if (data && data_size > 0) {
+        // Binary AVOptions are set from hex strings.
+        static const char hexdigits[] = "0123456789ABCDEF";
+        char *hex = av_malloc(2 * data_size + 1);
+        int i;
 
-    if (ret < 0)
-        goto fail;
+        if (!hex) {
+            av_dict_free(&settings);
+            return AVERROR(ENOMEM);
+        }
+        for (i = 0; i < data_size; i++) {
+            hex[2 * i]     = hexdigits[data[i] >> 4];
+            hex[2 * i + 1] = hexdigits[data[i] & 0xF];
+        }
+        hex[2 * data_size] = 0;
+        av_dict_set(&settings, "post_data", hex, AV_DICT_DONT_STRDUP_VAL);
+        av_dict_set(&settings, "content_type", "text/plain", 0);
+    }
 
-    size = avio_size(ioctx);
-    if (size < 0)
-        size = 4095;
-    else if (!size)
-        goto fail;
+    ret = avio_open2(ioctx, url, AVIO_FLAG_READ, NULL, &settings);
+    av_dict_free(&settings);
+    return ret;
+}
+
+static int http_reuse_connection(AVIOContext *ioctx, const char* url, const char* verb,
+                                 const uint8_t* data, int data_size)
+{
+    int ret;
 
-    reply = av_malloc(size + 1);
-    if (!reply)
-        goto fail;
+    // A leftover content type is harmless on requests without a body.
+    if ((ret = av_opt_set(ioctx, "method", verb, AV_OPT_SEARCH_CHILDREN)) < 0 ||
+        (ret = av_opt_set_bin(ioctx, "post_data", data, data ? data_size : 0,
+                              AV_OPT_SEARCH_CHILDREN)) < 0)
+        return ret;
+    if (data && data_size > 0 &&
+        (ret = av_opt_set(ioctx, "content_type", "text/plain", AV_OPT_SEARCH_CHILDREN)) < 0)
+        return ret;
 
-    ret = avio_read(ioctx, reply, size);
+    return ffio_http_new_request(ioctx, url);
+}
 
+static int is_http_status_error(int err)
+{
+    return err == AVERROR_HTTP_BAD_REQUEST || err == AVERROR_HTTP_UNAUTHORIZED ||
+           err == AVERROR_HTTP_FORBIDDEN   || err == AVERROR_HTTP_NOT_FOUND    ||
+           err == AVERROR_HTTP_OTHER_4XX   || err == AVERROR_HTTP_SERVER_ERROR;
+}
+
+static char* PMS_IssueHttpRequestWithData(const char* url, const char* verb,
+                                          const uint8_t* data, int data_size)
+{
+    char server[512];
+    AVIOContext *ioctx;
+    AVBPrint reply;
+    char *str = NULL;
+    int ret = AVERROR(EINVAL);
+
+    http_server_key(url, server, sizeof(server));
+
+    // An idle connection may have been closed by the server in the meantime;
+    // in that case the request is retried once on a new connection.
+    ioctx = http_pool_get(server);
+    if (ioctx) {
+        ret = http_reuse_connection(ioctx, url, verb, data, data_size);
+        if (ret < 0)
+            avio_closep(&ioctx);
+    }
+    if (!ioctx && !is_http_status_error(ret))
+        ret = http_open_connection(&ioctx, url, verb, data, data_size);
     if (ret < 0)
-        goto fail;
+        return NULL;
 
-    reply[ret] = 0;
+    av_bprint_init(&reply, 0, AV_BPRINT_SIZE_UNLIMITED);
+    ret = avio_read_to_bprint(ioctx, &reply, HTTP_MAX_REPLY_SIZE);
 
-    avio_close(ioctx);
-    av_dict_free(&settings);
-    return reply;
+    // Only a connection whose reply was fully consumed can be reused.
+    if (ret >= 0 && ioctx->eof_reached && !ioctx->error)
+        http_pool_put(server, ioctx);
+    else
+        avio_close(ioctx);
 
-fail:
-    avio_close(ioctx);
-    av_dict_free(&settings);
-    if (reply)
-        av_free(reply);
+    if (ret >= 0 && reply.len && av_bprint_is_complete(&reply))
+        av_bprint_finalize(&reply, &str);
+    else
+        av_bprint_finalize(&reply, NULL);
+    return str;
+}
+
+char* PMS_IssueHttpRequest(const char* url, const char* verb)
+{
+    return PMS_IssueHttpRequestWithData(url, verb, NULL, 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Log lines are queued and shipped to PMS by a background thread, so logging
+// from codec or filter threads never waits on HTTP or on each other. Each
+// logging thread owns a small ring that only it writes and only the shipper
+// reads, so queueing a line takes no lock. The shipper drains every ring,
+// puts the lines back in the order they were logged and sends them over a
+// kept-alive connection. A full ring drops its oldest line; drops are counted
+// and reported.
+#define LOG_RING_SIZE 32
+#define PMS_LOG_URL "http://127.0.0.1:32400/log"
+
+typedef struct LogEntry {
+    unsigned seq;
+    int level;
+    char msg[LOG_MSG_SIZE];
+} LogEntry;
+
+static void send_log_line(int level, const char *msg)
+{
+    char url[4096];
+    AVBPrint dstbuf;
+
+    av_bprint_init_for_buffer(&dstbuf, url, sizeof(url));
+
+    // Build the URL.
+    av_bprintf(&dstbuf, PMS_LOG_URL "?level=%d&source=Transcoder&message=", level);
+    av_bprint_escape(&dstbuf, msg, NULL, AV_ESCAPE_MODE_URL, 0);
+
+    // Issue the request.
+    av_free(PMS_IssueHttpRequest(url, "GET"));
+}
+
+#if HAVE_THREADS
+typedef struct LogRing {
+    LogEntry entries[LOG_RING_SIZE];
+    atomic_uint head;       ///< next entry the shipper takes
+    atomic_uint tail;       ///< next entry the owner writes
+    atomic_uint dropped;
+    atomic_int owned;       ///< cleared when the owning thread exits
+    struct LogRing *next;
+} LogRing;
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_uintptr_t rings; ///< list of LogRing, only ever grows
+    atomic_uint seq;
+    atomic_int wake;
+    atomic_int running;
+    int exiting;
+} shipper;
+
+static AVOnce shipper_once = AV_ONCE_INIT;
+static atomic_int shipper_initialized = ATOMIC_VAR_INIT(0);
+
+#if HAVE_PTHREADS
+static void release_log_ring(void *ring)
+{
+    atomic_store(&((LogRing *)ring)->owned, 0);
+}
+#endif
+
+// Rings are never freed: threads still running at uninit may hold theirs.
+// With pthreads the ring of an exited thread is handed to the next new one.
+static LogRing *get_log_ring(void)
+{
+    uintptr_t first;
+#if HAVE_PTHREADS
+    LogRing *ring;
+    pthread_once(&key_once, make_keys);
+    ring = pthread_getspecific(log_ring_key);
+#else
+    static PLEX_THREAD_LOCAL LogRing *thread_ring;
+    LogRing *ring = thread_ring;
+#endif
+
+    if (ring)
+        return ring;
+
+    for (ring = (LogRing *)atomic_load(&shipper.rings); ring; ring = ring->next) {
+        int owned = 0;
+        if (atomic_compare_exchange_strong(&ring->owned, &owned, 1))
+            break;
+    }
+    if (!ring) {
+        if (!(ring = av_mallocz(sizeof(*ring))))
+            return NULL;
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->dropped, 0);
+        atomic_init(&ring->owned, 1);
+        first = atomic_load(&shipper.rings);
+        do {
+            ring->next = (LogRing *)first;
+        } while (!atomic_compare_exchange_weak(&shipper.rings, &first, (uintptr_t)ring));
+    }
+
+#if HAVE_PTHREADS
+    pthread_setspecific(log_ring_key, ring);
+#else
+    thread_ring = ring;
+#endif
+    return ring;
+}
+
+static void push_log_line(LogRing *ring, int level, const char *msg)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load(&ring->head);
+    LogEntry *e;
+
+    // Drop the oldest line; if the shipper took it meanwhile there is room.
+    // Either way head moves before its entry is overwritten, so the shipper
+    // discards a copy it was making of it.
+    if (tail - head == LOG_RING_SIZE &&
+        atomic_compare_exchange_strong(&ring->head, &head, head + 1))
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+
+    e = &ring->entries[tail % LOG_RING_SIZE];
+    e->seq   = atomic_fetch_add_explicit(&shipper.seq, 1, memory_order_relaxed);
+    e->level = level;
+    av_strlcpy(e->msg, msg, sizeof(e->msg));
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    // The lock is only taken to wake an idle shipper.
+    if (!atomic_exchange(&shipper.wake, 1)) {
+        pthread_mutex_lock(&shipper.lock);
+        pthread_cond_signal(&shipper.cond);
+        pthread_mutex_unlock(&shipper.lock);
+    }
+}
+
+// Move the lines queued in ring to the end of *batch.
+static int take_log_lines(LogRing *ring, LogEntry **batch, unsigned *batch_size,
+                          int *nb_entries)
+{
+    unsigned head = atomic_load(&ring->head);
+
+    while (head != atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+        LogEntry *e = av_fast_realloc(*batch, batch_size, (*nb_entries + 1) * sizeof(**batch));
+        if (!e)
+            return AVERROR(ENOMEM);
+        *batch = e;
+        e += *nb_entries;
+
+        *e = ring->entries[head % LOG_RING_SIZE];
+        // Fails if the owner dropped the entry while it was copied; head is
+        // then reloaded.
+        if (atomic_compare_exchange_strong(&ring->head, &head, head + 1)) {
+            (*nb_entries)++;
+            head++;
+        }
+    }
+    return 0;
+}
+
+static int cmp_log_seq(const void *a, const void *b)
+{
+    int d = (int)(((const LogEntry *)a)->seq - ((const LogEntry *)b)->seq);
+    return (d > 0) - (d < 0);
+}
+
+static void *log_shipper_thread(void *arg)
+{
+    LogEntry *batch = NULL;
+    unsigned batch_size = 0;
+    int exiting = 0;
+
+#if HAVE_PTHREADS
+    // Anything logged while shipping (e.g. connection errors) must not be
+    // queued again.
+    pthread_once(&key_once, make_keys);
+    pthread_setspecific(logging_key, (void*)1);
+#else
+    logging = 1;
+#endif
+
+    while (!exiting) {
+        LogRing *ring;
+        unsigned dropped = 0;
+        int i, nb_entries = 0;
+
+        pthread_mutex_lock(&shipper.lock);
+        while (!atomic_load(&shipper.wake) && !shipper.exiting)
+            pthread_cond_wait(&shipper.cond, &shipper.lock);
+        exiting = shipper.exiting;
+        pthread_mutex_unlock(&shipper.lock);
+
+        // Cleared before draining, so lines queued from here on wake us again.
+        atomic_store(&shipper.wake, 0);
+
+        for (ring = (LogRing *)atomic_load(&shipper.rings); ring; ring = ring->next) {
+            take_log_lines(ring, &batch, &batch_size, &nb_entries);
+            dropped += atomic_exchange(&ring->dropped, 0);
+        }
+        qsort(batch, nb_entries, sizeof(*batch), cmp_log_seq);
+
+        if (dropped) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "%u log lines dropped", dropped);
+            send_log_line(LOG_LEVEL_WARNING, msg);
+        }
+        for (i = 0; i < nb_entries; i++)
+            send_log_line(batch[i].level, batch[i].msg);
+    }
+
+    av_free(batch);
     return NULL;
 }
 
+static void log_shipper_init(void)
+{
+    pthread_mutex_init(&shipper.lock, NULL);
+    pthread_cond_init(&shipper.cond, NULL);
+    atomic_init(&shipper.rings, 0);
+    atomic_init(&shipper.seq, 0);
+    atomic_init(&shipper.wake, 0);
+    atomic_init(&shipper.running, 0);
+    atomic_store(&shipper_initialized, 1);
+
+    if (!pthread_create(&shipper.thread, NULL, log_shipper_thread, NULL))
+        atomic_store(&shipper.running, 1);
+}
+
+static void log_shipper_uninit(void)
+{
+    int running = atomic_exchange(&shipper.running, 0);
+
+    pthread_mutex_lock(&shipper.lock);
+    shipper.exiting = 1;
+    pthread_cond_signal(&shipper.cond);
+    pthread_mutex_unlock(&shipper.lock);
+
+    // The shipper drains the rings before exiting; later lines are sent
+    // synchronously.
+    if (running)
+        pthread_join(shipper.thread, NULL);
+}
+#endif
+
+static void queue_log_line(int level, const char *msg)
+{
+#if HAVE_THREADS
+    LogRing *ring;
+
+    ff_thread_once(&shipper_once, log_shipper_init);
+
+    if (!atomic_load(&shipper.running) || !(ring = get_log_ring())) {
+        send_log_line(level, msg);
+        return;
+    }
+    push_log_line(ring, level, msg);
+#else
+    send_log_line(level, msg);
+#endif
+}
+
 void PMS_Log(LogLevel level, const char* format, ...)
 {
     // Format the mesage.
-    char msg[2048];
-    char url[4096];
+    char msg[LOG_MSG_SIZE];
     va_list va;
-    AVBPrint dstbuf;
     if (av_log_level_plex == AV_LOG_QUIET)
         return;
 
@@ -127,14 +570,409 @@ void PMS_Log(LogLevel level, const char* format, ...)
     vsnprintf(msg, sizeof(msg), format, va);
     va_end(va);
 
-    av_bprint_init_for_buffer(&dstbuf, url, sizeof(url));
+    queue_log_line(level, msg);
+}
 
-    // Build the URL.
-    av_bprintf(&dstbuf, "http://127.0.0.1:32400/log?level=%d&source=Transcoder&message=", level);
-    av_bprint_escape(&dstbuf, msg, NULL, AV_ESCAPE_MODE_URL, 0);
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Progress reporting runs on its own thread so a slow PMS never stalls the
+// transcode loop. The mailbox only holds the newest progress URL; older ones
+// that were never sent are simply replaced. Stream reports go through the
+// same thread, but all of them are kept and sent in order ahead of progress;
+// so is the duration report.
+static atomic_int progress_can_throttle = ATOMIC_VAR_INIT(0);
 
-    // Issue the request.
-    av_free(PMS_IssueHttpRequest(url, "GET"));
+static void report_progress_now(const char *url)
+{
+    char *reply = PMS_IssueHttpRequest(url, "PUT");
+    atomic_store(&progress_can_throttle, reply && strstr(reply, "canThrottle"));
+    av_free(reply);
+}
+
+#if HAVE_THREADS
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *pending;
+    char **reports;         ///< stream and duration report URLs, oldest first
+    int nb_reports;
+    int started;
+    int exiting;
+} reporter;
+
+static void *progress_reporter_thread(void *arg)
+{
+    pthread_mutex_lock(&reporter.lock);
+    while (1) {
+        char *url, **reports;
+        int i, nb_reports;
+
+        while (!reporter.pending && !reporter.nb_reports && !reporter.exiting)
+            pthread_cond_wait(&reporter.cond, &reporter.lock);
+        if (!reporter.pending && !reporter.nb_reports)
+            break;
+
+        url        = reporter.pending;
+        reports    = reporter.reports;
+        nb_reports = reporter.nb_reports;
+        reporter.pending    = NULL;
+        reporter.reports    = NULL;
+        reporter.nb_reports = 0;
+        pthread_mutex_unlock(&reporter.lock);
+
+        for (i = 0; i < nb_reports; i++) {
+            av_free(PMS_IssueHttpRequest(reports[i], "PUT"));
+            av_free(reports[i]);
+        }
+        av_free(reports);
+        if (url) {
+            report_progress_now(url);
+            av_free(url);
+        }
+
+        pthread_mutex_lock(&reporter.lock);
+    }
+    pthread_mutex_unlock(&reporter.lock);
+    return NULL;
+}
+
+static int progress_reporter_start(void)
+{
+    int ret;
+
+    if (reporter.started)
+        return 0;
+
+    pthread_mutex_init(&reporter.lock, NULL);
+    pthread_cond_init(&reporter.cond, NULL);
+    if ((ret = pthread_create(&reporter.thread, NULL, progress_reporter_thread, NULL))) {
+        av_log(NULL, AV_LOG_WARNING, "Unable to start progress reporter thread: %s\n",
+               strerror(ret));
+        pthread_cond_destroy(&reporter.cond);
+        pthread_mutex_destroy(&reporter.lock);
+        return AVERROR(ret);
+    }
+    reporter.started = 1;
+    return 0;
+}
+#endif
+
+void plex_report_progress(const char *url)
+{
+#if HAVE_THREADS
+    char *copy;
+
+    if (progress_reporter_start() < 0 || !(copy = av_strdup(url))) {
+        report_progress_now(url);
+        return;
+    }
+
+    pthread_mutex_lock(&reporter.lock);
+    av_free(reporter.pending);
+    reporter.pending = copy;
+    pthread_cond_signal(&reporter.cond);
+    pthread_mutex_unlock(&reporter.lock);
+#else
+    report_progress_now(url);
+#endif
+}
+
+int plex_can_throttle(void)
+{
+    return atomic_load(&progress_can_throttle);
+}
+
+static void queue_report(const char *url)
+{
+#if HAVE_THREADS
+    char *copy;
+    int ret;
+
+    if (progress_reporter_start() >= 0 && (copy = av_strdup(url))) {
+        pthread_mutex_lock(&reporter.lock);
+        ret = av_dynarray_add_nofree(&reporter.reports, &reporter.nb_reports, copy);
+        pthread_cond_signal(&reporter.cond);
+        pthread_mutex_unlock(&reporter.lock);
+        if (ret >= 0)
+            return;
+        av_free(copy);
+    }
+#endif
+    av_free(PMS_IssueHttpRequest(url, "PUT"));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Per-stage timing. Wall time shows where the pipeline waits; CPU time is
+// that of the thread running the stage, so the work of codec worker threads
+// only shows up in the process total of the final summary.
+static const char *const stage_names[PLEX_STAGE_NB] = {
+    "demux", "decode", "filter", "encode", "mux",
+};
+
+static int stage_stats_enabled(void)
+{
+    return plexContext.progress_url || do_benchmark || plexContext.thread_budget > 0;
+}
+
+static int64_t thread_cputime(void)
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+    return 0;
+}
+
+void plex_stage_begin(PlexStageClock *clock)
+{
+    if (!stage_stats_enabled()) {
+        clock->wall = AV_NOPTS_VALUE;
+        return;
+    }
+    clock->wall = av_gettime_relative();
+    clock->cpu  = thread_cputime();
+}
+
+void plex_stage_end(PlexStageTimes *times, enum PlexStage stage, const PlexStageClock *clock)
+{
+    if (clock->wall == AV_NOPTS_VALUE)
+        return;
+    atomic_fetch_add_explicit(&times->wall[stage], av_gettime_relative() - clock->wall,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&times->cpu[stage], thread_cputime() - clock->cpu,
+                              memory_order_relaxed);
+}
+
+static void stage_times_add(int64_t *wall, int64_t *cpu, PlexStageTimes *times)
+{
+    int i;
+    for (i = 0; i < PLEX_STAGE_NB; i++) {
+        wall[i] += atomic_load_explicit(&times->wall[i], memory_order_relaxed);
+        cpu[i]  += atomic_load_explicit(&times->cpu[i], memory_order_relaxed);
+    }
+}
+
+static void stage_totals(int64_t *wall, int64_t *cpu)
+{
+    int i;
+
+    memset(wall, 0, PLEX_STAGE_NB * sizeof(*wall));
+    memset(cpu,  0, PLEX_STAGE_NB * sizeof(*cpu));
+    for (i = 0; i < nb_input_files; i++)
+        stage_times_add(wall, cpu, &input_files[i]->plex_times);
+    for (i = 0; i < nb_input_streams; i++)
+        stage_times_add(wall, cpu, &input_streams[i]->plex_times);
+    for (i = 0; i < nb_filtergraphs; i++)
+        stage_times_add(wall, cpu, &filtergraphs[i]->plex_times);
+    for (i = 0; i < nb_output_streams; i++)
+        stage_times_add(wall, cpu, &output_streams[i]->plex_times);
+}
+
+// Packets waiting in the input thread queues and in the muxing queues.
+static void queue_depths(int *in, int *mux)
+{
+    int i;
+
+    *in = *mux = 0;
+#if HAVE_THREADS
+    for (i = 0; i < nb_input_files; i++)
+        if (input_files[i]->in_thread_queue)
+            *in += FFMAX(av_thread_message_queue_nb_elems(input_files[i]->in_thread_queue), 0);
+#endif
+    for (i = 0; i < nb_output_streams; i++)
+        if (output_streams[i]->muxing_queue)
+            *mux += av_fifo_size(output_streams[i]->muxing_queue) / sizeof(AVPacket);
+}
+
+void plex_append_stage_stats(char *url, int size)
+{
+    int64_t wall[PLEX_STAGE_NB], cpu[PLEX_STAGE_NB];
+    int i, in, mux;
+
+    stage_totals(wall, cpu);
+    for (i = 0; i < PLEX_STAGE_NB; i++)
+        av_strlcatf(url, size, "&%s_ms=%"PRId64"&%s_cpu_ms=%"PRId64,
+                    stage_names[i], wall[i] / 1000, stage_names[i], cpu[i] / 1000);
+    queue_depths(&in, &mux);
+    av_strlcatf(url, size, "&queue_in=%d&queue_mux=%d", in, mux);
+}
+
+static void print_stage_times(int level, const char *prefix, PlexStageTimes *times)
+{
+    int64_t wall[PLEX_STAGE_NB] = { 0 }, cpu[PLEX_STAGE_NB] = { 0 };
+    char line[256];
+    int i;
+
+    stage_times_add(wall, cpu, times);
+    line[0] = 0;
+    for (i = 0; i < PLEX_STAGE_NB; i++)
+        if (wall[i])
+            av_strlcatf(line, sizeof(line), " %s %"PRId64"/%"PRId64,
+                        stage_names[i], wall[i] / 1000, cpu[i] / 1000);
+    if (line[0])
+        av_log(NULL, level, "  %s:%s\n", prefix, line);
+}
+
+void plex_print_stage_summary(void)
+{
+    int level = do_benchmark ? AV_LOG_INFO : AV_LOG_VERBOSE;
+    PlexStageTimes total = { { 0 } };
+    int64_t wall[PLEX_STAGE_NB], cpu[PLEX_STAGE_NB];
+    char prefix[64];
+    int i;
+
+    if (!stage_stats_enabled())
+        return;
+
+    av_log(NULL, level, "Time per stage in ms (wall/thread cpu):\n");
+    for (i = 0; i < nb_input_files; i++) {
+        snprintf(prefix, sizeof(prefix), "input #%d", i);
+        print_stage_times(level, prefix, &input_files[i]->plex_times);
+    }
+    for (i = 0; i < nb_input_streams; i++) {
+        InputStream *ist = input_streams[i];
+        snprintf(prefix, sizeof(prefix), "input #%d:%d", ist->file_index, ist->st->index);
+        print_stage_times(level, prefix, &ist->plex_times);
+    }
+    for (i = 0; i < nb_filtergraphs; i++) {
+        snprintf(prefix, sizeof(prefix), "graph #%d", i);
+        print_stage_times(level, prefix, &filtergraphs[i]->plex_times);
+    }
+    for (i = 0; i < nb_output_streams; i++) {
+        OutputStream *ost = output_streams[i];
+        snprintf(prefix, sizeof(prefix), "output #%d:%d", ost->file_index, ost->index);
+        print_stage_times(level, prefix, &ost->plex_times);
+    }
+
+    stage_totals(wall, cpu);
+    for (i = 0; i < PLEX_STAGE_NB; i++) {
+        atomic_init(&total.wall[i], wall[i]);
+        atomic_init(&total.cpu[i], cpu[i]);
+    }
+    print_stage_times(level, "total", &total);
+
+#if HAVE_GETRUSAGE
+    {
+        struct rusage rusage;
+        int64_t ms;
+
+        getrusage(RUSAGE_SELF, &rusage);
+        ms = (rusage.ru_utime.tv_sec + rusage.ru_stime.tv_sec) * 1000LL +
+             (rusage.ru_utime.tv_usec + rusage.ru_stime.tv_usec) / 1000;
+        av_log(NULL, level, "  process cpu: %"PRId64" ms\n", ms);
+    }
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// With -thread_budget_file, every session sharing the file holds a write lock
+// on one byte of it; the locks go away with the process however it exits, so
+// counting the locked bytes counts the live sessions.
+#define BUDGET_MAX_SESSIONS 256
+
+static int budget_fd = -1;
+
+int plex_opt_thread_budget_file(void *optctx, const char *opt, const char *arg)
+{
+#if HAVE_FCNTL
+    struct flock fl = { 0 };
+    int fd, i;
+
+    if (budget_fd >= 0)
+        return 0;
+    if ((fd = open(arg, O_RDWR | O_CREAT, 0666)) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not open thread budget file %s: %s\n",
+               arg, strerror(errno));
+        return 0;
+    }
+    fl.l_type   = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_len    = 1;
+    for (i = 0; i < BUDGET_MAX_SESSIONS; i++) {
+        fl.l_start = i;
+        if (!fcntl(fd, F_SETLK, &fl)) {
+            budget_fd = fd;
+            return 0;
+        }
+    }
+    close(fd);
+    av_log(NULL, AV_LOG_WARNING, "All %d sessions of thread budget file %s are taken\n",
+           BUDGET_MAX_SESSIONS, arg);
+#else
+    av_log(NULL, AV_LOG_WARNING, "Thread budget files are not supported on this platform\n");
+#endif
+    return 0;
+}
+
+static int budget_sessions(void)
+{
+    int nb_sessions = 1;
+#if HAVE_FCNTL
+    int i;
+
+    // Our own lock never conflicts with F_GETLK, so it is counted above.
+    for (i = 0; budget_fd >= 0 && i < BUDGET_MAX_SESSIONS; i++) {
+        struct flock fl = { 0 };
+        fl.l_type   = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start  = i;
+        fl.l_len    = 1;
+        if (!fcntl(budget_fd, F_GETLK, &fl) && fl.l_type != F_UNLCK)
+            nb_sessions++;
+    }
+#endif
+    return nb_sessions;
+}
+
+int plex_thread_share(enum PlexStage stage)
+{
+    // Relative cost of one instance of each stage before any was measured.
+    static const int default_cost[PLEX_STAGE_NB] = {
+        [PLEX_STAGE_DECODE] = 1, [PLEX_STAGE_FILTER] = 1, [PLEX_STAGE_ENCODE] = 2,
+    };
+    int64_t wall[PLEX_STAGE_NB], cpu[PLEX_STAGE_NB], cost[PLEX_STAGE_NB], total_cost = 0;
+    int users[PLEX_STAGE_NB] = { 0 };
+    int i, j, budget, measured, threads;
+
+    if (plexContext.thread_budget <= 0)
+        return 0;
+    budget = FFMAX(plexContext.thread_budget / budget_sessions(), 1);
+
+    for (i = 0; i < nb_input_streams; i++)
+        if (input_streams[i]->decoding_needed &&
+            input_streams[i]->st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            users[PLEX_STAGE_DECODE]++;
+    for (i = 0; i < nb_filtergraphs; i++)
+        for (j = 0; j < filtergraphs[i]->nb_outputs; j++) {
+            OutputFilter *ofilter = filtergraphs[i]->outputs[j];
+            // Simple graphs only know their type through the output stream.
+            if ((ofilter->ost ? ofilter->ost->st->codecpar->codec_type : ofilter->type) == AVMEDIA_TYPE_VIDEO) {
+                users[PLEX_STAGE_FILTER]++;
+                break;
+            }
+        }
+    for (i = 0; i < nb_output_streams; i++)
+        if (output_streams[i]->encoding_needed &&
+            output_streams[i]->st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            users[PLEX_STAGE_ENCODE]++;
+    users[stage] = FFMAX(users[stage], 1);
+
+    // Wall time rather than thread CPU time, since the work of frame and
+    // slice threads is only seen as time spent waiting for them.
+    stage_totals(wall, cpu);
+    measured = wall[PLEX_STAGE_DECODE] + wall[PLEX_STAGE_FILTER] +
+               wall[PLEX_STAGE_ENCODE] >= 1000000;
+    for (i = PLEX_STAGE_DECODE; i <= PLEX_STAGE_ENCODE; i++) {
+        cost[i] = !users[i] ? 0 : measured ? wall[i] : default_cost[i] * users[i];
+        total_cost += cost[i];
+    }
+
+    threads = total_cost ? budget * cost[stage] / total_cost / users[stage] : 1;
+    threads = FFMAX(threads, 1);
+    av_log(NULL, AV_LOG_VERBOSE, "Thread budget: %d of %d threads for each of %d %s stage(s)%s\n",
+           threads, budget, users[stage], stage_names[stage], measured ? "" : " (estimated)");
+    return threads;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -148,8 +986,7 @@ static void plex_log_callback(void* ptr, int level, const char* fmt, va_list vl)
     char *cur_line;
     pthread_once(&key_once, make_keys);
 #else
-    static __thread char cur_line[LOG_LINE_SIZE] = {0};
-    static __thread int logging = 0;
+    static PLEX_THREAD_LOCAL char cur_line[LOG_LINE_SIZE] = {0};
 #endif
 
     va_copy(vl2, vl);
@@ -205,7 +1042,7 @@ void plex_report_stream(const AVStream *st)
                  plexContext.progress_url, st->index, st->id,
                  avcodec_get_name(st->codecpar->codec_id),
                  av_get_media_type_string(st->codecpar->codec_type));
-        av_free(PMS_IssueHttpRequest(url, "PUT"));
+        queue_report(url);
     }
 }
 
@@ -303,14 +1140,51 @@ void plex_report_stream_detail(const AVStream *st)
         SEND_DISPOSITION(TIMED_THUMBNAILS, "timed_thumbnails");
 
 
-        av_free(PMS_IssueHttpRequest(url, "PUT"));
+        queue_report(url);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void plex_init(void)
+{
+    av_log_set_callback(plex_log_callback);
+}
+
+static void control_uninit(void);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void plex_uninit(void)
+{
+    control_uninit();
+
+#if HAVE_THREADS
+    // Let the reporter deliver the last posted progress (usually the final
+    // report) before shutting it down.
+    if (reporter.started) {
+        pthread_mutex_lock(&reporter.lock);
+        reporter.exiting = 1;
+        pthread_cond_signal(&reporter.cond);
+        pthread_mutex_unlock(&reporter.lock);
+
+        pthread_join(reporter.thread, NULL);
+        pthread_cond_destroy(&reporter.cond);
+        pthread_mutex_destroy(&reporter.lock);
+        reporter.started = 0;
+    }
+
+    if (atomic_load(&shipper_initialized))
+        log_shipper_uninit();
+#endif
+
+    if (plexContext.trace_file) {
+        int ret = avpriv_trace_write(plexContext.trace_file);
+        if (ret < 0)
+            av_log(NULL, AV_LOG_ERROR, "Error writing trace to %s: %s\n",
+                   plexContext.trace_file, av_err2str(ret));
+        av_freep(&plexContext.trace_file);
     }
-}
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void plex_init(void)
-{
-    av_log_set_callback(plex_log_callback);
+    http_pool_close();
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -349,6 +1223,10 @@ void plex_link_subtitles_to_graph(AVFilterGraph* g)
                     InputStream *ist = input_streams[j];
                     if (ist->st->codecpar->codec_type == AVMEDIA_TYPE_ATTACHMENT)
                         avfilter_inlineass_add_attachment(ctx, ist->st);
+                    // The styles pick the fonts, so read them before the fonts are set.
+                    if (ist->file_index == assCtx->file_index &&
+                        ist->st->index == assCtx->stream_index && ist->dec_ctx)
+                        avfilter_inlineass_process_header(ctx, ist->dec_ctx);
                     if (ist->file_index == assCtx->file_index &&
                         ist->st->index == assCtx->stream_index &&
                         ist->sub2video.sub_queue) {
@@ -408,6 +1286,19 @@ finish:
     return 0;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#if CONFIG_INLINEASS_FILTER
+// The filters of a graph running on its own thread are only touched from
+// here once that thread is idle.
+static void plex_sync_filtergraph(const AVFilterGraph *graph)
+{
+    int i;
+    for (i = 0; i < nb_filtergraphs; i++)
+        if (filtergraphs[i]->graph == graph)
+            filtergraph_thread_sync(filtergraphs[i]);
+}
+#endif
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 int plex_process_subtitles(const InputStream *ist, AVSubtitle *sub)
 {
@@ -421,6 +1312,7 @@ int plex_process_subtitles(const InputStream *ist, AVSubtitle *sub)
             ist->file_index == ctx->file_index) {
             if (!ctx->ctx)
                 return 1;
+            plex_sync_filtergraph(ctx->ctx->graph);
             avfilter_inlineass_append_data(ctx->ctx, ist->dec_ctx, sub);
             return 2;
         }
@@ -443,6 +1335,34 @@ int plex_opt_loglevel(void *o, const char *opt, const char *arg)
     return 0;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int plex_opt_throttle_speed(void *optctx, const char *opt, const char *arg)
+{
+    plexContext.throttle_speed = parse_number_or_die(opt, arg, OPT_FLOAT, 0.01, 1000);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int plex_opt_throttle_buffer(void *optctx, const char *opt, const char *arg)
+{
+    plexContext.throttle_buffer = parse_number_or_die(opt, arg, OPT_FLOAT, 0, 3600);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int plex_opt_trace_file(void *optctx, const char *opt, const char *arg)
+{
+    int ret = avpriv_trace_start();
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Tracing is not available: %s\n", av_err2str(ret));
+        return 0;
+    }
+    av_free(plexContext.trace_file);
+    if (!(plexContext.trace_file = av_strdup(arg)))
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void plex_feedback(const AVFormatContext *ic)
 {
@@ -452,8 +1372,777 @@ void plex_feedback(const AVFormatContext *ic)
         if (ic && ic->duration != AV_NOPTS_VALUE)
             duration = ic->duration / (double)AV_TIME_BASE;
         snprintf(url, sizeof(url), "%s?duration=%f", plexContext.progress_url, duration);
-        av_free(PMS_IssueHttpRequest(url, "PUT"));
+        queue_report(url);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// While PMS allows throttling, output is paced by a token bucket counted in
+// microseconds of output media time. Tokens refill at throttle_speed times
+// the elapsed wall-clock time, up to throttle_buffer seconds, and writing
+// output consumes them. The transcode loop only sleeps once the bucket is
+// empty, so the resulting speed does not depend on the packet rate.
+// Throttling starts with an empty bucket, and one left over from an earlier
+// throttled period is never refilled in between, so canThrottle toggling
+// near PMS's threshold doesn't hand out a burst on every toggle.
+static struct {
+    int active;
+    int rebase;
+    int64_t last_output;
+    int64_t last_wall;
+    double tokens;
+} pacer;
+
+static int64_t get_output_time(void)
+{
+    int64_t pts = AV_NOPTS_VALUE;
+    int i;
+
+    for (i = 0; i < nb_output_streams; i++) {
+        OutputStream *ost = output_streams[i];
+        int64_t end = av_stream_get_end_pts(ost->st);
+        if (end != AV_NOPTS_VALUE) {
+            end = av_rescale_q(end, ost->st->time_base, AV_TIME_BASE_Q);
+            if (pts == AV_NOPTS_VALUE || end > pts)
+                pts = end;
+        }
+    }
+    return pts;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sloth mode: while throttled, the process drops to the idle I/O class and,
+// where it can be undone later, to the lowest CPU priority. Idle filter frame
+// pools and freed heap memory are handed back to the system, so that idle
+// sessions don't compete with the ones that are catching up.
+#define SLOTH_NICE 19
+#define SLOTH_MAX_THREADS 256
+
+#ifdef __linux__
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_IDLE   3
+#endif
+
+typedef struct SlothThread {
+    int tid;
+    int nice;       ///< original nice value, INT_MIN if left alone
+    int ioprio;     ///< original I/O priority, -1 if left alone
+} SlothThread;
+
+static SlothThread sloth_threads[SLOTH_MAX_THREADS];
+static int nb_sloth_threads;
+
+#if HAVE_SYS_RESOURCE_H
+// Lowering the nice value again needs privileges or RLIMIT_NICE headroom;
+// don't drop the priority at all if we couldn't restore it afterwards.
+static int sloth_can_restore(int nice)
+{
+#ifdef RLIMIT_NICE
+    struct rlimit rl;
+    if (!getrlimit(RLIMIT_NICE, &rl) &&
+        (rl.rlim_cur == RLIM_INFINITY || (int64_t)rl.rlim_cur >= 20 - nice))
+        return 1;
+#endif
+    return geteuid() == 0;
+}
+#endif
+
+// On Linux both priorities are per thread (tid), elsewhere per process (0).
+static void sloth_lower_thread(int tid)
+{
+    SlothThread *t;
+    int nice;
+
+    if (nb_sloth_threads == SLOTH_MAX_THREADS)
+        return;
+    t = &sloth_threads[nb_sloth_threads++];
+    t->tid    = tid;
+    t->nice   = INT_MIN;
+    t->ioprio = -1;
+
+#if HAVE_SYS_RESOURCE_H
+    errno = 0;
+    nice = getpriority(PRIO_PROCESS, tid);
+    if (!errno && nice < SLOTH_NICE && sloth_can_restore(nice)) {
+        if (setpriority(PRIO_PROCESS, tid, SLOTH_NICE) < 0)
+            PMS_Log(LOG_LEVEL_DEBUG, "Sloth - unable to set priority of thread %d: %s",
+                    tid, strerror(errno));
+        else
+            t->nice = nice;
+    }
+#endif
+#ifdef __linux__
+    // Unlike the nice value, an unprivileged process may leave the idle I/O
+    // class again.
+    t->ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid);
+    if (t->ioprio >= 0 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+        t->ioprio = -1;
+#endif
+}
+
+static void sloth_restore_thread(int tid, const SlothThread *t)
+{
+#if HAVE_SYS_RESOURCE_H
+    if (t->nice != INT_MIN)
+        setpriority(PRIO_PROCESS, tid, t->nice);
+#endif
+#ifdef __linux__
+    if (t->ioprio >= 0)
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, t->ioprio);
+#endif
+}
+
+static void sloth_set_priority(int lower)
+{
+#ifdef __linux__
+    DIR *dir = opendir("/proc/self/task");
+    struct dirent *ent;
+    int i;
+
+    if (dir) {
+        if (lower)
+            nb_sloth_threads = 0;
+        while ((ent = readdir(dir))) {
+            int tid = atoi(ent->d_name);
+            if (tid <= 0)
+                continue;
+            if (lower) {
+                sloth_lower_thread(tid);
+                continue;
+            }
+            // Threads started while throttled inherited the lowered
+            // priorities from the main thread; give them its original ones.
+            for (i = 0; i < nb_sloth_threads; i++)
+                if (sloth_threads[i].tid == tid)
+                    break;
+            if (i == nb_sloth_threads)
+                for (i = 0; i < nb_sloth_threads; i++)
+                    if (sloth_threads[i].tid == getpid())
+                        break;
+            if (i < nb_sloth_threads)
+                sloth_restore_thread(tid, &sloth_threads[i]);
+        }
+        closedir(dir);
+        if (!lower)
+            nb_sloth_threads = 0;
+        return;
+    }
+#endif
+    if (lower) {
+        nb_sloth_threads = 0;
+        sloth_lower_thread(0);
+    } else if (nb_sloth_threads) {
+        sloth_restore_thread(0, &sloth_threads[0]);
+        nb_sloth_threads = 0;
+    }
+}
+
+// Idle frames in the filter graphs' pools are released; the pools are
+// recreated on the next allocation, and frames still in use return to the
+// old pool, which is freed with its last frame.
+static void sloth_release_filter_pools(void)
+{
+    int i, j, k;
+
+    for (i = 0; i < nb_filtergraphs; i++) {
+        AVFilterGraph *graph = filtergraphs[i]->graph;
+        if (!graph)
+            continue;
+        filtergraph_thread_sync(filtergraphs[i]);
+        for (j = 0; j < graph->nb_filters; j++) {
+            AVFilterContext *f = graph->filters[j];
+            for (k = 0; k < f->nb_outputs; k++)
+                if (f->outputs[k])
+                    ff_frame_pool_uninit((FFFramePool **)&f->outputs[k]->frame_pool);
+        }
+    }
+}
+
+static void sloth_enter(void)
+{
+    sloth_set_priority(1);
+    sloth_release_filter_pools();
+#if HAVE_MALLOC_H && defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+    PMS_Log(LOG_LEVEL_DEBUG, "Sloth - entering low-power mode.");
+}
+
+static void sloth_exit(void)
+{
+    sloth_set_priority(0);
+    PMS_Log(LOG_LEVEL_DEBUG, "Sloth - leaving low-power mode.");
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void plex_throttle(void)
+{
+    double capacity = plexContext.throttle_buffer * AV_TIME_BASE;
+    int64_t now, output;
+
+    if (!plexContext.throttle_delay) {
+        if (pacer.active)
+            sloth_exit();
+        pacer.active = 0;
+        return;
+    }
+
+    output = get_output_time();
+    if (output == AV_NOPTS_VALUE)
+        return;
+
+    now = av_gettime_relative();
+    if (!pacer.active) {
+        pacer.active      = 1;
+        pacer.last_output = output;
+        pacer.last_wall   = now;
+        pacer.tokens      = FFMIN(pacer.tokens, 0);
+        sloth_enter();
+        return;
+    }
+
+    // After a seek the output time jumps; measure from the new position.
+    if (pacer.rebase) {
+        pacer.rebase      = 0;
+        pacer.last_output = output;
+        pacer.last_wall   = now;
+        return;
+    }
+
+    pacer.tokens = FFMIN(pacer.tokens + (now - pacer.last_wall) * plexContext.throttle_speed,
+                         capacity);
+    if (output > pacer.last_output) {
+        pacer.tokens -= output - pacer.last_output;
+        pacer.last_output = output;
+    }
+    pacer.last_wall = now;
+
+    // Sleep off the deficit, in slices short enough to keep signal and
+    // keyboard handling responsive; the next call accounts for the time slept.
+    if (pacer.tokens < 0)
+        av_usleep(FFMIN(-pacer.tokens / plexContext.throttle_speed, 100000));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Control channel: a thread listens on -control_url and accepts one client
+// at a time. Each line is a command, answered with "ok" or "error <reason>":
+//   seek <time> [<segment>]   continue transcoding from <time>, writing
+//                             segments from number <segment> on
+//   stop                      finish the transcode as if the input ended
+// Commands are carried out by the transcode loop between two steps, which
+// polls for them with plex_control_poll().
+#if HAVE_THREADS
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    PlexControl cmd;
+    int state;              ///< 0: idle, 1: posted, 2: taken by the main thread
+    int result;
+    int started;
+    atomic_int posted;
+    atomic_int exiting;
+} control;
+
+static int control_interrupt_cb(void *ctx)
+{
+    return atomic_load(&control.exiting);
+}
+
+static int control_parse(char *line, PlexControl *cmd)
+{
+    char verb[16], time[64];
+    int n;
+
+    memset(cmd, 0, sizeof(*cmd));
+    n = sscanf(line, "%15s %63s %d", verb, time, &cmd->segment);
+    if (n >= 1 && !strcmp(verb, "stop")) {
+        cmd->type = PLEX_CONTROL_STOP;
+        return 0;
+    }
+    if (n >= 2 && !strcmp(verb, "seek")) {
+        cmd->type = PLEX_CONTROL_SEEK;
+        return av_parse_time(&cmd->seek_time, time, 1);
+    }
+    return AVERROR(EINVAL);
+}
+
+static int control_submit(const PlexControl *cmd)
+{
+    int ret;
+
+    pthread_mutex_lock(&control.lock);
+    control.cmd   = *cmd;
+    control.state = 1;
+    atomic_store(&control.posted, 1);
+    while (control.state && !atomic_load(&control.exiting))
+        pthread_cond_wait(&control.cond, &control.lock);
+    ret = control.state ? AVERROR_EXIT : control.result;
+    control.state = 0;
+    atomic_store(&control.posted, 0);
+    pthread_mutex_unlock(&control.lock);
+    return ret;
+}
+
+static void control_handle_line(URLContext *h, char *line)
+{
+    PlexControl cmd;
+    char reply[128];
+    int len = strlen(line), ret;
+
+    if (len && line[len - 1] == '\r')
+        line[--len] = 0;
+    if (!len)
+        return;
+
+    PMS_Log(LOG_LEVEL_DEBUG, "Control - received '%s'", line);
+    ret = control_parse(line, &cmd);
+    if (ret >= 0)
+        ret = control_submit(&cmd);
+
+    if (ret < 0)
+        snprintf(reply, sizeof(reply), "error %s\n", av_err2str(ret));
+    else
+        snprintf(reply, sizeof(reply), "ok\n");
+    ffurl_write(h, reply, strlen(reply));
+}
+
+static void *control_thread(void *arg)
+{
+    AVIOInterruptCB cb = { control_interrupt_cb, NULL };
+
+    while (!atomic_load(&control.exiting)) {
+        AVDictionary *opts = NULL;
+        URLContext *h = NULL;
+        char buf[1024];
+        int len = 0, ret;
+
+        av_dict_set(&opts, "listen", "1", 0);
+        ret = ffurl_open_whitelist(&h, plexContext.control_url, AVIO_FLAG_READ_WRITE,
+                                   &cb, &opts, NULL, NULL, NULL);
+        av_dict_free(&opts);
+        if (ret < 0) {
+            if (!atomic_load(&control.exiting))
+                PMS_Log(LOG_LEVEL_ERROR, "Control - unable to listen on %s: %s",
+                        plexContext.control_url, av_err2str(ret));
+            break;
+        }
+
+        while ((ret = ffurl_read(h, buf + len, sizeof(buf) - 1 - len)) > 0) {
+            char *line = buf, *nl;
+
+            len += ret;
+            buf[len] = 0;
+            while ((nl = strchr(line, '\n'))) {
+                *nl = 0;
+                control_handle_line(h, line);
+                line = nl + 1;
+            }
+            len -= line - buf;
+            memmove(buf, line, len);
+            // Drop lines that don't fit the buffer.
+            if (len == sizeof(buf) - 1)
+                len = 0;
+        }
+        ffurl_closep(&h);
+    }
+    return NULL;
+}
+#endif
+
+int plex_control_start(void)
+{
+#if HAVE_THREADS
+    int ret;
+
+    if (!plexContext.control_url || control.started)
+        return 0;
+
+    pthread_mutex_init(&control.lock, NULL);
+    pthread_cond_init(&control.cond, NULL);
+    if ((ret = pthread_create(&control.thread, NULL, control_thread, NULL))) {
+        pthread_cond_destroy(&control.cond);
+        pthread_mutex_destroy(&control.lock);
+        return AVERROR(ret);
+    }
+    control.started = 1;
+    return 0;
+#else
+    if (plexContext.control_url)
+        PMS_Log(LOG_LEVEL_WARNING, "Control - not available without thread support");
+    return 0;
+#endif
+}
+
+static void control_uninit(void)
+{
+#if HAVE_THREADS
+    if (!control.started)
+        return;
+
+    pthread_mutex_lock(&control.lock);
+    atomic_store(&control.exiting, 1);
+    pthread_cond_broadcast(&control.cond);
+    pthread_mutex_unlock(&control.lock);
+
+    pthread_join(control.thread, NULL);
+    pthread_cond_destroy(&control.cond);
+    pthread_mutex_destroy(&control.lock);
+    control.started = 0;
+#endif
+}
+
+int plex_control_poll(PlexControl *cmd)
+{
+#if HAVE_THREADS
+    int taken = 0;
+
+    if (!atomic_load(&control.posted))
+        return 0;
+
+    pthread_mutex_lock(&control.lock);
+    if (control.state == 1) {
+        *cmd          = control.cmd;
+        control.state = 2;
+        taken         = 1;
+    }
+    pthread_mutex_unlock(&control.lock);
+    return taken;
+#else
+    return 0;
+#endif
+}
+
+void plex_control_done(const PlexControl *cmd, int ret)
+{
+    if (cmd->type == PLEX_CONTROL_SEEK && ret >= 0)
+        pacer.rebase = 1;
+
+#if HAVE_THREADS
+    pthread_mutex_lock(&control.lock);
+    control.result = ret;
+    control.state  = 0;
+    pthread_cond_broadcast(&control.cond);
+    pthread_mutex_unlock(&control.lock);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Session server. A request is a 32-bit length followed by that many bytes
+// of NUL-terminated arguments; the client's stdin, stdout and stderr are
+// passed along with the length. The server forks, the child reads the
+// request and runs it as a normal transcode, and the server answers with
+// the child's 32-bit exit status. A client hanging up stops its session.
+#if HAVE_SYS_UN_H && HAVE_POLL_H
+#define SESSION_MAX          256
+#define SESSION_MAX_REQUEST  (1 << 20)
+
+typedef struct Session {
+    pid_t pid;
+    int fd;                 ///< connection to the client, -1 once stopped
+} Session;
+
+static int session_pipe[2] = { -1, -1 };
+
+static void session_sigchld(int sig)
+{
+    int err = errno;
+    if (write(session_pipe[1], "", 1) < 0) {
+        // The pipe is full, so the server will wake up anyway.
+    }
+    errno = err;
+}
+
+static int session_io(int fd, void *buf, int size, int out)
+{
+    uint8_t *p = buf;
+
+    while (size > 0) {
+        ssize_t ret = out ? write(fd, p, size) : read(fd, p, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return AVERROR(errno);
+        if (!ret)
+            return AVERROR_EOF;
+        p    += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+static int session_socket(const char *path, struct sockaddr_un *addr)
+{
+    int fd;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return AVERROR(ENAMETOOLONG);
+    av_strlcpy(addr->sun_path, path, sizeof(addr->sun_path));
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return AVERROR(errno);
+    return fd;
+}
+
+// Read a request in the forked child and take over the client's stdio.
+static int session_recv(int fd, const char *argv0, int *argc, char ***argv)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    struct iovec iov;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    uint32_t size;
+    int fds[3], i, n, ret;
+    char *args, *p;
+
+    iov.iov_base       = &size;
+    iov.iov_len        = sizeof(size);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    do {
+        ret = recvmsg(fd, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+        return AVERROR(errno);
+    if (ret < sizeof(size) &&
+        (ret = session_io(fd, (uint8_t *)&size + ret, sizeof(size) - ret, 0)) < 0)
+        return ret;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds)) || !size || size > SESSION_MAX_REQUEST)
+        return AVERROR_INVALIDDATA;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    if (!(args = av_malloc(size + 1)))
+        return AVERROR(ENOMEM);
+    if ((ret = session_io(fd, args, size, 0)) < 0)
+        return ret;
+    args[size] = 0;
+
+    for (p = args, n = 0; p < args + size; p += strlen(p) + 1)
+        n++;
+    if (!(*argv = av_malloc_array(n + 2, sizeof(**argv))))
+        return AVERROR(ENOMEM);
+    (*argv)[0] = (char *)argv0;
+    for (p = args, i = 1; p < args + size; p += strlen(p) + 1)
+        (*argv)[i++] = p;
+    (*argv)[i] = NULL;
+    *argc = i;
+
+    for (i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) < 0)
+            return AVERROR(errno);
+        close(fds[i]);
+    }
+    return 0;
+}
+
+// Run the codecs' one-time table setup before forking, so that every
+// session shares the tables instead of building its own copy.
+static void session_warm_up(void)
+{
+    static const char *const decoders[] = {
+        "h264", "hevc", "mpeg2video", "mpeg4", "vc1", "aac", "ac3", "eac3", "mp3", "dca", "flac",
+    };
+    int i, level = av_log_get_level();
+
+    av_log_set_level(AV_LOG_QUIET);
+    for (i = 0; i < FF_ARRAY_ELEMS(decoders); i++) {
+        AVCodec *codec = avcodec_find_decoder_by_name(decoders[i]);
+        AVCodecContext *avctx;
+
+        if (!codec || !(avctx = avcodec_alloc_context3(codec)))
+            continue;
+        avcodec_open2(avctx, codec, NULL);
+        avcodec_free_context(&avctx);
+    }
+    av_log_set_level(level);
+}
+
+static void session_reap(Session *sessions, int *nb_sessions)
+{
+    int status, code, i;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        for (i = 0; i < *nb_sessions; i++) {
+            if (sessions[i].pid != pid)
+                continue;
+            av_log(NULL, AV_LOG_VERBOSE, "Session %d exited with status %d\n", pid, code);
+            if (sessions[i].fd >= 0) {
+                uint32_t reply = code;
+                session_io(sessions[i].fd, &reply, sizeof(reply), 1);
+                close(sessions[i].fd);
+            }
+            sessions[i] = sessions[--*nb_sessions];
+            break;
+        }
+    }
+}
+#endif
+
+int plex_session_serve(const char *path, int *argc, char ***argv)
+{
+#if HAVE_SYS_UN_H && HAVE_POLL_H
+    Session sessions[SESSION_MAX];
+    struct pollfd pfds[SESSION_MAX + 2];
+    struct sockaddr_un addr;
+    int nb_sessions = 0, listen_fd, i, ret;
+    const char *argv0 = (*argv)[0];
+
+    if ((listen_fd = session_socket(path, &addr)) < 0)
+        return listen_fd;
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0 || pipe(session_pipe) < 0) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_FATAL, "Could not serve sessions on %s: %s\n", path, av_err2str(ret));
+        close(listen_fd);
+        return ret;
+    }
+    fcntl(session_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(session_pipe[1], F_SETFL, O_NONBLOCK);
+    signal(SIGCHLD, session_sigchld);
+    signal(SIGPIPE, SIG_IGN);
+
+    session_warm_up();
+    av_log(NULL, AV_LOG_INFO, "Serving sessions on %s\n", path);
+
+    for (;;) {
+        pid_t pid;
+        int fd;
+
+        pfds[0] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+        pfds[1] = (struct pollfd){ .fd = session_pipe[0], .events = POLLIN };
+        // No events asked for: POLLHUP is always reported, and the
+        // request data is not ours to read.
+        for (i = 0; i < nb_sessions; i++)
+            pfds[i + 2] = (struct pollfd){ .fd = sessions[i].fd, .events = 0 };
+        if (poll(pfds, nb_sessions + 2, -1) < 0 && errno != EINTR)
+            return AVERROR(errno);
+
+        if (pfds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(session_pipe[0], buf, sizeof(buf)) > 0);
+        }
+        for (i = 0; i < nb_sessions; i++) {
+            if (sessions[i].fd >= 0 && (pfds[i + 2].revents & (POLLHUP | POLLERR))) {
+                av_log(NULL, AV_LOG_VERBOSE, "Client of session %d hung up, stopping it\n", sessions[i].pid);
+                kill(sessions[i].pid, SIGTERM);
+                close(sessions[i].fd);
+                sessions[i].fd = -1;
+            }
+        }
+        session_reap(sessions, &nb_sessions);
+
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+        if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+            continue;
+        if (nb_sessions == SESSION_MAX) {
+            av_log(NULL, AV_LOG_ERROR, "Too many sessions, refusing a new one\n");
+            close(fd);
+            continue;
+        }
+
+        if ((pid = fork()) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not start a session: %s\n", av_err2str(AVERROR(errno)));
+            close(fd);
+        } else if (!pid) {
+            signal(SIGCHLD, SIG_DFL);
+            signal(SIGPIPE, SIG_DFL);
+            close(listen_fd);
+            close(session_pipe[0]);
+            close(session_pipe[1]);
+            for (i = 0; i < nb_sessions; i++)
+                if (sessions[i].fd >= 0)
+                    close(sessions[i].fd);
+            ret = session_recv(fd, argv0, argc, argv);
+            close(fd);
+            if (ret < 0)
+                av_log(NULL, AV_LOG_ERROR, "Invalid session request: %s\n", av_err2str(ret));
+            return ret;
+        } else {
+            sessions[nb_sessions++] = (Session){ .pid = pid, .fd = fd };
+        }
+    }
+#else
+    av_log(NULL, AV_LOG_FATAL, "Session server is not supported on this platform\n");
+    return AVERROR(ENOSYS);
+#endif
+}
+
+int plex_session_connect(const char *path, int argc, char **argv)
+{
+#if HAVE_SYS_UN_H && HAVE_POLL_H
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    static const int fds[3] = { 0, 1, 2 };
+    struct sockaddr_un addr;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    AVBPrint args;
+    uint32_t size, status;
+    int fd, i, ret;
+
+    av_bprint_init(&args, 0, SESSION_MAX_REQUEST);
+    for (i = 0; i < argc; i++)
+        av_bprint_append_data(&args, argv[i], strlen(argv[i]) + 1);
+    if (!av_bprint_is_complete(&args) || !args.len) {
+        av_log(NULL, AV_LOG_FATAL, "Invalid session arguments\n");
+        av_bprint_finalize(&args, NULL);
+        return 1;
+    }
+    size = args.len;
+
+    if ((fd = session_socket(path, &addr)) < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ret = fd < 0 ? fd : AVERROR(errno);
+        av_log(NULL, AV_LOG_FATAL, "Could not connect to %s: %s\n", path, av_err2str(ret));
+        av_bprint_finalize(&args, NULL);
+        return 1;
+    }
+
+    iov.iov_base       = &size;
+    iov.iov_len        = sizeof(size);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, 0) != sizeof(size))
+        ret = AVERROR(errno);
+    else if ((ret = session_io(fd, args.str, size, 1)) >= 0)
+        ret = session_io(fd, &status, sizeof(status), 0);
+    av_bprint_finalize(&args, NULL);
+    close(fd);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Session on %s failed: %s\n", path, av_err2str(ret));
+        return 1;
     }
+    return status;
+#else
+    av_log(NULL, AV_LOG_FATAL, "Session server is not supported on this platform\n");
+    return 1;
+#endif
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -93,6 +93,11 @@ typedef struct
     int64_t output_duration;            //[+]
     char* progress_url;                 //[-]
     int throttle_delay;
+    float throttle_speed;               // output speed while throttled (x realtime)
+    float throttle_buffer;              // seconds of output allowed ahead of the paced rate
+    char* control_url;                  // URL to listen on for seek/stop commands
+    char* trace_file;                   // Chrome trace written on exit
+    int thread_budget;                  // threads shared by all video stages, 0 for per-codec auto
 
     int nb_inlineass_ctxs;
     InlineAssContext *inlineass_ctxs;
@@ -106,6 +111,16 @@ typedef struct
 
 extern PlexContext plexContext;
 
+typedef struct PlexControl
+{
+    enum {
+        PLEX_CONTROL_SEEK,
+        PLEX_CONTROL_STOP,
+    } type;
+    int64_t seek_time;                  // in AV_TIME_BASE units
+    int segment;                        // first segment to write after the seek, 0 to keep
+} PlexControl;
+
 typedef enum LogLevel
 {
    LOG_LEVEL_ERROR,
@@ -119,9 +134,41 @@ char* PMS_IssueHttpRequest(const char* url, const char* verb);
 void PMS_Log(LogLevel level, const char* format, ...);
 
 void plex_init(void);
+void plex_uninit(void);
 int av_log_get_level_plex(void);
 void av_log_set_level_plex(int);
 
+/**
+ * Queue a progress URL for the background reporter. Only the newest URL is
+ * kept; the reply's canThrottle flag is reflected by plex_can_throttle().
+ */
+void plex_report_progress(const char *url);
+int plex_can_throttle(void);
+
+typedef struct PlexStageClock {
+    int64_t wall;
+    int64_t cpu;
+} PlexStageClock;
+
+/**
+ * Time a pipeline stage: plex_stage_end() adds the wall and thread CPU time
+ * since the matching plex_stage_begin() to times. Only active when progress
+ * is reported, -benchmark is given or a thread budget is set.
+ */
+void plex_stage_begin(PlexStageClock *clock);
+void plex_stage_end(PlexStageTimes *times, enum PlexStage stage, const PlexStageClock *clock);
+void plex_append_stage_stats(char *url, int size);
+void plex_print_stage_summary(void);
+
+/**
+ * Number of threads one video decoder, filtergraph or encoder should use
+ * under -thread_budget, or 0 if no budget is set. The budget is split
+ * between the stages by their measured wall time so far (by a fixed
+ * estimate before anything was measured) and divided between the sessions
+ * sharing the -thread_budget_file.
+ */
+int plex_thread_share(enum PlexStage stage);
+
 void plex_report_stream(const AVStream *st);
 void plex_report_stream_detail(const AVStream *st);
 
@@ -129,8 +176,33 @@ int plex_opt_subtitle_stream(void *optctx, const char *opt, const char *arg);
 
 int plex_opt_progress_url(void *optctx, const char *opt, const char *arg);
 int plex_opt_loglevel(void *o, const char *opt, const char *arg);
+int plex_opt_throttle_speed(void *optctx, const char *opt, const char *arg);
+int plex_opt_throttle_buffer(void *optctx, const char *opt, const char *arg);
+int plex_opt_trace_file(void *optctx, const char *opt, const char *arg);
+int plex_opt_thread_budget_file(void *optctx, const char *opt, const char *arg);
 
 void plex_feedback(const AVFormatContext *ic);
+void plex_throttle(void);
+
+/**
+ * Start listening on plexContext.control_url for seek and stop commands.
+ * plex_control_poll() returns 1 and fills cmd when a command is waiting;
+ * it must be completed with plex_control_done().
+ */
+int plex_control_start(void);
+int plex_control_poll(PlexControl *cmd);
+void plex_control_done(const PlexControl *cmd, int ret);
+
+/**
+ * Session server: "-serve <path>" registers and warms up the codecs once,
+ * then forks a session for each request on the unix socket at path.
+ * "-connect <path> <options>" runs options as such a session with the
+ * caller's stdin, stdout and stderr and returns its exit status.
+ * plex_session_serve() only returns in a session, with argc and argv
+ * replaced by its options, or on error.
+ */
+int plex_session_serve(const char *path, int *argc, char ***argv);
+int plex_session_connect(const char *path, int argc, char **argv);
 
 void plex_prepare_setup_streams_for_input_stream(InputStream* ist);
 void plex_link_subtitles_to_graph(AVFilterGraph* graph);
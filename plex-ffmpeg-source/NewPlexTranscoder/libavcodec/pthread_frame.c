@@ -44,6 +44,7 @@
 #include "libavutil/mem.h"
 #include "libavutil/opt.h"
 #include "libavutil/thread.h"
+#include "libavutil/trace.h" //PLEX
 
 enum {
     ///< Set when the thread is awaiting a packet.
@@ -198,7 +199,9 @@ static attribute_align_arg void *frame_worker_thread(void *arg)
 
         av_frame_unref(p->frame);
         p->got_frame = 0;
+        avpriv_trace_begin("frame_decode", p->avpkt.pts); //PLEX
         p->result = codec->decode(avctx, p->frame, &p->got_frame, &p->avpkt);
+        avpriv_trace_end("frame_decode", p->avpkt.pts); //PLEX
 
         if ((p->result < 0 || !p->got_frame) && p->frame->buf[0]) {
             if (avctx->internal->allocate_progress)
@@ -592,10 +595,12 @@ void ff_thread_await_progress(ThreadFrame *f, int n, int field)
         av_log(f->owner[field], AV_LOG_DEBUG,
                "thread awaiting %d field %d from %p\n", n, field, progress);
 
+    avpriv_trace_begin("await_progress", AV_NOPTS_VALUE); //PLEX
     pthread_mutex_lock(&p->progress_mutex);
     while (atomic_load_explicit(&progress[field], memory_order_relaxed) < n)
         pthread_cond_wait(&p->progress_cond, &p->progress_mutex);
     pthread_mutex_unlock(&p->progress_mutex);
+    avpriv_trace_end("await_progress", AV_NOPTS_VALUE); //PLEX
 }
 
 void ff_thread_finish_setup(AVCodecContext *avctx) {
@@ -35,6 +35,7 @@
 #include "libavutil/mem.h"
 #include "libavutil/thread.h"
 #include "libavutil/slicethread.h"
+#include "libavutil/trace.h" //PLEX
 
 typedef int (action_func)(AVCodecContext *c, void *arg);
 typedef int (action_func2)(AVCodecContext *c, void *arg, int jobnr, int threadnr);
@@ -68,8 +69,10 @@ static void worker_func(void *priv, int jobnr, int threadnr, int nb_jobs, int nb
     SliceThreadContext *c = avctx->internal->thread_ctx;
     int ret;
 
+    avpriv_trace_begin("slice_job", AV_NOPTS_VALUE); //PLEX
     ret = c->func ? c->func(avctx, (char *)c->args + c->job_size * jobnr)
                   : c->func2(avctx, c->args, jobnr, threadnr);
+    avpriv_trace_end("slice_job", AV_NOPTS_VALUE); //PLEX
     if (c->rets)
         c->rets[jobnr] = ret;
 }
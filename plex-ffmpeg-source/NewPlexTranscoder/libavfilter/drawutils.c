@@ -19,6 +19,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "config.h"
+
 #include <string.h>
 
 #include "libavutil/avassert.h"
@@ -175,6 +177,55 @@ void ff_copy_rectangle(uint8_t *dst[4], int dst_linesize[4],
     }
 }
 
+typedef void (*blend_row_fn)(uint8_t *dst, const uint8_t *mask, ptrdiff_t mask_linesize,
+                             int w, unsigned src, unsigned alpha);
+
+static void blend_row8_c(uint8_t *dst, const uint8_t *mask, ptrdiff_t mask_linesize,
+                         int w, unsigned src, unsigned alpha)
+{
+    int x;
+
+    for (x = 0; x < w; x++) {
+        unsigned a = mask[x] * alpha;
+        dst[x] = ((0x1010101 - a) * dst[x] + a * src) >> 24;
+    }
+}
+
+static void blend_row8_sub_c(uint8_t *dst, const uint8_t *mask, ptrdiff_t mask_linesize,
+                             int w, unsigned src, unsigned alpha)
+{
+    int x;
+
+    for (x = 0; x < w; x++) {
+        unsigned a = ((mask[2 * x]                 + mask[2 * x + 1] +
+                       mask[2 * x + mask_linesize] + mask[2 * x + 1 + mask_linesize]) >> 2) * alpha;
+        dst[x] = ((0x1010101 - a) * dst[x] + a * src) >> 24;
+    }
+}
+
+static void blend_row16_c(uint8_t *dst, const uint8_t *mask, ptrdiff_t mask_linesize,
+                          int w, unsigned src, unsigned alpha)
+{
+    int x;
+
+    for (x = 0; x < w; x++) {
+        unsigned a = mask[x] * alpha;
+        AV_WL16(dst + 2 * x, ((0x10001 - a) * AV_RL16(dst + 2 * x) + a * src) >> 16);
+    }
+}
+
+static void blend_row16_sub_c(uint8_t *dst, const uint8_t *mask, ptrdiff_t mask_linesize,
+                              int w, unsigned src, unsigned alpha)
+{
+    int x;
+
+    for (x = 0; x < w; x++) {
+        unsigned a = ((mask[2 * x]                 + mask[2 * x + 1] +
+                       mask[2 * x + mask_linesize] + mask[2 * x + 1 + mask_linesize]) >> 2) * alpha;
+        AV_WL16(dst + 2 * x, ((0x10001 - a) * AV_RL16(dst + 2 * x) + a * src) >> 16);
+    }
+}
+
 int ff_draw_init(FFDrawContext *draw, enum AVPixelFormat format, unsigned flags)
 {
     const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
@@ -220,6 +271,14 @@ int ff_draw_init(FFDrawContext *draw, enum AVPixelFormat format, unsigned flags)
     for (i = 0; i < (desc->nb_components - !!(desc->flags & AV_PIX_FMT_FLAG_ALPHA && !(flags & FF_DRAW_PROCESS_ALPHA))); i++)
         draw->comp_mask[desc->comp[i].plane] |=
             1 << desc->comp[i].offset;
+
+    draw->blend_row[0][0] = blend_row8_c;
+    draw->blend_row[0][1] = blend_row8_sub_c;
+    draw->blend_row[1][0] = blend_row16_c;
+    draw->blend_row[1][1] = blend_row16_sub_c;
+    draw->blend_row_block = 1;
+    if (ARCH_X86)
+        ff_draw_init_x86(draw);
     return 0;
 }
 
@@ -567,7 +626,8 @@ static void blend_line_hv16(uint8_t *dst, int dst_delta,
                             unsigned src, unsigned alpha,
                             const uint8_t *mask, int mask_linesize, int l2depth, int w,
                             unsigned hsub, unsigned vsub,
-                            int xm, int left, int right, int hband)
+                            int xm, int left, int right, int hband,
+                            blend_row_fn blend_row, int block)
 {
     int x;
 
@@ -577,6 +637,13 @@ static void blend_line_hv16(uint8_t *dst, int dst_delta,
         dst += dst_delta;
         xm += left;
     }
+    if (blend_row) {
+        int n = w / block * block;
+        blend_row(dst, mask + xm, mask_linesize, n, src, alpha);
+        dst += n * dst_delta;
+        xm  += n << hsub;
+        w   -= n;
+    }
     for (x = 0; x < w; x++) {
         blend_pixel16(dst, src, alpha, mask, mask_linesize, l2depth,
                       1 << hsub, hband, hsub + vsub, xm);
@@ -592,7 +659,8 @@ static void blend_line_hv(uint8_t *dst, int dst_delta,
                           unsigned src, unsigned alpha,
                           const uint8_t *mask, int mask_linesize, int l2depth, int w,
                           unsigned hsub, unsigned vsub,
-                          int xm, int left, int right, int hband)
+                          int xm, int left, int right, int hband,
+                          blend_row_fn blend_row, int block)
 {
     int x;
 
@@ -602,6 +670,13 @@ static void blend_line_hv(uint8_t *dst, int dst_delta,
         dst += dst_delta;
         xm += left;
     }
+    if (blend_row) {
+        int n = w / block * block;
+        blend_row(dst, mask + xm, mask_linesize, n, src, alpha);
+        dst += n * dst_delta;
+        xm  += n << hsub;
+        w   -= n;
+    }
     for (x = 0; x < w; x++) {
         blend_pixel(dst, src, alpha, mask, mask_linesize, l2depth,
                     1 << hsub, hband, hsub + vsub, xm);
@@ -622,6 +697,7 @@ void ff_blend_mask(FFDrawContext *draw, FFDrawColor *color,
     int xm0, ym0, w_sub, h_sub, x_sub, y_sub, left, right, top, bottom, y;
     uint8_t *p0, *p;
     const uint8_t *m;
+    blend_row_fn blend_row;
 
     clip_interval(dst_w, &x0, &mask_w, &xm0);
     clip_interval(dst_h, &y0, &mask_h, &ym0);
@@ -651,6 +727,10 @@ void ff_blend_mask(FFDrawContext *draw, FFDrawColor *color,
 
             if (!component_used(draw, plane, comp))
                 continue;
+            blend_row = NULL;
+            if (l2depth == 3 && nb_comp == 1 + (depth > 8) &&
+                draw->hsub[plane] == draw->vsub[plane] && draw->hsub[plane] <= 1)
+                blend_row = draw->blend_row[depth > 8][draw->hsub[plane]];
             p = p0 + comp;
             m = mask;
             if (top) {
@@ -659,13 +739,13 @@ void ff_blend_mask(FFDrawContext *draw, FFDrawColor *color,
                                   color->comp[plane].u8[comp], alpha,
                                   m, mask_linesize, l2depth, w_sub,
                                   draw->hsub[plane], draw->vsub[plane],
-                                  xm0, left, right, top);
+                                  xm0, left, right, top, NULL, 1);
                 } else {
                     blend_line_hv16(p, draw->pixelstep[plane],
                                     color->comp[plane].u16[comp], alpha,
                                     m, mask_linesize, l2depth, w_sub,
                                     draw->hsub[plane], draw->vsub[plane],
-                                    xm0, left, right, top);
+                                    xm0, left, right, top, NULL, 1);
                 }
                 p += dst_linesize[plane];
                 m += top * mask_linesize;
@@ -676,7 +756,8 @@ void ff_blend_mask(FFDrawContext *draw, FFDrawColor *color,
                                   color->comp[plane].u8[comp], alpha,
                                   m, mask_linesize, l2depth, w_sub,
                                   draw->hsub[plane], draw->vsub[plane],
-                                  xm0, left, right, 1 << draw->vsub[plane]);
+                                  xm0, left, right, 1 << draw->vsub[plane],
+                                  blend_row, draw->blend_row_block);
                     p += dst_linesize[plane];
                     m += mask_linesize << draw->vsub[plane];
                 }
@@ -686,7 +767,8 @@ void ff_blend_mask(FFDrawContext *draw, FFDrawColor *color,
                                     color->comp[plane].u16[comp], alpha,
                                     m, mask_linesize, l2depth, w_sub,
                                     draw->hsub[plane], draw->vsub[plane],
-                                    xm0, left, right, 1 << draw->vsub[plane]);
+                                    xm0, left, right, 1 << draw->vsub[plane],
+                                    blend_row, draw->blend_row_block);
                     p += dst_linesize[plane];
                     m += mask_linesize << draw->vsub[plane];
                 }
@@ -697,13 +779,13 @@ void ff_blend_mask(FFDrawContext *draw, FFDrawColor *color,
                                   color->comp[plane].u8[comp], alpha,
                                   m, mask_linesize, l2depth, w_sub,
                                   draw->hsub[plane], draw->vsub[plane],
-                                  xm0, left, right, bottom);
+                                  xm0, left, right, bottom, NULL, 1);
                 } else {
                     blend_line_hv16(p, draw->pixelstep[plane],
                                     color->comp[plane].u16[comp], alpha,
                                     m, mask_linesize, l2depth, w_sub,
                                     draw->hsub[plane], draw->vsub[plane],
-                                    xm0, left, right, bottom);
+                                    xm0, left, right, bottom, NULL, 1);
                 }
             }
         }
@@ -56,6 +56,16 @@ typedef struct FFDrawContext {
     uint8_t hsub_max;
     uint8_t vsub_max;
     unsigned flags;
+
+    /**
+     * Blend w samples of a plane holding a single component, each covering
+     * (1 << sub) x (1 << sub) pixels of an 8-bit mask, with the color
+     * component src at the ff_blend_mask() scaled alpha. Indexed by
+     * [depth > 8][sub]; w must be a multiple of blend_row_block.
+     */
+    void (*blend_row[2][2])(uint8_t *dst, const uint8_t *mask, ptrdiff_t mask_linesize,
+                            int w, unsigned src, unsigned alpha);
+    int blend_row_block;
 } FFDrawContext;
 
 typedef struct FFDrawColor {
@@ -81,6 +91,7 @@ typedef struct FFDrawColor {
  * @return  0 for success, < 0 for error
  */
 int ff_draw_init(FFDrawContext *draw, enum AVPixelFormat format, unsigned flags);
+void ff_draw_init_x86(FFDrawContext *draw);
 
 /**
  * Prepare a color.
@@ -27,7 +27,11 @@
 #include "libavcodec/avcodec.h"
 #include "libavfilter/avfilter.h"
 #include "libavutil/avstring.h"
+#include "libavutil/bprint.h"
+#include "libavutil/intreadwrite.h"
 #include "libavutil/opt.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/thread.h"
 #include "libavformat/avformat.h"
 #include "vf_inlineass.h"
 #include "drawutils.h"
@@ -36,6 +40,23 @@
 #include "video.h"
 #include "libavutil/frame.h"
 
+/* A font attachment, registered with libass when the fonts are set */
+typedef struct FontAttachment {
+    char *filename;
+    const uint8_t *data;    ///< owned by the attachment stream
+    int size;
+    char *names;            ///< tab separated names the font can be selected by
+} FontAttachment;
+
+/* Images rendered by the look-ahead thread, copied out of the renderer */
+typedef struct RenderedFrame {
+    int64_t pts;
+    long long time_ms;
+    int changed;
+    unsigned seq;           ///< ass_render_frame() call that produced images
+    ASS_Image *images;
+} RenderedFrame;
+
 typedef struct {
     const AVClass *class;
     ASS_Library *library;
@@ -56,8 +77,48 @@ typedef struct {
     int mangle_state;
     float vs_rgb2yuv[3][4];
     float vs2rgb[3][4];
+
+    /* The current images composited once, in the output pixel format:
+       a frame is drawn as frame * transparency / max + overlay. */
+    AVFrame *overlay;
+    AVFrame *transparency;
+    int overlay_x, overlay_y, overlay_w, overlay_h;
+    int overlay_valid;
+    /* With check_overlay, frames drawn from the overlay are also blended
+       directly and compared: the overlay rounds once where blending the
+       images one by one rounds after each of them. */
+    int check_overlay;
+    int64_t checked_frames, differing_frames, differing_samples;
+    int max_difference;
+
+    int lookahead;
+    pthread_t render_thread;
+    int thread_started;
+    /* render_lock guards the renderer and the track and is taken before
+       lock, which guards the queue. */
+    pthread_mutex_t render_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    RenderedFrame *queue;
+    int queue_start, nb_queued;
+    int64_t next_pts, frame_duration;
+    int anchored, rendering, stop;
+    long long rendering_time;
+    unsigned render_seq, last_seq;
+    ASS_Image *current;     ///< copies handed to the frame being filtered
+
+    FontAttachment *fonts;
+    int nb_fonts;
+    AVDictionary *font_refs;    ///< names used by the styles
 } AssContext;
 
+typedef struct ThreadData {
+    AVFrame *frame;
+    AVFrame *transparency;  ///< set when building the overlay into frame
+    const ASS_Image *images;
+    int x, y;               ///< position of frame in the video
+} ThreadData;
+
 #define OFFSET(x) offsetof(AssContext, x)
 #define FLAGS AV_OPT_FLAG_FILTERING_PARAM|AV_OPT_FLAG_VIDEO_PARAM
 
@@ -87,6 +148,10 @@ static av_cold int init(AVFilterContext *ctx)
 {
     AssContext *ass = ctx->priv;
 
+    pthread_mutex_init(&ass->render_lock, NULL);
+    pthread_mutex_init(&ass->lock, NULL);
+    pthread_cond_init(&ass->cond, NULL);
+
     ass->library = ass_library_init();
 
     if (!ass->library) {
@@ -119,10 +184,48 @@ static av_cold int init(AVFilterContext *ctx)
     return 0;
 }
 
+static void flush_queue(AssContext *ass, int keep)
+{
+    while (ass->nb_queued > keep) {
+        RenderedFrame *f = &ass->queue[(ass->queue_start + --ass->nb_queued) % ass->lookahead];
+        av_freep(&f->images);
+    }
+}
+
 static av_cold void uninit(AVFilterContext *ctx)
 {
     AssContext *ass = ctx->priv;
+    int i;
+
+    if (ass->thread_started) {
+        pthread_mutex_lock(&ass->lock);
+        ass->stop = 1;
+        pthread_cond_broadcast(&ass->cond);
+        pthread_mutex_unlock(&ass->lock);
+        pthread_join(ass->render_thread, NULL);
+        flush_queue(ass, 0);
+    }
+    av_freep(&ass->queue);
+    av_freep(&ass->current);
+    pthread_cond_destroy(&ass->cond);
+    pthread_mutex_destroy(&ass->lock);
+    pthread_mutex_destroy(&ass->render_lock);
+
+    for (i = 0; i < ass->nb_fonts; i++) {
+        av_freep(&ass->fonts[i].filename);
+        av_freep(&ass->fonts[i].names);
+    }
+    av_freep(&ass->fonts);
+    av_dict_free(&ass->font_refs);
+
+    if (ass->check_overlay)
+        av_log(ctx, AV_LOG_INFO, "Overlay check: %"PRId64" of %"PRId64" frames differ from "
+               "direct blending in %"PRId64" samples, by at most %d\n",
+               ass->differing_frames, ass->checked_frames, ass->differing_samples,
+               ass->max_difference);
 
+    av_frame_free(&ass->overlay);
+    av_frame_free(&ass->transparency);
     if (ass->track)
         ass_free_track(ass->track);
     if (ass->renderer)
@@ -136,15 +239,49 @@ static int query_formats(AVFilterContext *ctx)
     return ff_set_common_formats(ctx, ff_draw_supported_pixel_formats(0));
 }
 
+static void *render_thread(void *arg);
+
 static int config_input(AVFilterLink *link)
 {
     AssContext *context = link->dst->priv;
+    int ret;
+
     ff_draw_init(&context->draw, link->format, 0);
 
+    pthread_mutex_lock(&context->render_lock);
     ass_set_frame_size(context->renderer, link->w, link->h);
 
     ass_set_pixel_aspect(context->renderer, av_q2d(link->sample_aspect_ratio));
 
+    pthread_mutex_lock(&context->lock);
+    if (context->thread_started)
+        flush_queue(context, 0);
+    context->anchored = 0;
+    context->frame_duration = 0;
+    if (link->frame_rate.num > 0 && link->frame_rate.den > 0)
+        context->frame_duration = av_rescale_q(1, av_inv_q(link->frame_rate), link->time_base);
+    pthread_mutex_unlock(&context->lock);
+    pthread_mutex_unlock(&context->render_lock);
+
+    context->overlay_valid = 0;
+
+    if (context->lookahead && !context->thread_started) {
+        if (context->frame_duration <= 0) {
+            av_log(link->dst, AV_LOG_WARNING,
+                   "Unknown frame rate, rendering subtitles without look-ahead.\n");
+            return 0;
+        }
+        context->queue = av_calloc(context->lookahead, sizeof(*context->queue));
+        if (!context->queue)
+            return AVERROR(ENOMEM);
+        if ((ret = pthread_create(&context->render_thread, NULL, render_thread, link->dst))) {
+            av_log(link->dst, AV_LOG_ERROR, "Failed to create the render thread: %s\n",
+                   av_err2str(AVERROR(ret)));
+            return AVERROR(ret);
+        }
+        context->thread_started = 1;
+    }
+
     return 0;
 }
 
@@ -505,34 +642,421 @@ static void calculate_mangle_table(AssContext *ass, AVFrame *frame)
 #define AB(c)  (((c)>>8) &0xFF)
 #define AA(c)  ((0xFF-c) &0xFF)
 
-static void overlay_ass_image(AssContext *ass, AVFrame *picref,
-                              const ASS_Image *image)
+static void ass_image_color(AssContext *ass, const ASS_Image *image, FFDrawColor *color)
 {
     uint8_t rgba_color[4];
-    for (; image; image = image->next) {
-        if (ass->mangle_state == 1) {
-            int c[3] = {AR(image->color), AG(image->color), AB(image->color)};
-            mp_map_int_color(ass->vs_rgb2yuv, 8, c);
-            mp_map_int_color(ass->vs2rgb, 8, c);
-
-            rgba_color[0] = c[0];
-            rgba_color[1] = c[1];
-            rgba_color[2] = c[2];
-            rgba_color[3] = AA(image->color);
-        } else {
-            rgba_color[0] = AR(image->color);
-            rgba_color[1] = AG(image->color);
-            rgba_color[2] = AB(image->color);
-            rgba_color[3] = AA(image->color);
+
+    if (ass->mangle_state == 1) {
+        int c[3] = {AR(image->color), AG(image->color), AB(image->color)};
+        mp_map_int_color(ass->vs_rgb2yuv, 8, c);
+        mp_map_int_color(ass->vs2rgb, 8, c);
+
+        rgba_color[0] = c[0];
+        rgba_color[1] = c[1];
+        rgba_color[2] = c[2];
+        rgba_color[3] = AA(image->color);
+    } else {
+        rgba_color[0] = AR(image->color);
+        rgba_color[1] = AG(image->color);
+        rgba_color[2] = AB(image->color);
+        rgba_color[3] = AA(image->color);
+    }
+    ff_draw_color(&ass->draw, color, rgba_color);
+}
+
+/* Bands start on a chroma row, so that blending a band touches the same
+   samples with the same mask rows as blending the whole frame. */
+static void slice_bounds(const AssContext *ass, int h, int jobnr, int nb_jobs,
+                         int *slice_start, int *slice_end)
+{
+    int align = (1 << ass->draw.vsub_max) - 1;
+
+    *slice_start = (h *  jobnr     / nb_jobs) & ~align;
+    *slice_end   = jobnr + 1 == nb_jobs ? h : (h * (jobnr + 1) / nb_jobs) & ~align;
+}
+
+static void fill_overlay_frame(FFDrawContext *draw, AVFrame *frame, int value,
+                               int slice_start, int slice_end)
+{
+    int plane, y;
+
+    for (plane = 0; plane < draw->nb_planes; plane++) {
+        int w = AV_CEIL_RSHIFT(frame->width, draw->hsub[plane]) * draw->pixelstep[plane];
+        int h = AV_CEIL_RSHIFT(slice_end,    draw->vsub[plane]);
+        for (y = slice_start >> draw->vsub[plane]; y < h; y++)
+            memset(frame->data[plane] + y * frame->linesize[plane], value, w);
+    }
+}
+
+static void blend_image_slice(FFDrawContext *draw, FFDrawColor *color, AVFrame *frame,
+                              int slice_start, int slice_end,
+                              const ASS_Image *image, int x, int y)
+{
+    uint8_t *data[4] = { NULL };
+    int plane;
+
+    for (plane = 0; plane < draw->nb_planes; plane++)
+        data[plane] = frame->data[plane] +
+                      (slice_start >> draw->vsub[plane]) * frame->linesize[plane];
+    ff_blend_mask(draw, color, data, frame->linesize,
+                  frame->width, slice_end - slice_start,
+                  image->bitmap, image->stride, image->w, image->h,
+                  3, 0, image->dst_x - x, image->dst_y - y - slice_start);
+}
+
+/* Blend all images in a band of td->frame. Blending is linear in the
+   destination, so blending the images onto black gives the color they add,
+   and blending them without color onto white gives how much of the
+   destination is left. */
+static int blend_slice(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
+{
+    AssContext *ass = ctx->priv;
+    ThreadData *td = arg;
+    const ASS_Image *image;
+    int slice_start, slice_end;
+
+    slice_bounds(ass, td->frame->height, jobnr, nb_jobs, &slice_start, &slice_end);
+    if (slice_start >= slice_end)
+        return 0;
+
+    if (td->transparency) {
+        fill_overlay_frame(&ass->draw, td->frame,        0,    slice_start, slice_end);
+        fill_overlay_frame(&ass->draw, td->transparency, 0xFF, slice_start, slice_end);
+    }
+
+    for (image = td->images; image; image = image->next) {
+        FFDrawColor color, clear = { { 0 } };
+
+        if (image->dst_y - td->y >= slice_end ||
+            image->dst_y - td->y + image->h <= slice_start)
+            continue;
+        ass_image_color(ass, image, &color);
+        blend_image_slice(&ass->draw, &color, td->frame, slice_start, slice_end,
+                          image, td->x, td->y);
+        if (td->transparency) {
+            clear.rgba[3] = color.rgba[3];
+            blend_image_slice(&ass->draw, &clear, td->transparency, slice_start, slice_end,
+                              image, td->x, td->y);
+        }
+    }
+    return 0;
+}
+
+static void overlay_ass_image(AVFilterContext *ctx, AVFrame *picref,
+                              const ASS_Image *image)
+{
+    ThreadData td = { .frame = picref, .images = image };
+
+    ctx->internal->execute(ctx, blend_slice, &td, NULL,
+                           FFMIN(picref->height, ff_filter_get_nb_threads(ctx)));
+}
+
+static AVFrame *alloc_overlay_frame(enum AVPixelFormat format, int w, int h)
+{
+    AVFrame *frame = av_frame_alloc();
+
+    if (!frame)
+        return NULL;
+    frame->format = format;
+    frame->width  = w;
+    frame->height = h;
+    if (av_frame_get_buffer(frame, 32) < 0)
+        av_frame_free(&frame);
+    return frame;
+}
+
+static int build_overlay(AVFilterContext *ctx, const AVFrame *picref, const ASS_Image *images)
+{
+    AssContext *ass = ctx->priv;
+    const ASS_Image *image;
+    ThreadData td = { .images = images };
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+
+    for (image = images; image; image = image->next) {
+        x0 = FFMIN(x0, image->dst_x);
+        y0 = FFMIN(y0, image->dst_y);
+        x1 = FFMAX(x1, image->dst_x + image->w);
+        y1 = FFMAX(y1, image->dst_y + image->h);
+    }
+    // Keep the chroma siting of the frame.
+    x0 = av_clip(x0, 0, picref->width)  & ~((1 << ass->draw.hsub_max) - 1);
+    y0 = av_clip(y0, 0, picref->height) & ~((1 << ass->draw.vsub_max) - 1);
+    x1 = av_clip(x1, 0, picref->width);
+    y1 = av_clip(y1, 0, picref->height);
+
+    ass->overlay_x     = x0;
+    ass->overlay_y     = y0;
+    ass->overlay_w     = FFMAX(x1 - x0, 0);
+    ass->overlay_h     = FFMAX(y1 - y0, 0);
+    ass->overlay_valid = 1;
+    if (!ass->overlay_w || !ass->overlay_h)
+        return 0;
+
+    if (!ass->overlay || ass->overlay->format != picref->format ||
+        ass->overlay->width != ass->overlay_w || ass->overlay->height != ass->overlay_h) {
+        av_frame_free(&ass->overlay);
+        av_frame_free(&ass->transparency);
+        ass->overlay      = alloc_overlay_frame(picref->format, ass->overlay_w, ass->overlay_h);
+        ass->transparency = alloc_overlay_frame(picref->format, ass->overlay_w, ass->overlay_h);
+        if (!ass->overlay || !ass->transparency) {
+            ass->overlay_valid = 0;
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    td.frame        = ass->overlay;
+    td.transparency = ass->transparency;
+    td.x            = x0;
+    td.y            = y0;
+    ctx->internal->execute(ctx, blend_slice, &td, NULL,
+                           FFMIN(ass->overlay_h, ff_filter_get_nb_threads(ctx)));
+    return 0;
+}
+
+static int apply_overlay_slice(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
+{
+    AssContext *ass = ctx->priv;
+    FFDrawContext *draw = &ass->draw;
+    AVFrame *picref = arg;
+    int plane, x, y, slice_start, slice_end;
+
+    slice_bounds(ass, ass->overlay_h, jobnr, nb_jobs, &slice_start, &slice_end);
+
+    for (plane = 0; plane < draw->nb_planes; plane++) {
+        int w  = AV_CEIL_RSHIFT(ass->overlay_w, draw->hsub[plane]) * draw->pixelstep[plane];
+        int y0 = slice_start >> draw->vsub[plane];
+        int y1 = AV_CEIL_RSHIFT(slice_end, draw->vsub[plane]);
+        const uint8_t *o = ass->overlay->data[plane]      + y0 * ass->overlay->linesize[plane];
+        const uint8_t *t = ass->transparency->data[plane] + y0 * ass->transparency->linesize[plane];
+        uint8_t *d = picref->data[plane] +
+                     ((ass->overlay_y >> draw->vsub[plane]) + y0) * picref->linesize[plane] +
+                     (ass->overlay_x >> draw->hsub[plane]) * draw->pixelstep[plane];
+
+        for (y = y0; y < y1; y++) {
+            if (draw->desc->comp[0].depth <= 8) {
+                for (x = 0; x < w; x++)
+                    d[x] = FFMIN(o[x] + ((d[x] * t[x] + 128) * 257 >> 16), 255);
+            } else {
+                for (x = 0; x < w; x += 2) {
+                    unsigned v = AV_RL16(o + x) + (AV_RL16(d + x) * AV_RL16(t + x) + 32767U) / 65535;
+                    AV_WL16(d + x, FFMIN(v, 65535));
+                }
+            }
+            o += ass->overlay->linesize[plane];
+            t += ass->transparency->linesize[plane];
+            d += picref->linesize[plane];
+        }
+    }
+    return 0;
+}
+
+static void apply_overlay(AVFilterContext *ctx, AVFrame *picref)
+{
+    AssContext *ass = ctx->priv;
+
+    if (!ass->overlay_w || !ass->overlay_h)
+        return;
+    ctx->internal->execute(ctx, apply_overlay_slice, picref, NULL,
+                           FFMIN(ass->overlay_h, ff_filter_get_nb_threads(ctx)));
+}
+
+/* Compare the overlay area of picref, drawn from the overlay, with direct,
+   which got the images blended one by one. */
+static void check_overlay(AVFilterContext *ctx, const AVFrame *picref, const AVFrame *direct)
+{
+    AssContext *ass = ctx->priv;
+    FFDrawContext *draw = &ass->draw;
+    int bytes = (draw->desc->comp[0].depth + 7) >> 3;
+    int64_t samples = 0;
+    int plane, x, y;
+
+    for (plane = 0; plane < draw->nb_planes; plane++) {
+        int w  = AV_CEIL_RSHIFT(ass->overlay_w, draw->hsub[plane]) * draw->pixelstep[plane];
+        int y0 = ass->overlay_y >> draw->vsub[plane];
+        int y1 = y0 + AV_CEIL_RSHIFT(ass->overlay_h, draw->vsub[plane]);
+        int x0 = (ass->overlay_x >> draw->hsub[plane]) * draw->pixelstep[plane];
+
+        for (y = y0; y < y1; y++) {
+            const uint8_t *a = picref->data[plane] + y * picref->linesize[plane] + x0;
+            const uint8_t *b = direct->data[plane] + y * direct->linesize[plane] + x0;
+
+            for (x = 0; x < w; x += bytes) {
+                int d = bytes == 1 ? abs(a[x] - b[x]) : abs(AV_RL16(a + x) - AV_RL16(b + x));
+                if (d) {
+                    samples++;
+                    ass->max_difference = FFMAX(ass->max_difference, d);
+                }
+            }
+        }
+    }
+
+    ass->checked_frames++;
+    if (samples) {
+        av_log(ctx, AV_LOG_DEBUG, "Frame drawn from the overlay differs from direct "
+               "blending in %"PRId64" samples\n", samples);
+        ass->differing_frames++;
+        ass->differing_samples += samples;
+    }
+}
+
+/* The images of a render stay valid only until the next ass_render_frame()
+   call, so anything rendered ahead is copied. */
+static ASS_Image *copy_images(const ASS_Image *images, int *ret)
+{
+    const ASS_Image *image;
+    ASS_Image *copy, *dst;
+    uint8_t *bitmap;
+    size_t size = 0;
+    int nb_images = 0, y;
+
+    *ret = 0;
+    for (image = images; image; image = image->next) {
+        nb_images++;
+        size += (size_t)image->w * image->h;
+    }
+    if (!nb_images)
+        return NULL;
+    if (!(copy = av_malloc(nb_images * sizeof(*copy) + size))) {
+        *ret = AVERROR(ENOMEM);
+        return NULL;
+    }
+
+    bitmap = (uint8_t *)(copy + nb_images);
+    for (image = images, dst = copy; image; image = image->next, dst++) {
+        *dst        = *image;
+        dst->bitmap = bitmap;
+        dst->stride = image->w;
+        dst->next   = image->next ? dst + 1 : NULL;
+        for (y = 0; y < image->h; y++)
+            memcpy(bitmap + y * image->w, image->bitmap + y * image->stride, image->w);
+        bitmap += (size_t)image->w * image->h;
+    }
+    return copy;
+}
+
+/* Render the frames following the last one filter_frame() asked for, at the
+   link frame rate, up to lookahead of them. */
+static void *render_thread(void *arg)
+{
+    AVFilterContext *ctx = arg;
+    AVFilterLink *inlink = ctx->inputs[0];
+    AssContext *ass = ctx->priv;
+
+    for (;;) {
+        RenderedFrame f = { 0 };
+        const ASS_Image *images;
+        int ret;
+
+        pthread_mutex_lock(&ass->lock);
+        while (!ass->stop && (!ass->anchored || ass->nb_queued == ass->lookahead))
+            pthread_cond_wait(&ass->cond, &ass->lock);
+        if (ass->stop) {
+            pthread_mutex_unlock(&ass->lock);
+            break;
         }
-        FFDrawColor color;
-        ff_draw_color(&ass->draw, &color, rgba_color);
-        ff_blend_mask(&ass->draw, &color,
-                      picref->data, picref->linesize,
-                      picref->width, picref->height,
-                      image->bitmap, image->stride, image->w, image->h,
-                      3, 0, image->dst_x, image->dst_y);
+        pthread_mutex_unlock(&ass->lock);
+
+        pthread_mutex_lock(&ass->render_lock);
+        pthread_mutex_lock(&ass->lock);
+        if (ass->stop || !ass->anchored || ass->nb_queued == ass->lookahead) {
+            pthread_mutex_unlock(&ass->lock);
+            pthread_mutex_unlock(&ass->render_lock);
+            continue;
+        }
+        f.pts               = ass->next_pts;
+        f.time_ms           = av_rescale_q(f.pts, inlink->time_base, ASS_TIME_BASE);
+        ass->next_pts      += ass->frame_duration;
+        ass->rendering      = 1;
+        ass->rendering_time = f.time_ms;
+        pthread_mutex_unlock(&ass->lock);
+
+        images   = ass_render_frame(ass->renderer, ass->track, f.time_ms, &f.changed);
+        f.seq    = ++ass->render_seq;
+        f.images = copy_images(images, &ret);
+
+        pthread_mutex_lock(&ass->lock);
+        if (ret < 0)
+            ass->anchored = 0; // filter_frame() renders and anchors again
+        else
+            ass->queue[(ass->queue_start + ass->nb_queued++) % ass->lookahead] = f;
+        ass->rendering = 0;
+        pthread_cond_broadcast(&ass->cond);
+        pthread_mutex_unlock(&ass->lock);
+        pthread_mutex_unlock(&ass->render_lock);
     }
+    return NULL;
+}
+
+/* Take the images rendered ahead for time_ms, or render them here if they
+   were not predicted. */
+static int get_images(AVFilterContext *ctx, int64_t pts, long long time_ms,
+                      ASS_Image **images, int *changed)
+{
+    AVFilterLink *inlink = ctx->inputs[0];
+    AssContext *ass = ctx->priv;
+    ASS_Image *image;
+    unsigned seq;
+    int ret;
+
+    av_freep(&ass->current);
+
+    if (!ass->thread_started) {
+        *images = ass_render_frame(ass->renderer, ass->track, time_ms, changed);
+        return 0;
+    }
+
+    pthread_mutex_lock(&ass->lock);
+    for (;;) {
+        RenderedFrame *f;
+
+        if (!ass->nb_queued) {
+            // Wait if the thread is about to get to this frame.
+            long long next_time = ass->rendering ? ass->rendering_time :
+                av_rescale_q(ass->next_pts, inlink->time_base, ASS_TIME_BASE);
+            if (ass->anchored && next_time <= time_ms) {
+                pthread_cond_wait(&ass->cond, &ass->lock);
+                continue;
+            }
+            break;
+        }
+        f = &ass->queue[ass->queue_start];
+        if (f->time_ms > time_ms)
+            break;
+        ass->queue_start = (ass->queue_start + 1) % ass->lookahead;
+        ass->nb_queued--;
+        pthread_cond_broadcast(&ass->cond);
+        if (f->time_ms == time_ms) {
+            ass->current = *images = f->images;
+            *changed = f->changed;
+            seq = f->seq;
+            pthread_mutex_unlock(&ass->lock);
+            goto done;
+        }
+        av_freep(&f->images); // a frame was skipped
+    }
+    pthread_mutex_unlock(&ass->lock);
+
+    pthread_mutex_lock(&ass->render_lock);
+    pthread_mutex_lock(&ass->lock);
+    flush_queue(ass, 0);
+    ass->next_pts = pts + ass->frame_duration;
+    ass->anchored = pts != AV_NOPTS_VALUE && ass->frame_duration > 0;
+    pthread_cond_broadcast(&ass->cond);
+    pthread_mutex_unlock(&ass->lock);
+    image = ass_render_frame(ass->renderer, ass->track, time_ms, changed);
+    seq   = ++ass->render_seq;
+    ass->current = *images = copy_images(image, &ret);
+    pthread_mutex_unlock(&ass->render_lock);
+    if (ret < 0)
+        return ret;
+
+done:
+    /* libass compares with its previous render, which may have been for
+       another frame. */
+    if (seq != ass->last_seq + 1)
+        *changed = 2;
+    ass->last_seq = seq;
+    return 0;
 }
 
 static int filter_frame(AVFilterLink *inlink, AVFrame *picref)
@@ -542,14 +1066,47 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *picref)
     AssContext *ass = ctx->priv;
     ASS_Image *image = NULL;
     long long time_ms = av_rescale_q(picref->pts, inlink->time_base, ASS_TIME_BASE);
+    int changed = 0, ret;
 
     if (!ass->mangle_state) {
         calculate_mangle_table(ass, picref);
     }
 
-    image = ass_render_frame(ass->renderer, ass->track, time_ms, NULL);
-
-    overlay_ass_image(ass, picref, image);
+    if ((ret = get_images(ctx, picref->pts, time_ms, &image, &changed)) < 0) {
+        av_frame_free(&picref);
+        return ret;
+    }
+    if (changed)
+        ass->overlay_valid = 0;
+
+    /* Composite the images once they stayed the same for a frame, and reuse
+       that until libass reports a change. Lines that change on every frame
+       (karaoke, moves) are still blended directly. */
+    if (changed) {
+        overlay_ass_image(ctx, picref, image);
+    } else if (image) {
+        AVFrame *direct = NULL;
+
+        if (!ass->overlay_valid && (ret = build_overlay(ctx, picref, image)) < 0) {
+            av_frame_free(&picref);
+            return ret;
+        }
+        if (ass->check_overlay) {
+            direct = ff_get_video_buffer(outlink, picref->width, picref->height);
+            ret = direct ? av_frame_copy(direct, picref) : AVERROR(ENOMEM);
+            if (ret < 0) {
+                av_frame_free(&direct);
+                av_frame_free(&picref);
+                return ret;
+            }
+            overlay_ass_image(ctx, direct, image);
+        }
+        apply_overlay(ctx, picref);
+        if (direct) {
+            check_overlay(ctx, picref, direct);
+            av_frame_free(&direct);
+        }
+    }
 
     return ff_filter_frame(outlink, picref);
 }
@@ -576,7 +1133,138 @@ static const AVFilterPad inlineass_outputs[] = {
 void avfilter_inlineass_set_storage_size(AVFilterContext *context, int w, int h)
 {
     AssContext *ass = (AssContext *)context->priv;
+    pthread_mutex_lock(&ass->render_lock);
     ass_set_storage_size(ass->renderer, w, h);
+    pthread_mutex_unlock(&ass->render_lock);
+}
+
+/* libass selects an embedded font by its family, full or PostScript name. */
+static void add_font_name(AVBPrint *names, const char *name)
+{
+    const char *p = names->str;
+    size_t len = strlen(name);
+
+    if (!len || strchr(name, '\t'))
+        return;
+    while (*p) {
+        size_t n = strcspn(p, "\t");
+        if (n == len && !av_strncasecmp(p, name, len))
+            return;
+        p += n + !!p[n];
+    }
+    av_bprintf(names, "%s%s", names->len ? "\t" : "", name);
+}
+
+static void read_name_table(const uint8_t *table, unsigned size, AVBPrint *names)
+{
+    unsigned count, strings, i;
+
+    if (size < 6)
+        return;
+    count   = AV_RB16(table + 2);
+    strings = AV_RB16(table + 4);
+    for (i = 0; i < count && 6 + 12 * (i + 1) <= size; i++) {
+        const uint8_t *rec = table + 6 + 12 * i;
+        unsigned platform = AV_RB16(rec), id = AV_RB16(rec + 6);
+        unsigned len = AV_RB16(rec + 8), offset = strings + AV_RB16(rec + 10);
+        const uint8_t *p, *end;
+        char name[256];
+        AVBPrint b;
+
+        if ((id != 1 && id != 4 && id != 6) || offset > size || len > size - offset)
+            continue;
+        p   = table + offset;
+        end = p + len;
+        av_bprint_init_for_buffer(&b, name, sizeof(name));
+        if (platform == 0 || platform == 3) {
+            while (end - p >= 2) {
+                uint32_t val;
+                uint8_t tmp;
+                GET_UTF16(val, end - p >= 2 ? (p += 2, AV_RB16(p - 2)) : 0, break;)
+                if (val < 0x20)
+                    break;
+                PUT_UTF8(val, tmp, av_bprint_chars(&b, tmp, 1);)
+            }
+        } else if (platform == 1) {
+            for (; p < end && *p >= 0x20 && *p < 0x80; p++)
+                av_bprint_chars(&b, *p, 1);
+        }
+        if (p == end && av_bprint_is_complete(&b))
+            add_font_name(names, name);
+    }
+}
+
+static void read_font_names(const uint8_t *data, unsigned size, AVBPrint *names)
+{
+    unsigned nb_faces = 1, face, i;
+    int ttc = size >= 12 && AV_RB32(data) == MKBETAG('t','t','c','f');
+
+    if (ttc)
+        nb_faces = FFMIN(AV_RB32(data + 8), (size - 12) / 4);
+    for (face = 0; face < nb_faces; face++) {
+        unsigned offset = ttc ? AV_RB32(data + 12 + 4 * face) : 0;
+        unsigned nb_tables;
+
+        if (size < 12 || offset > size - 12)
+            continue;
+        nb_tables = AV_RB16(data + offset + 4);
+        for (i = 0; i < nb_tables && offset + 12 + 16 * (i + 1) <= size; i++) {
+            const uint8_t *rec = data + offset + 12 + 16 * i;
+            unsigned table = AV_RB32(rec + 8), len = AV_RB32(rec + 12);
+
+            if (AV_RB32(rec) != MKBETAG('n','a','m','e'))
+                continue;
+            if (table <= size && len <= size - table)
+                read_name_table(data + table, len, names);
+            break;
+        }
+    }
+}
+
+static void add_font_ref(AssContext *ass, const char *name, size_t len)
+{
+    char *ref;
+
+    while (len && (*name == ' ' || *name == '@'))
+        name++, len--;
+    while (len && name[len - 1] == ' ')
+        len--;
+    if (!len || !(ref = av_strndup(name, len)))
+        return;
+    av_dict_set(&ass->font_refs, ref, "", 0);
+    av_free(ref);
+}
+
+static int font_referenced(AssContext *ass, const FontAttachment *font)
+{
+    const char *p = font->names;
+    char name[256];
+
+    while (*p) {
+        size_t n = strcspn(p, "\t");
+        av_strlcpy(name, p, FFMIN(n + 1, sizeof(name)));
+        if (av_dict_get(ass->font_refs, name, NULL, 0))
+            return 1;
+        p += n + !!p[n];
+    }
+    return 0;
+}
+
+/* Fonts named by the styles are registered first, so that they are picked
+   over other attachments with the same names. The rest are kept for \fn
+   overrides and as fallback fonts. */
+static void register_fonts(AVFilterContext *ctx)
+{
+    AssContext *ass = ctx->priv;
+    int pass, i;
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < ass->nb_fonts; i++) {
+            FontAttachment *font = &ass->fonts[i];
+            if (font_referenced(ass, font) == !pass)
+                ass_add_font(ass->library, font->filename, (char *)font->data, font->size);
+        }
+    }
 }
 
 void avfilter_inlineass_add_attachment(AVFilterContext *context, AVStream *st)
@@ -597,15 +1285,43 @@ void avfilter_inlineass_add_attachment(AVFilterContext *context, AVStream *st)
         !av_strcasecmp( ext, ".otf" ) ||
         !av_strcasecmp( ext, ".ttc" )
     ) {
-        ass_add_font(assContext->library, filename,
-                     st->codecpar->extradata, st->codecpar->extradata_size);
+        FontAttachment *fonts, font = { 0 };
+        AVBPrint b;
+        int i;
+
+        // The same font may be attached more than once.
+        for (i = 0; i < assContext->nb_fonts; i++)
+            if (assContext->fonts[i].size == st->codecpar->extradata_size &&
+                !memcmp(assContext->fonts[i].data, st->codecpar->extradata,
+                        st->codecpar->extradata_size))
+                return;
+
+        av_bprint_init(&b, 0, AV_BPRINT_SIZE_UNLIMITED);
+        read_font_names(st->codecpar->extradata, st->codecpar->extradata_size, &b);
+        av_bprint_finalize(&b, &font.names);
+        font.filename = av_strdup(filename);
+        font.data     = st->codecpar->extradata;
+        font.size     = st->codecpar->extradata_size;
+        fonts = av_realloc_array(assContext->fonts, assContext->nb_fonts + 1, sizeof(*fonts));
+        if (!font.names || !font.filename || !fonts) {
+            av_free(font.names);
+            av_free(font.filename);
+            if (fonts)
+                assContext->fonts = fonts;
+            return;
+        }
+        assContext->fonts = fonts;
+        assContext->fonts[assContext->nb_fonts++] = font;
     }
 }
 
 void avfilter_inlineass_set_fonts(AVFilterContext *context)
 {
     AssContext* ass = context->priv;
+    pthread_mutex_lock(&ass->render_lock);
+    register_fonts(context);
     ass_set_fonts(ass->renderer, ass->font_path, "DejaVu Sans", 1, ass->fc_file, 1);
+    pthread_mutex_unlock(&ass->render_lock);
 }
 
 static void process_header(AVFilterContext *link, AVCodecContext *dec_ctx)
@@ -613,6 +1329,7 @@ static void process_header(AVFilterContext *link, AVCodecContext *dec_ctx)
     AssContext *ass = link->priv;
     ASS_Track *track = ass->track;
     enum AVCodecID codecID = dec_ctx->codec_id;
+    int i;
 
     if (!track)
         return;
@@ -656,15 +1373,31 @@ static void process_header(AVFilterContext *link, AVCodecContext *dec_ctx)
         track->default_style = sid;
     }
 
+    add_font_ref(ass, "DejaVu Sans", strlen("DejaVu Sans"));
+    for (i = 0; i < track->n_styles; i++)
+        if (track->styles[i].FontName)
+            add_font_ref(ass, track->styles[i].FontName, strlen(track->styles[i].FontName));
+
     ass->got_header = 1;
 }
 
+void avfilter_inlineass_process_header(AVFilterContext *link, AVCodecContext *dec_ctx)
+{
+    AssContext *ass = link->priv;
+
+    pthread_mutex_lock(&ass->render_lock);
+    if (!ass->got_header)
+        process_header(link, dec_ctx);
+    pthread_mutex_unlock(&ass->render_lock);
+}
+
 void avfilter_inlineass_append_data(AVFilterContext *link, AVCodecContext *dec_ctx,
                                     AVSubtitle *sub)
 {
     AssContext *ass = link->priv;
-    int i;
+    int i, j;
 
+    pthread_mutex_lock(&ass->render_lock);
     if (!ass->got_header)
         process_header(link, dec_ctx);
 
@@ -676,7 +1409,22 @@ void avfilter_inlineass_append_data(AVFilterContext *link, AVCodecContext *dec_c
         if (!ass_line)
             break;
         ass_process_chunk(ass->track, ass_line, strlen(ass_line), start, duration);
+
+        // Render again the frames rendered ahead that the event shows on.
+        pthread_mutex_lock(&ass->lock);
+        for (j = 0; j < ass->nb_queued; j++) {
+            RenderedFrame *f = &ass->queue[(ass->queue_start + j) % ass->lookahead];
+            if (f->time_ms >= start && f->time_ms < start + duration) {
+                ass->next_pts = f->pts;
+                flush_queue(ass, j);
+                pthread_cond_broadcast(&ass->cond);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&ass->lock);
     }
+
+    pthread_mutex_unlock(&ass->render_lock);
 }
 
 static const AVOption inlineass_options[] = {
@@ -686,6 +1434,8 @@ static const AVOption inlineass_options[] = {
     {"margin",         "default margin",                   OFFSET(margin),     AV_OPT_TYPE_INT64,  {.i64 = 20  }, INT64_MIN, INT64_MAX,FLAGS},
     {"fonts_dir",      "directory to scan for fonts",      OFFSET(fonts_dir),  AV_OPT_TYPE_STRING, {.str = NULL}, CHAR_MIN,  CHAR_MAX, FLAGS},
     {"fontconfig_file","fontconfig file to load",          OFFSET(fc_file),    AV_OPT_TYPE_STRING, {.str = NULL}, CHAR_MIN,  CHAR_MAX, FLAGS},
+    {"lookahead",      "frames to render ahead on a thread of their own", OFFSET(lookahead), AV_OPT_TYPE_INT, {.i64 = 0}, 0, 64, FLAGS},
+    {"check_overlay",  "compare frames drawn from the cached overlay with direct blending", OFFSET(check_overlay), AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, FLAGS},
     {NULL},
 };
 
@@ -701,4 +1451,5 @@ AVFilter ff_vf_inlineass ={
     .query_formats = query_formats,
     .inputs        = inlineass_inputs,
     .outputs       = inlineass_outputs,
+    .flags         = AVFILTER_FLAG_SLICE_THREADS,
   };
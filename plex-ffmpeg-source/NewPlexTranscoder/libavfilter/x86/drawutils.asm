@@ -0,0 +1,183 @@
+;*****************************************************************************
+;* x86-optimized functions for drawutils
+;*
+;* This file is part of FFmpeg.
+;*
+;* FFmpeg is free software; you can redistribute it and/or
+;* modify it under the terms of the GNU Lesser General Public
+;* License as published by the Free Software Foundation; either
+;* version 2.1 of the License, or (at your option) any later version.
+;*
+;* FFmpeg is distributed in the hope that it will be useful,
+;* but WITHOUT ANY WARRANTY; without even the implied warranty of
+;* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+;* Lesser General Public License for more details.
+;*
+;* You should have received a copy of the GNU Lesser General Public
+;* License along with FFmpeg; if not, write to the Free Software
+;* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+;******************************************************************************
+
+%include "libavutil/x86/x86util.asm"
+
+SECTION_RODATA 32
+
+pw_1: times 16 dw 1
+
+SECTION .text
+
+; %1 = low 32 bits of %1 * %2 in each dword, %3 and %4 are clobbered
+%macro MULLD 4
+%if cpuflag(avx2)
+    pmulld          %1, %2
+%else
+    pshufd          %3, %1, q3311
+    pshufd          %4, %2, q3311
+    pmuludq         %1, %2
+    pmuludq         %3, %4
+    pshufd          %1, %1, q0020
+    pshufd          %3, %3, q0020
+    punpckldq       %1, %3
+%endif
+%endmacro
+
+; m0 = mmsize / 4 mask values as dwords, averaged over 2x2 blocks if %1
+%macro LOAD_MASK 1
+%if %1
+%if cpuflag(avx2)
+    pmovzxbw        m0, [maskq  + 2 * wq]
+    pmovzxbw        m1, [mask2q + 2 * wq]
+%else
+    movq            m0, [maskq  + 2 * wq]
+    movq            m1, [mask2q + 2 * wq]
+    punpcklbw       m0, m5
+    punpcklbw       m1, m5
+%endif
+    paddw           m0, m1
+    pmaddwd         m0, [pw_1]
+    psrld           m0, 2
+%else
+%if cpuflag(avx2)
+    pmovzxbd        m0, [maskq + wq]
+%else
+    movd            m0, [maskq + wq]
+    punpcklbw       m0, m5
+    punpcklwd       m0, m5
+%endif
+%endif
+%endmacro
+
+; The sums of blend_row*_c are formed as dst * 0x1010101 + a * (src - dst)
+; (0x10001 for 16 bits), which wraps to the same 32-bit value.
+;
+; void ff_blend_row<depth>[_sub](uint8_t *dst, const uint8_t *mask,
+;                                ptrdiff_t mask_linesize, int w,
+;                                unsigned src, unsigned alpha)
+; %1 depth (8 or 16), %2 mask subsampled 2x2 or not
+%macro BLEND_ROW 2
+%if %2
+cglobal blend_row%1_sub, 6, 6, 8, dst, mask, mask2, w, src, alpha
+    add             mask2q, maskq
+%else
+cglobal blend_row%1, 6, 6, 8, dst, mask, mask_linesize, w, src, alpha
+%endif
+    movd            xm6, srcd
+    movd            xm7, alphad
+%if cpuflag(avx2)
+    vpbroadcastd    m6, xm6
+    vpbroadcastd    m7, xm7
+%else
+    pshufd          m6, m6, 0
+    pshufd          m7, m7, 0
+%endif
+    pxor            m5, m5
+    movsxdifnidn    wq, wd
+    test            wq, wq
+    jz .end
+%if %1 == 8
+    add             dstq, wq
+%else
+    lea             dstq, [dstq + 2 * wq]
+%endif
+%if %2
+    lea             maskq, [maskq + 2 * wq]
+    lea             mask2q, [mask2q + 2 * wq]
+%else
+    add             maskq, wq
+%endif
+    neg             wq
+
+.loop:
+    LOAD_MASK       %2
+%if %1 == 8
+%if cpuflag(avx2)
+    pmovzxbd        m1, [dstq + wq]
+%else
+    movd            m1, [dstq + wq]
+    punpcklbw       m1, m5
+    punpcklwd       m1, m5
+%endif
+    MULLD           m0, m7, m2, m3          ; a = mask * alpha
+    psubd           m2, m6, m1
+    MULLD           m2, m0, m3, m4          ; a * (src - dst)
+    pslld           m3, m1, 8
+    por             m1, m3
+    pslld           m3, m1, 16
+    por             m1, m3
+    paddd           m1, m2
+    psrld           m1, 24
+%if cpuflag(avx2)
+    vextracti128    xm2, m1, 1
+    packssdw        xm1, xm2
+    packuswb        xm1, xm1
+    movq            [dstq + wq], xm1
+%else
+    packssdw        m1, m1
+    packuswb        m1, m1
+    movd            [dstq + wq], m1
+%endif
+%else ; %1 == 16
+%if cpuflag(avx2)
+    pmovzxwd        m1, [dstq + 2 * wq]
+%else
+    movq            m1, [dstq + 2 * wq]
+    punpcklwd       m1, m5
+%endif
+    pmaddwd         m0, m7                  ; a = mask * alpha, fits in 16 bits
+    psubd           m2, m6, m1
+    MULLD           m2, m0, m3, m4          ; a * (src - dst)
+    pslld           m3, m1, 16
+    por             m1, m3
+    paddd           m1, m2
+%if cpuflag(avx2)
+    psrld           m1, 16
+    vextracti128    xm2, m1, 1
+    packusdw        xm1, xm2
+    movu            [dstq + 2 * wq], xm1
+%else
+    ; keep the high words, SSE2 has no unsigned dword to word pack
+    pshuflw         m1, m1, q3131
+    pshufhw         m1, m1, q3131
+    pshufd          m1, m1, q2020
+    movq            [dstq + 2 * wq], m1
+%endif
+%endif
+    add             wq, mmsize / 4
+    jl .loop
+.end:
+    RET
+%endmacro
+
+INIT_XMM sse2
+BLEND_ROW 8, 0
+BLEND_ROW 8, 1
+BLEND_ROW 16, 0
+BLEND_ROW 16, 1
+
+%if HAVE_AVX2_EXTERNAL
+INIT_YMM avx2
+BLEND_ROW 8, 0
+BLEND_ROW 8, 1
+BLEND_ROW 16, 0
+BLEND_ROW 16, 1
+%endif
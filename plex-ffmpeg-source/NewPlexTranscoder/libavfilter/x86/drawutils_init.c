@@ -0,0 +1,56 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libavutil/attributes.h"
+#include "libavutil/cpu.h"
+#include "libavutil/x86/cpu.h"
+#include "libavfilter/drawutils.h"
+
+#define BLEND_ROW_FUNC(name, opt)                                                \
+void ff_blend_##name##_##opt(uint8_t *dst, const uint8_t *mask,                 \
+                             ptrdiff_t mask_linesize, int w,                     \
+                             unsigned src, unsigned alpha);
+
+#define BLEND_ROW_FUNCS(opt)        \
+    BLEND_ROW_FUNC(row8, opt)       \
+    BLEND_ROW_FUNC(row8_sub, opt)   \
+    BLEND_ROW_FUNC(row16, opt)      \
+    BLEND_ROW_FUNC(row16_sub, opt)
+
+BLEND_ROW_FUNCS(sse2)
+BLEND_ROW_FUNCS(avx2)
+
+av_cold void ff_draw_init_x86(FFDrawContext *draw)
+{
+    int cpu_flags = av_get_cpu_flags();
+
+    if (EXTERNAL_SSE2(cpu_flags)) {
+        draw->blend_row[0][0] = ff_blend_row8_sse2;
+        draw->blend_row[0][1] = ff_blend_row8_sub_sse2;
+        draw->blend_row[1][0] = ff_blend_row16_sse2;
+        draw->blend_row[1][1] = ff_blend_row16_sub_sse2;
+        draw->blend_row_block = 4;
+    }
+    if (EXTERNAL_AVX2_FAST(cpu_flags)) {
+        draw->blend_row[0][0] = ff_blend_row8_avx2;
+        draw->blend_row[0][1] = ff_blend_row8_sub_avx2;
+        draw->blend_row[1][0] = ff_blend_row16_avx2;
+        draw->blend_row[1][1] = ff_blend_row16_sub_avx2;
+        draw->blend_row_block = 8;
+    }
+}
@@ -1929,6 +1929,15 @@ typedef struct AVFormatContext {
      * - decoding: set by user
      */
     int max_streams;
+
+    /**
+     * Directory in which avformat_find_stream_info() keeps its results for
+     * local files, so that opening an unchanged file again skips the
+     * analysis. Entries are keyed by path, size and modification time.
+     * - encoding: unused
+     * - decoding: set by user
+     */
+    char *probe_cache_dir; //PLEX
 } AVFormatContext;
 
 #if FF_API_FORMAT_GET_SET
@@ -169,4 +169,20 @@ int ffio_close_null_buf(AVIOContext *s);
  */
 void ffio_free_dyn_buf(AVIOContext **s);
 
+//PLEX
+/**
+ * Send a new HTTP request on the connection of an AVIOContext opened on an
+ * http(s) URL with the "multiple_requests" option, keeping the connection
+ * alive. The reply of the previous request must have been read completely.
+ * Protocol options for the new request (e.g. "method" or "post_data") can be
+ * changed beforehand with av_opt_set() and AV_OPT_SEARCH_CHILDREN.
+ *
+ * @param s   the context to reuse
+ * @param uri URL of the new request; must point to the same host and port
+ * @return 0 on success, AVERROR_EOF if the server closed the connection, or
+ *         another negative AVERROR code on failure
+ */
+int ffio_http_new_request(AVIOContext *s, const char *uri);
+//PLEX
+
 #endif /* AVFORMAT_AVIO_INTERNAL_H */
@@ -29,6 +29,7 @@
 #include "avformat.h"
 #include "avio.h"
 #include "avio_internal.h"
+#include "http.h"
 #include "internal.h"
 #include "url.h"
 #include <stdarg.h>
@@ -1241,6 +1242,31 @@ int avio_handshake(AVIOContext *c)
     return ffurl_handshake(cc);
 }
 
+//PLEX
+int ffio_http_new_request(AVIOContext *s, const char *uri)
+{
+#if CONFIG_HTTP_PROTOCOL
+    URLContext *h = ffio_geturlcontext(s);
+    int ret;
+
+    if (!h || s->write_flag)
+        return AVERROR(EINVAL);
+
+    ret = ff_http_do_new_request(h, uri);
+    if (ret < 0)
+        return ret;
+
+    s->buf_ptr     = s->buf_end = s->buffer;
+    s->pos         = 0;
+    s->eof_reached = 0;
+    s->error       = 0;
+    return 0;
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
+//PLEX
+
 /* output in a dynamic buffer */
 
 typedef struct DynBuffer {
@@ -234,6 +234,23 @@ char *ff_data_to_hex(char *buf, const uint8_t *src, int size, int lowercase);
  */
 int ff_hex_to_data(uint8_t *data, const char *p);
 
+//PLEX
+/**
+ * Restore the results of an earlier avformat_find_stream_info() on the same
+ * file from s->probe_cache_dir.
+ *
+ * @return 1 if the streams were filled in from the cache, 0 if there is no
+ *         valid entry, a negative AVERROR code if applying it failed
+ */
+int ff_probe_cache_load(AVFormatContext *s);
+
+/**
+ * Save the stream parameters found by avformat_find_stream_info() to
+ * s->probe_cache_dir. Failures are not fatal and are ignored.
+ */
+void ff_probe_cache_store(AVFormatContext *s);
+//PLEX
+
 /**
  * Add packet to AVFormatContext->packet_buffer list, determining its
  * interleaved position using compare() function argument.
@@ -0,0 +1,370 @@
+/*
+ * On-disk cache of avformat_find_stream_info() results
+ * Copyright (c) 2016 Plex, Inc.
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * One file per input, named after the MD5 of its path, holding the stream
+ * parameters as "key=value" lines. An entry is only used if the size and
+ * modification time of the input still match and the demuxer created the
+ * same streams from the header.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#if HAVE_IO_H
+#include <io.h>
+#endif
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
+#include <stdio.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/dict.h"
+#include "libavutil/file.h"
+#include "libavutil/internal.h"
+#include "libavutil/md5.h"
+#include "libavutil/random_seed.h"
+#include "avformat.h"
+#include "internal.h"
+#include "os_support.h"
+
+#define PROBE_CACHE_VERSION 2
+
+#define PAR_FIELDS(X)                                                        \
+    X(codec_type) X(codec_id) X(codec_tag) X(format) X(bit_rate)             \
+    X(bits_per_coded_sample) X(bits_per_raw_sample) X(profile) X(level)      \
+    X(width) X(height) X(field_order) X(color_range) X(color_primaries)      \
+    X(color_trc) X(color_space) X(chroma_location) X(video_delay)             \
+    X(channel_layout) X(channels) X(sample_rate) X(block_align)              \
+    X(frame_size) X(initial_padding) X(trailing_padding) X(seek_preroll)
+
+#define STREAM_FIELDS(X)                                                     \
+    X(start_time) X(duration) X(codec_info_nb_frames) X(disposition)
+
+#define FORMAT_FIELDS(X)                                                     \
+    X(start_time) X(duration) X(bit_rate)
+
+static int cache_path(const AVFormatContext *ic, const char **path, char *entry, int size)
+{
+    uint8_t md5[16];
+    char hex[2 * sizeof(md5) + 1];
+    const char *proto;
+
+    if (!ic->url)
+        return AVERROR(EINVAL);
+    proto = avio_find_protocol_name(ic->url);
+    if (!proto || strcmp(proto, "file"))
+        return AVERROR(ENOSYS);
+
+    *path = ic->url;
+    av_strstart(ic->url, "file:", path);
+    av_md5_sum(md5, *path, strlen(*path));
+    ff_data_to_hex(hex, md5, sizeof(md5), 1);
+    hex[2 * sizeof(md5)] = 0;
+    snprintf(entry, size, "%s/%s.probe", ic->probe_cache_dir, hex);
+    return 0;
+}
+
+static void set_int(AVDictionary **d, const char *prefix, const char *key, int64_t val)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s%s", prefix, key);
+    av_dict_set_int(d, name, val, 0);
+}
+
+static void set_q(AVDictionary **d, const char *prefix, const char *key, AVRational q)
+{
+    char name[64], val[32];
+    snprintf(name, sizeof(name), "%s%s", prefix, key);
+    snprintf(val, sizeof(val), "%d/%d", q.num, q.den);
+    av_dict_set(d, name, val, 0);
+}
+
+static int get_int(AVDictionary *d, const char *prefix, const char *key, int64_t *val)
+{
+    char name[64];
+    AVDictionaryEntry *e;
+
+    snprintf(name, sizeof(name), "%s%s", prefix, key);
+    if (!(e = av_dict_get(d, name, NULL, AV_DICT_MATCH_CASE)))
+        return AVERROR_INVALIDDATA;
+    *val = strtoll(e->value, NULL, 10);
+    return 0;
+}
+
+static int get_q(AVDictionary *d, const char *prefix, const char *key, AVRational *q)
+{
+    char name[64];
+    AVDictionaryEntry *e;
+
+    snprintf(name, sizeof(name), "%s%s", prefix, key);
+    if (!(e = av_dict_get(d, name, NULL, AV_DICT_MATCH_CASE)) ||
+        sscanf(e->value, "%d/%d", &q->num, &q->den) != 2)
+        return AVERROR_INVALIDDATA;
+    return 0;
+}
+
+static int stream_matches(AVDictionary *d, const char *prefix, const AVStream *st)
+{
+    int64_t v;
+
+    return get_int(d, prefix, "id", &v) >= 0 && v == st->id &&
+           get_int(d, prefix, "tb_num", &v) >= 0 && v == st->time_base.num &&
+           get_int(d, prefix, "tb_den", &v) >= 0 && v == st->time_base.den;
+}
+
+int ff_probe_cache_load(AVFormatContext *ic)
+{
+    AVDictionary *d = NULL;
+    AVDictionaryEntry *e;
+    const char *path;
+    char entry[1024], prefix[16];
+    uint8_t *data = NULL;
+    size_t data_size;
+    struct stat sb;
+    int64_t v;
+    int i, ret;
+
+    // Streams of these demuxers only appear while reading packets.
+    if (ic->ctx_flags & AVFMTCTX_NOHEADER)
+        return 0;
+    if (cache_path(ic, &path, entry, sizeof(entry)) < 0 || stat(path, &sb) < 0)
+        return 0;
+    if (av_file_map(entry, &data, &data_size, 0, ic) < 0)
+        return 0;
+
+    ret = 0;
+    {
+        char *text = av_malloc(data_size + 1);
+        if (!text) {
+            av_file_unmap(data, data_size);
+            return AVERROR(ENOMEM);
+        }
+        memcpy(text, data, data_size);
+        text[data_size] = 0;
+        av_file_unmap(data, data_size);
+        if (av_dict_parse_string(&d, text, "=", "\n", 0) < 0)
+            ret = AVERROR_INVALIDDATA;
+        av_free(text);
+    }
+    if (ret < 0)
+        goto miss;
+
+    if (get_int(d, "", "version", &v) < 0 || v != PROBE_CACHE_VERSION ||
+        get_int(d, "", "size", &v) < 0 || v != sb.st_size ||
+        get_int(d, "", "mtime", &v) < 0 || v != sb.st_mtime ||
+        !(e = av_dict_get(d, "path", NULL, AV_DICT_MATCH_CASE)) || strcmp(e->value, path) ||
+        !(e = av_dict_get(d, "format", NULL, AV_DICT_MATCH_CASE)) || strcmp(e->value, ic->iformat->name) ||
+        get_int(d, "", "nb_streams", &v) < 0 || v != ic->nb_streams)
+        goto miss;
+    for (i = 0; i < ic->nb_streams; i++) {
+        snprintf(prefix, sizeof(prefix), "%d.", i);
+        if (!stream_matches(d, prefix, ic->streams[i]))
+            goto miss;
+    }
+
+    for (i = 0; i < ic->nb_streams; i++) {
+        AVStream *st = ic->streams[i];
+        AVCodecParameters *par = st->codecpar;
+
+        snprintf(prefix, sizeof(prefix), "%d.", i);
+#define GET(obj, field)                                                     \
+        if ((ret = get_int(d, prefix, #field, &v)) < 0)                     \
+            goto fail;                                                      \
+        obj->field = v;
+#define GET_PAR(field)    GET(par, field)
+#define GET_STREAM(field) GET(st, field)
+        PAR_FIELDS(GET_PAR)
+        STREAM_FIELDS(GET_STREAM)
+        if ((ret = get_q(d, prefix, "sample_aspect_ratio", &par->sample_aspect_ratio)) < 0 ||
+            (ret = get_q(d, prefix, "avg_frame_rate", &st->avg_frame_rate)) < 0 ||
+            (ret = get_q(d, prefix, "r_frame_rate", &st->r_frame_rate)) < 0 ||
+            (ret = get_q(d, prefix, "st_sample_aspect_ratio", &st->sample_aspect_ratio)) < 0)
+            goto fail;
+
+        av_freep(&par->extradata);
+        par->extradata_size = 0;
+        snprintf(entry, sizeof(entry), "%sextradata", prefix);
+        if ((e = av_dict_get(d, entry, NULL, AV_DICT_MATCH_CASE)) && *e->value) {
+            int size = strlen(e->value) / 2;
+            par->extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+            if (!par->extradata) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+            par->extradata_size = ff_hex_to_data(par->extradata, e->value);
+        }
+
+        // The codec is known, so reading packets must not probe it again.
+        if (st->request_probe > 0)
+            st->request_probe = -1;
+        st->internal->need_context_update = 1;
+
+#if FF_API_LAVF_AVCTX
+FF_DISABLE_DEPRECATION_WARNINGS
+        if ((ret = avcodec_parameters_to_context(st->codec, par)) < 0)
+            goto fail;
+        if (get_int(d, prefix, "refs", &v) >= 0)
+            st->codec->refs = v;
+        if (get_int(d, prefix, "scaling_matrix_present", &v) >= 0)
+            st->codec->scaling_matrix_present = v;
+        get_q(d, prefix, "codec_time_base", &st->codec->time_base);
+        if (get_int(d, prefix, "ticks_per_frame", &v) >= 0)
+            st->codec->ticks_per_frame = v;
+        if (get_int(d, prefix, "coded_width", &v) >= 0)
+            st->codec->coded_width = v;
+        if (get_int(d, prefix, "coded_height", &v) >= 0)
+            st->codec->coded_height = v;
+        st->codec->framerate = st->avg_frame_rate;
+        if (get_int(d, prefix, "properties", &v) >= 0)
+            st->codec->properties = v;
+        snprintf(entry, sizeof(entry), "%ssubtitle_header", prefix);
+        av_freep(&st->codec->subtitle_header);
+        st->codec->subtitle_header_size = 0;
+        if ((e = av_dict_get(d, entry, NULL, AV_DICT_MATCH_CASE)) && *e->value) {
+            int size = strlen(e->value) / 2;
+            st->codec->subtitle_header = av_mallocz(size + 1);
+            if (!st->codec->subtitle_header) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+            st->codec->subtitle_header_size = ff_hex_to_data(st->codec->subtitle_header, e->value);
+        }
+FF_ENABLE_DEPRECATION_WARNINGS
+#endif
+    }
+    prefix[0] = 0;
+#define GET_FORMAT(field) GET(ic, field)
+    FORMAT_FIELDS(GET_FORMAT)
+
+    av_log(ic, AV_LOG_VERBOSE, "Using cached stream info for %s\n", path);
+    av_dict_free(&d);
+    return 1;
+
+miss:
+    av_dict_free(&d);
+    return 0;
+fail:
+    // Fields were overwritten already; the caller has to give up on ic.
+    av_log(ic, AV_LOG_ERROR, "Corrupt probe cache entry for %s\n", path);
+    av_dict_free(&d);
+    return ret;
+}
+
+void ff_probe_cache_store(AVFormatContext *ic)
+{
+    AVDictionary *d = NULL;
+    const char *path;
+    char entry[1024], tmp[1040], prefix[16];
+    char *text = NULL;
+    struct stat sb;
+    int i, fd, len;
+
+    if (ic->ctx_flags & AVFMTCTX_NOHEADER)
+        return;
+    if (cache_path(ic, &path, entry, sizeof(entry)) < 0 || stat(path, &sb) < 0)
+        return;
+
+    set_int(&d, "", "version", PROBE_CACHE_VERSION);
+    av_dict_set(&d, "path", path, 0);
+    av_dict_set(&d, "format", ic->iformat->name, 0);
+    set_int(&d, "", "size", sb.st_size);
+    set_int(&d, "", "mtime", sb.st_mtime);
+    set_int(&d, "", "nb_streams", ic->nb_streams);
+    prefix[0] = 0;
+#define SET(obj, field) set_int(&d, prefix, #field, obj->field);
+#define SET_FORMAT(field) SET(ic, field)
+    FORMAT_FIELDS(SET_FORMAT)
+
+    for (i = 0; i < ic->nb_streams; i++) {
+        const AVStream *st = ic->streams[i];
+        const AVCodecParameters *par = st->codecpar;
+
+        snprintf(prefix, sizeof(prefix), "%d.", i);
+#define SET_PAR(field)    SET(par, field)
+#define SET_STREAM(field) SET(st, field)
+        PAR_FIELDS(SET_PAR)
+        STREAM_FIELDS(SET_STREAM)
+        set_int(&d, prefix, "id", st->id);
+        set_int(&d, prefix, "tb_num", st->time_base.num);
+        set_int(&d, prefix, "tb_den", st->time_base.den);
+        set_q(&d, prefix, "sample_aspect_ratio", par->sample_aspect_ratio);
+        set_q(&d, prefix, "avg_frame_rate", st->avg_frame_rate);
+        set_q(&d, prefix, "r_frame_rate", st->r_frame_rate);
+        set_q(&d, prefix, "st_sample_aspect_ratio", st->sample_aspect_ratio);
+        if (par->extradata_size) {
+            char *hex = av_malloc(2 * par->extradata_size + 1);
+            if (!hex)
+                goto end;
+            ff_data_to_hex(hex, par->extradata, par->extradata_size, 1);
+            hex[2 * par->extradata_size] = 0;
+            snprintf(entry, sizeof(entry), "%sextradata", prefix);
+            av_dict_set(&d, entry, hex, AV_DICT_DONT_STRDUP_VAL);
+        }
+#if FF_API_LAVF_AVCTX
+FF_DISABLE_DEPRECATION_WARNINGS
+        set_int(&d, prefix, "refs", st->codec->refs);
+        set_int(&d, prefix, "scaling_matrix_present", st->codec->scaling_matrix_present);
+        set_q(&d, prefix, "codec_time_base", st->codec->time_base);
+        set_int(&d, prefix, "ticks_per_frame", st->codec->ticks_per_frame);
+        set_int(&d, prefix, "coded_width", st->codec->coded_width);
+        set_int(&d, prefix, "coded_height", st->codec->coded_height);
+        set_int(&d, prefix, "properties", st->codec->properties);
+        if (st->codec->subtitle_header_size) {
+            char *hex = av_malloc(2 * st->codec->subtitle_header_size + 1);
+            if (!hex)
+                goto end;
+            ff_data_to_hex(hex, st->codec->subtitle_header, st->codec->subtitle_header_size, 1);
+            hex[2 * st->codec->subtitle_header_size] = 0;
+            snprintf(entry, sizeof(entry), "%ssubtitle_header", prefix);
+            av_dict_set(&d, entry, hex, AV_DICT_DONT_STRDUP_VAL);
+        }
+FF_ENABLE_DEPRECATION_WARNINGS
+#endif
+    }
+
+    if (av_dict_get_string(d, &text, '=', '\n') < 0)
+        goto end;
+
+    // Write to a temporary file first so readers never see a partial entry.
+    cache_path(ic, &path, entry, sizeof(entry));
+    snprintf(tmp, sizeof(tmp), "%s.%08x", entry, av_get_random_seed());
+    fd = avpriv_open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        av_log(ic, AV_LOG_WARNING, "Cannot write probe cache entry %s\n", tmp);
+        goto end;
+    }
+    len = strlen(text);
+    if (write(fd, text, len) != len) {
+        close(fd);
+        unlink(tmp);
+        goto end;
+    }
+    close(fd);
+    if (rename(tmp, entry) < 0)
+        unlink(tmp);
+
+end:
+    av_free(text);
+    av_dict_free(&d);
+}
@@ -111,6 +111,8 @@ static int unix_read(URLContext *h, uint8_t *buf, int size)
             return ret;
     }
     ret = recv(s->fd, buf, size, 0);
+    if (!ret && s->type == SOCK_STREAM) //PLEX
+        return AVERROR_EOF;             //PLEX
     return ret < 0 ? ff_neterrno() : ret;
 }
 
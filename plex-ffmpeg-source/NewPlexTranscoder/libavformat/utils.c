@@ -3577,6 +3577,16 @@ int attribute_align_arg avformat_find_stream_info(AVFormatContext *ic, AVDiction
     int has_non_empty_video = 0;
     //PLEX
 
+    //PLEX
+    if (ic->probe_cache_dir && (ret = ff_probe_cache_load(ic))) {
+        // The cache holds what the analysis below finds; chapter ends are
+        // derived from the stream durations it restored.
+        if (ret > 0)
+            compute_chapters_end(ic);
+        return FFMIN(ret, 0);
+    }
+    //PLEX
+
     flush_codecs = probesize > 0;
 
     av_opt_set(ic, "skip_clear", "1", AV_OPT_SEARCH_CHILDREN);
@@ -4177,6 +4187,11 @@ FF_ENABLE_DEPRECATION_WARNINGS
         st->internal->avctx_inited = 0;
     }
 
+    //PLEX
+    if (ic->probe_cache_dir)
+        ff_probe_cache_store(ic);
+    //PLEX
+
 find_stream_info_err:
     // PLEX: do not discard/free info?? (see 416836c1fc36b15a2)
 #if 0
@@ -21,6 +21,7 @@
 #include "mem.h"
 #include "thread.h"
 #include "avassert.h"
+#include "trace.h" //PLEX
 
 #if HAVE_PTHREADS || HAVE_W32THREADS || HAVE_OS2THREADS
 
@@ -58,7 +59,9 @@ static int run_jobs(AVSliceThread *ctx)
     unsigned current_job  = first_job;
 
     do {
+        avpriv_trace_begin("slicethread_job", AV_NOPTS_VALUE); //PLEX
         ctx->worker_func(ctx->priv, current_job, first_job, nb_jobs, nb_active_threads);
+        avpriv_trace_end("slicethread_job", AV_NOPTS_VALUE); //PLEX
     } while ((current_job = atomic_fetch_add_explicit(&ctx->current_job, 1, memory_order_acq_rel)) < nb_jobs);
 
     return current_job == nb_jobs + nb_active_threads - 1;
@@ -18,20 +18,45 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <stdatomic.h>
+#include <string.h>
+
+#include "cpu.h"
 #include "fifo.h"
 #include "threadmessage.h"
 #include "thread.h"
 
+#define CACHE_LINE 64
+#define SPSC_SPIN  1000 ///< polls of the other side before a thread parks
+
 struct AVThreadMessageQueue {
 #if HAVE_THREADS
     AVFifoBuffer *fifo;
     pthread_mutex_t lock;
     pthread_cond_t cond_recv;
     pthread_cond_t cond_send;
-    int err_send;
-    int err_recv;
+    atomic_int err_send;
+    atomic_int err_recv;
     unsigned elsize;
     void (*free_func)(void *msg);
+
+    /* With AV_THREAD_MESSAGE_QUEUE_SPSC, the messages are kept in a ring of
+     * nelem + 1 slots instead of the fifo. Each index is only written by its
+     * own side and sits on a cache line of its own, next to the copy of the
+     * other index that side last read. The lock and the conditions are only
+     * used to park a side that found nothing to do after spinning. */
+    uint8_t *ring;
+    unsigned nb_slots;
+    int spin;
+    uint8_t pad0[CACHE_LINE];
+    atomic_uint head;           ///< next slot to write, sender only
+    unsigned tail_cache;
+    atomic_int send_waiting;
+    uint8_t pad1[CACHE_LINE];
+    atomic_uint tail;           ///< next slot to read, receiver only
+    unsigned head_cache;
+    atomic_int recv_waiting;
+    uint8_t pad2[CACHE_LINE];
 #else
     int dummy;
 #endif
@@ -40,12 +65,20 @@ struct AVThreadMessageQueue {
 int av_thread_message_queue_alloc(AVThreadMessageQueue **mq,
                                   unsigned nelem,
                                   unsigned elsize)
+{
+    return av_thread_message_queue_alloc2(mq, nelem, elsize, 0);
+}
+
+int av_thread_message_queue_alloc2(AVThreadMessageQueue **mq,
+                                   unsigned nelem,
+                                   unsigned elsize,
+                                   unsigned flags)
 {
 #if HAVE_THREADS
     AVThreadMessageQueue *rmq;
     int ret = 0;
 
-    if (nelem > INT_MAX / elsize)
+    if (nelem >= INT_MAX / elsize)
         return AVERROR(EINVAL);
     if (!(rmq = av_mallocz(sizeof(*rmq))))
         return AVERROR(ENOMEM);
@@ -64,7 +97,15 @@ int av_thread_message_queue_alloc(AVThreadMessageQueue **mq,
         av_free(rmq);
         return AVERROR(ret);
     }
-    if (!(rmq->fifo = av_fifo_alloc(elsize * nelem))) {
+    if ((flags & AV_THREAD_MESSAGE_QUEUE_SPSC)) {
+        rmq->nb_slots = nelem + 1;
+        rmq->ring = av_malloc_array(rmq->nb_slots, elsize);
+        /* spinning on a single core only delays the other side */
+        rmq->spin = av_cpu_count() > 1 ? SPSC_SPIN : 0;
+    } else {
+        rmq->fifo = av_fifo_alloc(elsize * nelem);
+    }
+    if (!rmq->fifo && !rmq->ring) {
         pthread_cond_destroy(&rmq->cond_send);
         pthread_cond_destroy(&rmq->cond_recv);
         pthread_mutex_destroy(&rmq->lock);
@@ -94,6 +135,7 @@ void av_thread_message_queue_free(AVThreadMessageQueue **mq)
     if (*mq) {
         av_thread_message_flush(*mq);
         av_fifo_freep(&(*mq)->fifo);
+        av_freep(&(*mq)->ring);
         pthread_cond_destroy(&(*mq)->cond_send);
         pthread_cond_destroy(&(*mq)->cond_recv);
         pthread_mutex_destroy(&(*mq)->lock);
@@ -138,6 +180,98 @@ static int av_thread_message_queue_recv_locked(AVThreadMessageQueue *mq,
     return 0;
 }
 
+static int spsc_can_send(AVThreadMessageQueue *mq)
+{
+    unsigned head = atomic_load_explicit(&mq->head, memory_order_relaxed);
+    unsigned tail = atomic_load(&mq->tail);
+    return (head + 1) % mq->nb_slots != tail || atomic_load(&mq->err_send);
+}
+
+static int spsc_can_recv(AVThreadMessageQueue *mq)
+{
+    unsigned tail = atomic_load_explicit(&mq->tail, memory_order_relaxed);
+    return atomic_load(&mq->head) != tail || atomic_load(&mq->err_recv);
+}
+
+/* The waiting flag is set before the index of the other side is read again
+ * under the lock, and the other side reads the flag after storing its index,
+ * so either the parking side sees the new index or the other side sees the
+ * flag and signals. */
+static void spsc_park(AVThreadMessageQueue *mq, atomic_int *waiting,
+                      pthread_cond_t *cond, int (*ready)(AVThreadMessageQueue *mq))
+{
+    pthread_mutex_lock(&mq->lock);
+    atomic_store(waiting, 1);
+    while (!ready(mq))
+        pthread_cond_wait(cond, &mq->lock);
+    atomic_store(waiting, 0);
+    pthread_mutex_unlock(&mq->lock);
+}
+
+static void spsc_wake(AVThreadMessageQueue *mq, atomic_int *waiting,
+                      pthread_cond_t *cond)
+{
+    if (!atomic_load(waiting))
+        return;
+    pthread_mutex_lock(&mq->lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&mq->lock);
+}
+
+static int spsc_send(AVThreadMessageQueue *mq, void *msg, unsigned flags)
+{
+    unsigned head = atomic_load_explicit(&mq->head, memory_order_relaxed);
+    unsigned next = (head + 1) % mq->nb_slots;
+    int spin = mq->spin;
+    int err;
+
+    while (1) {
+        if ((err = atomic_load_explicit(&mq->err_send, memory_order_acquire)))
+            return err;
+        if (next != mq->tail_cache)
+            break;
+        mq->tail_cache = atomic_load_explicit(&mq->tail, memory_order_acquire);
+        if (next != mq->tail_cache)
+            continue;
+        if ((flags & AV_THREAD_MESSAGE_NONBLOCK))
+            return AVERROR(EAGAIN);
+        if (spin-- <= 0)
+            spsc_park(mq, &mq->send_waiting, &mq->cond_send, spsc_can_send);
+    }
+    memcpy(mq->ring + head * mq->elsize, msg, mq->elsize);
+    atomic_store(&mq->head, next);
+    spsc_wake(mq, &mq->recv_waiting, &mq->cond_recv);
+    return 0;
+}
+
+static int spsc_recv(AVThreadMessageQueue *mq, void *msg, unsigned flags)
+{
+    unsigned tail = atomic_load_explicit(&mq->tail, memory_order_relaxed);
+    int spin = mq->spin;
+    int err;
+
+    while (tail == mq->head_cache) {
+        mq->head_cache = atomic_load_explicit(&mq->head, memory_order_acquire);
+        if (tail != mq->head_cache)
+            break;
+        /* the sender may have queued a message right before the error */
+        if ((err = atomic_load_explicit(&mq->err_recv, memory_order_acquire))) {
+            mq->head_cache = atomic_load_explicit(&mq->head, memory_order_acquire);
+            if (tail != mq->head_cache)
+                break;
+            return err;
+        }
+        if ((flags & AV_THREAD_MESSAGE_NONBLOCK))
+            return AVERROR(EAGAIN);
+        if (spin-- <= 0)
+            spsc_park(mq, &mq->recv_waiting, &mq->cond_recv, spsc_can_recv);
+    }
+    memcpy(msg, mq->ring + tail * mq->elsize, mq->elsize);
+    atomic_store(&mq->tail, (tail + 1) % mq->nb_slots);
+    spsc_wake(mq, &mq->send_waiting, &mq->cond_send);
+    return 0;
+}
+
 #endif /* HAVE_THREADS */
 
 int av_thread_message_queue_send(AVThreadMessageQueue *mq,
@@ -147,6 +281,8 @@ int av_thread_message_queue_send(AVThreadMessageQueue *mq,
 #if HAVE_THREADS
     int ret;
 
+    if (mq->ring)
+        return spsc_send(mq, msg, flags);
     pthread_mutex_lock(&mq->lock);
     ret = av_thread_message_queue_send_locked(mq, msg, flags);
     pthread_mutex_unlock(&mq->lock);
@@ -163,6 +299,8 @@ int av_thread_message_queue_recv(AVThreadMessageQueue *mq,
 #if HAVE_THREADS
     int ret;
 
+    if (mq->ring)
+        return spsc_recv(mq, msg, flags);
     pthread_mutex_lock(&mq->lock);
     ret = av_thread_message_queue_recv_locked(mq, msg, flags);
     pthread_mutex_unlock(&mq->lock);
@@ -202,12 +340,41 @@ static void free_func_wrap(void *arg, void *msg, int size)
 }
 #endif
 
+int av_thread_message_queue_nb_elems(AVThreadMessageQueue *mq)
+{
+#if HAVE_THREADS
+    int ret;
+    if (mq->ring) {
+        unsigned tail = atomic_load(&mq->tail);
+        return (atomic_load(&mq->head) + mq->nb_slots - tail) % mq->nb_slots;
+    }
+    pthread_mutex_lock(&mq->lock);
+    ret = av_fifo_size(mq->fifo);
+    pthread_mutex_unlock(&mq->lock);
+    return ret / mq->elsize;
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
+
 void av_thread_message_flush(AVThreadMessageQueue *mq)
 {
 #if HAVE_THREADS
     int used, off;
     void *free_func = mq->free_func;
 
+    if (mq->ring) {
+        unsigned tail = atomic_load_explicit(&mq->tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&mq->head, memory_order_acquire);
+
+        if (free_func)
+            for (; tail != head; tail = (tail + 1) % mq->nb_slots)
+                mq->free_func(mq->ring + tail * mq->elsize);
+        atomic_store(&mq->tail, head);
+        spsc_wake(mq, &mq->send_waiting, &mq->cond_send);
+        return;
+    }
+
     pthread_mutex_lock(&mq->lock);
     used = av_fifo_size(mq->fifo);
     if (free_func)
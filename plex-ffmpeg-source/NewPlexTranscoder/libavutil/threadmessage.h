@@ -32,6 +32,19 @@ typedef enum AVThreadMessageFlags {
 
 } AVThreadMessageFlags;
 
+typedef enum AVThreadMessageQueueFlags {
+
+    /**
+     * Only one thread sends and only one thread receives.
+     * The messages are then passed through a lock-free ring, and a side
+     * waiting for the other spins for a while before sleeping, so the lock
+     * is only taken to sleep or wake up. av_thread_message_flush() must be
+     * called from the receiving thread.
+     */
+    AV_THREAD_MESSAGE_QUEUE_SPSC = 1,
+
+} AVThreadMessageQueueFlags;
+
 /**
  * Allocate a new message queue.
  *
@@ -45,6 +58,17 @@ int av_thread_message_queue_alloc(AVThreadMessageQueue **mq,
                                   unsigned nelem,
                                   unsigned elsize);
 
+/**
+ * Allocate a new message queue.
+ *
+ * Same as av_thread_message_queue_alloc(), with flags a combination of
+ * AVThreadMessageQueueFlags.
+ */
+int av_thread_message_queue_alloc2(AVThreadMessageQueue **mq,
+                                   unsigned nelem,
+                                   unsigned elsize,
+                                   unsigned flags);
+
 /**
  * Free a message queue.
  *
@@ -95,6 +119,14 @@ void av_thread_message_queue_set_err_recv(AVThreadMessageQueue *mq,
 void av_thread_message_queue_set_free_func(AVThreadMessageQueue *mq,
                                            void (*free_func)(void *msg));
 
+/**
+ * Return the current number of messages in the queue.
+ *
+ * @return the current number of messages or AVERROR(ENOSYS) if lavu was built
+ *         without thread support
+ */
+int av_thread_message_queue_nb_elems(AVThreadMessageQueue *mq);
+
 /**
  * Flush the message queue
  *
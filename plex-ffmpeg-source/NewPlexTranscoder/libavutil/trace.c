@@ -0,0 +1,239 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "avutil.h"
+#include "error.h"
+#include "mem.h"
+#include "thread.h"
+#include "time.h"
+#include "trace.h"
+
+#define TRACE_CHUNK_EVENTS 4096
+#define TRACE_MAX_CHUNKS    256 ///< per thread, so at most ~1M events each
+
+typedef struct TraceEvent {
+    const char *name;
+    int64_t ts;
+    int64_t pts;
+    char phase;
+} TraceEvent;
+
+typedef struct TraceChunk {
+    TraceEvent events[TRACE_CHUNK_EVENTS];
+    int nb_events;
+    struct TraceChunk *next;
+} TraceChunk;
+
+typedef struct TraceBuffer {
+    TraceChunk *first, *last;
+    TraceChunk *cur;        ///< chunk the next event goes to
+    int nb_chunks;
+    int nb_free;            ///< allocated events not used yet
+    int depth;              ///< recorded spans not closed yet
+    int dropped_depth;      ///< dropped spans not closed yet
+    int nb_dropped;
+    int tid;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+static atomic_int trace_active = ATOMIC_VAR_INIT(0);
+static int trace_written;
+static int64_t trace_epoch;
+
+#if HAVE_PTHREADS
+static AVMutex trace_lock = AV_MUTEX_INITIALIZER;
+static TraceBuffer *trace_buffers;
+static int trace_nb_threads;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static void make_key(void)
+{
+    pthread_key_create(&trace_key, NULL);
+}
+
+static TraceBuffer *get_buffer(void)
+{
+    TraceBuffer *b;
+
+    pthread_once(&trace_once, make_key);
+    if ((b = pthread_getspecific(trace_key)))
+        return b;
+
+    // Buffers outlive their threads; they are freed after being written.
+    if (!(b = av_mallocz(sizeof(*b))))
+        return NULL;
+    ff_mutex_lock(&trace_lock);
+    b->tid  = ++trace_nb_threads;
+    b->next = trace_buffers;
+    trace_buffers = b;
+    ff_mutex_unlock(&trace_lock);
+    pthread_setspecific(trace_key, b);
+    return b;
+}
+
+// Make sure the allocated chunks have room for n more events.
+static int reserve_events(TraceBuffer *b, int n)
+{
+    while (b->nb_free < n) {
+        TraceChunk *c;
+        if (b->nb_chunks == TRACE_MAX_CHUNKS || !(c = av_mallocz(sizeof(*c))))
+            return 0;
+        if (b->last)
+            b->last->next = c;
+        else
+            b->first = b->cur = c;
+        b->last = c;
+        b->nb_chunks++;
+        b->nb_free += TRACE_CHUNK_EVENTS;
+    }
+    return 1;
+}
+
+static void trace_event(char phase, const char *name, int64_t pts)
+{
+    TraceBuffer *b;
+    TraceChunk *c;
+    TraceEvent *e;
+
+    if (!atomic_load_explicit(&trace_active, memory_order_relaxed) ||
+        !(b = get_buffer()))
+        return;
+
+    // A span is only begun if room for its end and the ends of all spans it
+    // is nested in is kept, and spans inside a dropped one are dropped too,
+    // so every recorded 'B' gets its 'E'.
+    if (phase == 'B') {
+        if (b->dropped_depth || !reserve_events(b, b->depth + 2)) {
+            b->dropped_depth++;
+            b->nb_dropped++;
+            return;
+        }
+        b->depth++;
+    } else if (b->dropped_depth) {
+        b->dropped_depth--;
+        b->nb_dropped++;
+        return;
+    } else if (b->depth) {
+        b->depth--;
+    } else if (!reserve_events(b, 1)) {
+        b->nb_dropped++;
+        return;
+    }
+
+    c = b->cur;
+    if (c->nb_events == TRACE_CHUNK_EVENTS)
+        c = b->cur = c->next;
+    b->nb_free--;
+
+    e = &c->events[c->nb_events++];
+    e->name  = name;
+    e->ts    = av_gettime_relative();
+    e->pts   = pts;
+    e->phase = phase;
+}
+#endif
+
+int avpriv_trace_start(void)
+{
+#if HAVE_PTHREADS
+    if (trace_written)
+        return AVERROR(EINVAL);
+    trace_epoch = av_gettime_relative();
+    atomic_store(&trace_active, 1);
+    return 0;
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
+
+void avpriv_trace_begin(const char *name, int64_t pts)
+{
+#if HAVE_PTHREADS
+    trace_event('B', name, pts);
+#endif
+}
+
+void avpriv_trace_end(const char *name, int64_t pts)
+{
+#if HAVE_PTHREADS
+    trace_event('E', name, pts);
+#endif
+}
+
+int avpriv_trace_write(const char *filename)
+{
+#if HAVE_PTHREADS
+    TraceBuffer *b, *next_b;
+    TraceChunk *c, *next_c;
+    FILE *f;
+    int i, first = 1, ret = 0;
+
+    atomic_store(&trace_active, 0);
+    trace_written = 1;
+
+    if (!(f = av_fopen_utf8(filename, "w")))
+        ret = AVERROR(errno);
+    if (f)
+        fprintf(f, "{\"traceEvents\":[\n");
+
+    ff_mutex_lock(&trace_lock);
+    for (b = trace_buffers; b; b = next_b) {
+        for (c = b->first; c; c = next_c) {
+            for (i = 0; f && i < c->nb_events; i++) {
+                const TraceEvent *e = &c->events[i];
+                fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%"PRId64",\"pid\":1,\"tid\":%d",
+                        first ? "" : ",\n", e->name, e->phase, e->ts - trace_epoch, b->tid);
+                if (e->pts != AV_NOPTS_VALUE)
+                    fprintf(f, ",\"args\":{\"pts\":%"PRId64"}", e->pts);
+                fputc('}', f);
+                first = 0;
+            }
+            next_c = c->next;
+            av_free(c);
+        }
+        if (b->nb_dropped) {
+            av_log(NULL, AV_LOG_WARNING, "Trace buffer of thread %d full, %d events dropped\n",
+                   b->tid, b->nb_dropped);
+            if (f)
+                fprintf(f, "%s{\"name\":\"trace buffer full\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%"PRId64",\"pid\":1,\"tid\":%d,\"args\":{\"dropped\":%d}}",
+                        first ? "" : ",\n", av_gettime_relative() - trace_epoch, b->tid, b->nb_dropped);
+            first = 0;
+        }
+        next_b = b->next;
+        av_free(b);
+    }
+    trace_buffers = NULL;
+    ff_mutex_unlock(&trace_lock);
+
+    if (f) {
+        fprintf(f, "\n]}\n");
+        if (fclose(f))
+            ret = AVERROR(errno);
+    }
+    return ret;
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVUTIL_TRACE_H
+#define AVUTIL_TRACE_H
+
+#include <stdint.h>
+
+/**
+ * @file
+ * Recording of begin/end events for the Chrome trace-event format.
+ *
+ * Every thread appends to a buffer of its own, so recording takes no locks.
+ * The buffers are only read by avpriv_trace_write(), which must not run
+ * before the traced threads are done.
+ */
+
+/**
+ * Start recording events.
+ * @return 0 on success, AVERROR(ENOSYS) if tracing is unsupported, or
+ *         AVERROR(EINVAL) if the trace was already written
+ */
+int avpriv_trace_start(void);
+
+/**
+ * Record the start or end of a span on the calling thread. Spans nest.
+ * @param name static string naming the span
+ * @param pts  timestamp of the frame or packet worked on, or AV_NOPTS_VALUE
+ */
+void avpriv_trace_begin(const char *name, int64_t pts);
+void avpriv_trace_end(const char *name, int64_t pts);
+
+/**
+ * Stop recording, write all events to filename as a JSON trace and free
+ * them. Recording cannot be started again afterwards.
+ */
+int avpriv_trace_write(const char *filename);
+
+#endif /* AVUTIL_TRACE_H */
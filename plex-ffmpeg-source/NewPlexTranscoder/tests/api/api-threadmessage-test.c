@@ -27,6 +27,7 @@
 #include "libavutil/frame.h"
 #include "libavutil/threadmessage.h"
 #include "libavutil/thread.h" // not public
+#include "libavutil/time.h"
 
 struct sender_data {
     int id;
@@ -154,6 +155,59 @@ static void *receiver_thread(void *arg)
     return NULL;
 }
 
+struct bench_data {
+    AVThreadMessageQueue *queue;
+    int nb_messages;
+};
+
+static void *bench_sender_thread(void *arg)
+{
+    int i, ret = 0;
+    struct bench_data *bd = arg;
+
+    for (i = 0; i < bd->nb_messages && ret >= 0; i++) {
+        struct message msg = { .magic = i };
+        ret = av_thread_message_queue_send(bd->queue, &msg, 0);
+    }
+    av_thread_message_queue_set_err_recv(bd->queue, ret < 0 ? ret : AVERROR_EOF);
+    return NULL;
+}
+
+/* pass small messages from one thread to another as fast as possible */
+static int bench(int queue_size, int nb_messages, unsigned flags, const char *mode)
+{
+    int i = 0, ret;
+    int64_t t;
+    pthread_t tid;
+    struct message msg;
+    struct bench_data bd = { .nb_messages = nb_messages };
+
+    ret = av_thread_message_queue_alloc2(&bd.queue, queue_size, sizeof(msg), flags);
+    if (ret < 0)
+        return ret;
+
+    t = av_gettime_relative();
+    ret = pthread_create(&tid, NULL, bench_sender_thread, &bd);
+    if (ret) {
+        av_thread_message_queue_free(&bd.queue);
+        return AVERROR(ret);
+    }
+    while ((ret = av_thread_message_queue_recv(bd.queue, &msg, 0)) >= 0) {
+        av_assert0(msg.magic == i);
+        i++;
+    }
+    pthread_join(tid, NULL);
+    t = av_gettime_relative() - t;
+    av_thread_message_queue_free(&bd.queue);
+
+    if (ret != AVERROR_EOF)
+        return ret;
+    av_assert0(i == nb_messages);
+    av_log(NULL, AV_LOG_INFO, "%-6s qsize:%d %d messages in %"PRId64" us (%.0f/s)\n",
+           mode, queue_size, nb_messages, t, nb_messages * 1000000.0 / FFMAX(t, 1));
+    return 0;
+}
+
 static int get_workload(int minv, int maxv)
 {
     return maxv == minv ? maxv : rand() % (maxv - minv) + minv;
@@ -169,10 +223,27 @@ int main(int ac, char **av)
     struct receiver_data *receivers;
     AVThreadMessageQueue *queue = NULL;
 
+    if (ac == 4 && !strcmp(av[1], "-bench")) {
+        int nb_messages = atoi(av[3]);
+
+        max_queue_size = atoi(av[2]);
+        if (max_queue_size <= 0 || nb_messages <= 0) {
+            av_log(NULL, AV_LOG_ERROR, "negative values not allowed\n");
+            return 1;
+        }
+        if ((ret = bench(max_queue_size, nb_messages, 0, "locked")) < 0 ||
+            (ret = bench(max_queue_size, nb_messages, AV_THREAD_MESSAGE_QUEUE_SPSC, "spsc")) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error: %s\n", av_err2str(ret));
+            return 1;
+        }
+        return 0;
+    }
+
     if (ac != 8) {
         av_log(NULL, AV_LOG_ERROR, "%s <max_queue_size> "
                "<nb_senders> <sender_min_send> <sender_max_send> "
-               "<nb_receivers> <receiver_min_recv> <receiver_max_recv>\n", av[0]);
+               "<nb_receivers> <receiver_min_recv> <receiver_max_recv>\n"
+               "%s -bench <max_queue_size> <nb_messages>\n", av[0], av[0]);
         return 1;
     }
 
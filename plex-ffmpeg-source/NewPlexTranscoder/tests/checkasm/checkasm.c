@@ -149,6 +149,7 @@ static const struct {
     #endif
 #endif
 #if CONFIG_AVFILTER
+        { "drawutils", checkasm_check_drawutils },
     #if CONFIG_BLEND_FILTER
         { "vf_blend", checkasm_check_blend },
     #endif
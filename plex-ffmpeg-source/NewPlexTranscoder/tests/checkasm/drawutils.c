@@ -0,0 +1,95 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with FFmpeg; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+#include "checkasm.h"
+#include "libavfilter/drawutils.h"
+#include "libavutil/intreadwrite.h"
+
+#define WIDTH 64
+
+#define randomize_buffers(buf, size)     \
+    do {                                 \
+       int j;                            \
+       uint8_t *tmp_buf = (uint8_t *)buf;\
+       for (j = 0; j < size; j++)        \
+           tmp_buf[j] = rnd() & 0xFF;    \
+    } while (0)
+
+static void check_blend_row(int depth, int sub)
+{
+    /* The callers round widths down to blend_row_block and blend the rest in
+     * C, so widths below the block give 0. Every other width starts one
+     * sample off alignment. */
+    static const int widths[] = { 1, 2, 3, 4, 5, 7, 8, 9, 13, 16, 17, 31, 33, 47, 63, WIDTH };
+    LOCAL_ALIGNED_32(uint8_t, mask   , [4 * WIDTH]);
+    LOCAL_ALIGNED_32(uint8_t, dst_ref, [2 * WIDTH + 2]);
+    LOCAL_ALIGNED_32(uint8_t, dst_new, [2 * WIDTH + 2]);
+    ptrdiff_t mask_linesize = 2 * WIDTH;
+    int bytes = depth > 8 ? 2 : 1;
+    unsigned src = 0, alpha = 0;
+    int i, k;
+
+    declare_func(void, uint8_t *dst, const uint8_t *mask, ptrdiff_t mask_linesize,
+                 int w, unsigned src, unsigned alpha);
+
+    FFDrawContext draw;
+    if (ff_draw_init(&draw, depth > 8 ? AV_PIX_FMT_YUV420P10LE : AV_PIX_FMT_YUV420P, 0) < 0)
+        fail();
+
+    if (check_func(draw.blend_row[depth > 8][sub], "blend_row%d%s",
+                   depth > 8 ? 16 : 8, sub ? "_sub" : "")) {
+        for (k = 0; k < FF_ARRAY_ELEMS(widths); k++) {
+            int w   = widths[k] / draw.blend_row_block * draw.blend_row_block;
+            int off = (k & 1) * bytes;
+            unsigned a = rnd() & 0xFF;
+
+            randomize_buffers(mask, 4 * WIDTH);
+            randomize_buffers(dst_ref, 2 * WIDTH + 2);
+            if (depth > 8) {
+                /* alpha and src as ff_blend_mask() passes them */
+                for (i = 0; i < WIDTH + 1; i++)
+                    AV_WL16(dst_ref + 2 * i, AV_RL16(dst_ref + 2 * i) & 0x3FF);
+                src   = rnd() & 0x3FF;
+                alpha = (0x101 * a + 0x2) >> 8;
+            } else {
+                src   = rnd() & 0xFF;
+                alpha = (0x10307 * a + 0x3) >> 8;
+            }
+            memcpy(dst_new, dst_ref, 2 * WIDTH + 2);
+
+            call_ref(dst_ref + off, mask, mask_linesize, w, src, alpha);
+            call_new(dst_new + off, mask, mask_linesize, w, src, alpha);
+            /* also catches writes past w */
+            if (memcmp(dst_ref, dst_new, 2 * WIDTH + 2))
+                fail();
+        }
+        bench_new(dst_new, mask, mask_linesize, WIDTH, src, alpha);
+    }
+}
+
+void checkasm_check_drawutils(void)
+{
+    check_blend_row(8, 0);
+    check_blend_row(8, 1);
+    report("blend_row8");
+
+    check_blend_row(10, 0);
+    check_blend_row(10, 1);
+    report("blend_row16");
+}
@@ -30,6 +30,11 @@ fate-api-threadmessage: $(APITESTSDIR)/api-threadmessage-test$(EXESUF)
 fate-api-threadmessage: CMD = run $(APITESTSDIR)/api-threadmessage-test 3 10 30 50 2 20 40
 fate-api-threadmessage: CMP = null
 
+FATE_API-$(HAVE_THREADS) += fate-api-threadmessage-bench
+fate-api-threadmessage-bench: $(APITESTSDIR)/api-threadmessage-test$(EXESUF)
+fate-api-threadmessage-bench: CMD = run $(APITESTSDIR)/api-threadmessage-test -bench 16 100000
+fate-api-threadmessage-bench: CMP = null
+
 FATE_API_SAMPLES-$(CONFIG_AVFORMAT) += $(FATE_API_SAMPLES_LIBAVFORMAT-yes)
 
 ifdef SAMPLES